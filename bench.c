@@ -0,0 +1,238 @@
+#include <stdio.h>
+
+#define DMON_IMPL
+#include "dmon.h"
+#include "dmon_extra.h"
+
+#if DMON_OS_INOTIFY
+#include "test_util.h"
+
+static volatile int bench_sink;
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t bench_rand(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void bench_make_tree(const char* dirname, int depth, int fanout)
+{
+    char path[DMON_MAX_PATH];
+    int i;
+    for (i = 0; i < fanout; i++) {
+        snprintf(path, sizeof(path), "%s/%d", dirname, i);
+        mkdir(path, 0755);
+        if (depth > 1) {
+            bench_make_tree(path, depth - 1, fanout);
+        }
+    }
+}
+
+static void bench_watch_cb(dmon_watch_id watch_id, dmon_action action, const char* rootdir,
+                           const char* filepath, const char* oldfilepath, void* user)
+{
+    _DMON_UNUSED(watch_id); _DMON_UNUSED(action); _DMON_UNUSED(rootdir);
+    _DMON_UNUSED(filepath); _DMON_UNUSED(oldfilepath); _DMON_UNUSED(user);
+}
+
+// wd -> subdir lookups of real watches, the way the inotify read loop resolves every incoming event: wd_tbl, the
+// refs of the wd, then the path of the directory in the tree of the watch. the overlapped column has a second watch
+// of the same tree, so every wd has two refs
+static void bench_wd_lookup(void)
+{
+    static const int trees[][2] = { { 2, 16 }, { 3, 16 }, { 4, 10 } };    // depth, fanout
+    int i;
+
+    puts("wd lookup (ns/lookup):");
+    puts("    dirs       find_wd_ref  +path      overlapped");
+    for (i = 0; i < (int)(sizeof(trees) / sizeof(trees[0])); i++) {
+        char rootdir[] = "/tmp/dmon_bench_XXXXXX";
+        if (mkdtemp(rootdir) == NULL) {
+            puts("wd lookup: could not create temp directory");
+            return;
+        }
+        bench_make_tree(rootdir, trees[i][0], trees[i][1]);
+
+        dmon_init();
+        dmon_watch_id id = dmon_watch(rootdir, bench_watch_cb, DMON_WATCHFLAGS_RECURSIVE, NULL);
+
+        pthread_mutex_lock(&_dmon_default.mutex);
+        dmon__watch_state* watch = _dmon_get_watch(&_dmon_default, id);
+        int watch_index = _dmon_watch_index(id);
+        int* wds = NULL;
+        int k;
+        for (k = 0; k < stb_sb_count(watch->subdirs); k++) {
+            if (watch->subdirs[k].wd >= 0) {
+                stb_sb_push(wds, watch->subdirs[k].wd);
+            }
+        }
+        int num_dirs = stb_sb_count(wds);
+
+        uint32_t seed = 0x9e3779b9;
+        int num_lookups = 1 << 20;
+        int sum = 0;
+        uint64_t start = bench_now_ns();
+        for (k = 0; k < num_lookups; k++) {
+            sum += _dmon_find_wd_ref(&_dmon_default, wds[bench_rand(&seed) % num_dirs], watch_index);
+        }
+        double find_ns = (double)(bench_now_ns() - start) / num_lookups;
+
+        char reldir[DMON_MAX_PATH];
+        start = bench_now_ns();
+        for (k = 0; k < num_lookups; k++) {
+            int r = _dmon_find_wd_ref(&_dmon_default, wds[bench_rand(&seed) % num_dirs], watch_index);
+            _dmon_subdir_path(watch, _dmon_default.wd_refs[r].subdir, reldir, sizeof(reldir));
+            sum += reldir[0];
+        }
+        double path_ns = (double)(bench_now_ns() - start) / num_lookups;
+        pthread_mutex_unlock(&_dmon_default.mutex);
+
+        // the refs of the second watch are in front of the chains, the first watch is found after them
+        dmon_watch_id id2 = dmon_watch(rootdir, bench_watch_cb, DMON_WATCHFLAGS_RECURSIVE, NULL);
+        pthread_mutex_lock(&_dmon_default.mutex);
+        start = bench_now_ns();
+        for (k = 0; k < num_lookups; k++) {
+            sum += _dmon_find_wd_ref(&_dmon_default, wds[bench_rand(&seed) % num_dirs], watch_index);
+        }
+        double overlap_ns = (double)(bench_now_ns() - start) / num_lookups;
+        pthread_mutex_unlock(&_dmon_default.mutex);
+
+        bench_sink = sum;
+        printf("    %-10d %-12.1f %-10.1f %.1f\n", num_dirs, find_ns, path_ns, overlap_ns);
+
+        stb_sb_free(wds);
+        dmon_unwatch(id2);
+        dmon_unwatch(id);
+        dmon_deinit();
+        test_remove_tree(rootdir);
+    }
+}
+
+typedef struct bench_path {
+    char path[DMON_MAX_PATH];
+} bench_path;
+
+static void bench_list_dirs(const char* dirname, bench_path** dirs)
+{
+    struct dirent* entry;
+    DIR* dir = opendir(dirname);
+    bench_path* p = stb_sb_add(*dirs, 1);
+    _dmon_strcpy(p->path, sizeof(p->path), dirname);
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            char path[DMON_MAX_PATH];
+            snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
+            bench_list_dirs(path, dirs);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+}
+
+// initial crawl of a recursive watch with different number of crawler threads
+// inotify_add_watch is serialized by the kernel for each inotify instance, the "add_watch only" line is the part of
+// the crawl that can't be spread over the threads
+static void bench_crawl(void)
+{
+    static const int thread_counts[] = { 1, 2, 4, 8 };
+    char rootdir[] = "/tmp/dmon_bench_XXXXXX";
+    if (mkdtemp(rootdir) == NULL) {
+        puts("crawl: could not create temp directory");
+        return;
+    }
+    bench_make_tree(rootdir, 3, 16);
+
+    puts("crawl 4368 dirs (ms):");
+    puts("    threads    time");
+    dmon_init();
+    int i;
+    for (i = 0; i < (int)(sizeof(thread_counts) / sizeof(thread_counts[0])); i++) {
+        dmon_set_crawl_threads(thread_counts[i]);
+        uint64_t start = bench_now_ns();
+        dmon_watch_id id = dmon_watch(rootdir, bench_watch_cb, DMON_WATCHFLAGS_RECURSIVE, NULL);
+        double ms = (double)(bench_now_ns() - start) / 1000000.0;
+        dmon_stats stats;
+        dmon_get_stats(id, &stats);
+        dmon_unwatch(id);
+
+        printf("    %-10d %.2f%s\n", thread_counts[i], ms, stats.dirs_registered == 4369 ? "" : " (missing dirs)");
+    }
+    dmon_deinit();
+
+    bench_path* dirs = NULL;
+    bench_list_dirs(rootdir, &dirs);
+    int fd = inotify_init1(IN_CLOEXEC);
+    uint64_t start = bench_now_ns();
+    for (i = 0; i < stb_sb_count(dirs); i++) {
+        inotify_add_watch(fd, dirs[i].path, _dmon_inotify_mask(DMON_ACTIONMASK_DEFAULT, false));
+    }
+    printf("    add_watch only %.2f\n", (double)(bench_now_ns() - start) / 1000000.0);
+    close(fd);
+    stb_sb_free(dirs);
+
+    test_remove_tree(rootdir);
+}
+
+// warm start of a recursive watch from an index file, against crawling the tree again
+static void bench_restore(void)
+{
+    char rootdir[] = "/tmp/dmon_bench_XXXXXX";
+    if (mkdtemp(rootdir) == NULL) {
+        puts("restore: could not create temp directory");
+        return;
+    }
+    bench_make_tree(rootdir, 3, 16);
+    char indexfile[DMON_MAX_PATH];
+    snprintf(indexfile, sizeof(indexfile), "%s.index", rootdir);
+    uint32_t flags = DMON_WATCHFLAGS_RECURSIVE | DMON_WATCHFLAGS_SNAPSHOT;
+
+    dmon_init();
+    uint64_t start = bench_now_ns();
+    dmon_watch_id id = dmon_watch(rootdir, bench_watch_cb, flags, NULL);
+    double crawl_ms = (double)(bench_now_ns() - start) / 1000000.0;
+    dmon_watch_save(id, indexfile);
+    dmon_deinit();
+
+    // the index is only trusted for directories that are not modified right before the save
+    sleep(1);
+    dmon_init();
+    id = dmon_watch(rootdir, bench_watch_cb, flags, NULL);
+    dmon_watch_save(id, indexfile);
+    dmon_deinit();
+
+    dmon_init();
+    start = bench_now_ns();
+    dmon_watch_restore(rootdir, bench_watch_cb, flags, NULL, indexfile, NULL);
+    double restore_ms = (double)(bench_now_ns() - start) / 1000000.0;
+    dmon_deinit();
+
+    puts("watch 4368 dirs (ms):");
+    printf("    crawl      %.2f\n", crawl_ms);
+    printf("    restore    %.2f\n", restore_ms);
+
+    unlink(indexfile);
+    test_remove_tree(rootdir);
+}
+#endif // DMON_OS_INOTIFY
+
+int main(void)
+{
+#if DMON_OS_INOTIFY
+    bench_wd_lookup();
+    bench_crawl();
+    bench_restore();
+#else
+    puts("benchmarks are only implemented for the inotify backend");
+#endif
+    return 0;
+}
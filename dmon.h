@@ -31,7 +31,12 @@
 //              user_data: user pointer that is passed to callback function
 //          Returns the Id of the watched directory after successful call, or returns Id=0 if error
 //      dmon_unwatch:
-//          Remove the directory from watch list
+//          Remove the directory from watch list. On linux, ids of removed watches are ignored
+//      dmon_context_create/dmon_context_destroy:
+//          Independent instances of dmon, each one with it's own monitoring thread, lock and events. The functions
+//          above use the default context (dmon_init/dmon_deinit), dmon_context_watch and dmon_context_unwatch take
+//          a context. Watch ids are only valid in their own context, so callbacks must call the functions of
+//          their own context. A context can't be destroyed from it's own callbacks
 //
 //      see test.c for the basic example
 //
@@ -57,11 +62,30 @@
 //          Maximum size of path characters
 //          default is 260 characters
 //      DMON_MAX_WATCHES
-//          Maximum number of watch directories
-//          default is 64
+//          Maximum number of watch directories (Windows and MacOS backends)
+//          default is 64. The inotify backend grows it's watch table as needed, up to 65535 watches
 //      DMON_SLEEP_INTERVAL
 //          Number of milliseconds to pause between polling for file changes
-//          default is 10 ms
+//          default is 10 ms. The inotify backend does not poll, it sleeps until there are new events
+//      DMON_CRAWL_THREADS
+//          Number of threads that crawl the directory tree of recursive watches (inotify backend)
+//          default is 1, which crawls on the calling thread only. It can be changed at runtime for each context
+//          with dmon_set_crawl_threads (dmon_extra.h)
+//      DMON_POLL_INTERVAL
+//          Number of milliseconds between the checks of DMON_WATCHFLAGS_POLL watches (inotify backend)
+//          default is 1000 ms
+//      DMON_POLL_BUDGET
+//          Maximum number of entries that are stat'ed for each DMON_WATCHFLAGS_POLL watch in every check
+//          default is 16384. Directories are checked first and only the modified ones are read again, files are
+//          checked in slices that continue on the next check, with at least a quarter of the budget
+//      DMON_CALLBACK_THREADS
+//          Number of threads that call the watch callbacks (inotify backend)
+//          default is 0, which calls them on the monitor thread with the lock held, so a slow callback holds up the
+//          events of all the watches. With a pool, the callbacks of every watch are still called one at a time and in
+//          order, different watches are called in parallel, and dmon_unwatch waits for the running callbacks
+//      DMON_QUEUE_SIZE
+//          Number of events that the queue of dmon_poll_events/dmon_wait_events can hold, must be a power of two
+//          default is 1024 (inotify backend). Events are dropped when the queue is full
 //
 // TODO:
 //      - DMON_WATCHFLAGS_FOLLOW_SYMLINKS does not resolve files
@@ -100,13 +124,29 @@
 #   define DMON_API_IMPL
 #endif
 
+#ifndef DMON_MAX_PATH
+#   define DMON_MAX_PATH 260
+#endif
+
+// ids of the inotify backend are the slot of the watch (low 16 bits, up to 65535 watches at a time) and the number
+// of times the slot was freed (high 16 bits), so the ids of removed watches are rejected. the count wraps after 65536
+// reuses of the same slot, then an old id refers to the new watch in the slot again
 typedef struct { uint32_t id; } dmon_watch_id;
 
 // Pass these flags to `dmon_watch`
 typedef enum dmon_watch_flags_t {
     DMON_WATCHFLAGS_RECURSIVE = 0x1,            // monitor all child directories
     DMON_WATCHFLAGS_FOLLOW_SYMLINKS = 0x2,      // resolve symlinks (linux only)
-    DMON_WATCHFLAGS_OUTOFSCOPE_LINKS = 0x4      // TODO: not implemented yet
+    DMON_WATCHFLAGS_OUTOFSCOPE_LINKS = 0x4,     // TODO: not implemented yet
+    DMON_WATCHFLAGS_FANOTIFY = 0x8,             // watch the file system with fanotify instead of one inotify watch per
+                                                // directory (linux 5.9+, needs CAP_SYS_ADMIN). falls back to inotify
+    DMON_WATCHFLAGS_SNAPSHOT = 0x10,            // keep every file with it's size and mtime in memory, so rescans only
+                                                // report the files that are actually changed. otherwise only the
+                                                // directories are kept (linux only)
+    DMON_WATCHFLAGS_POLL = 0x20,                // find the changes by polling the directories with stat instead of
+                                                // inotify, for NFS, CIFS and FUSE mounts (linux only)
+    DMON_WATCHFLAGS_CLOSE_WRITE = 0x40          // report DMON_ACTION_CLOSE_WRITE once a file is closed, instead of
+                                                // DMON_ACTION_MODIFY for every write (linux only)
 } dmon_watch_flags;
 
 // Action is what operation performed on the file. this value is provided by watch callback
@@ -114,9 +154,64 @@ typedef enum dmon_action_t {
     DMON_ACTION_CREATE = 1,
     DMON_ACTION_DELETE,
     DMON_ACTION_MODIFY,
-    DMON_ACTION_MOVE
+    DMON_ACTION_MOVE,
+    DMON_ACTION_OVERFLOW,   // events are lost (queue overflow), the changes are found by a rescan and reported
+                            // after this action, filepath is empty (linux only)
+    DMON_ACTION_CLOSE_WRITE,    // the file is written and closed, DMON_WATCHFLAGS_CLOSE_WRITE watches only (linux only)
+    DMON_ACTION_ATTRIB,         // permissions, owner, timestamps or links of the entry are changed (linux only)
+    DMON_ACTION_ROOT_DELETE,    // the root directory is deleted, filepath is empty (linux only)
+    DMON_ACTION_ROOT_MOVE       // the root directory is moved, filepath is empty (linux only)
 } dmon_action;
 
+// bits of the actions that a watch reports, see dmon_watch_ex (dmon_extra.h)
+#define DMON_ACTIONMASK(action) (1u << (action))
+#define DMON_ACTIONMASK_DEFAULT (DMON_ACTIONMASK(DMON_ACTION_CREATE) | DMON_ACTIONMASK(DMON_ACTION_DELETE) | \
+                                 DMON_ACTIONMASK(DMON_ACTION_MODIFY) | DMON_ACTIONMASK(DMON_ACTION_MOVE) | \
+                                 DMON_ACTIONMASK(DMON_ACTION_OVERFLOW))
+
+// event of the batches that are delivered to the callback of dmon_watch_batch (dmon_extra.h)
+// the paths are only valid during the callback
+typedef struct dmon_event {
+    dmon_watch_id watch_id;
+    dmon_action action;
+    const char* filepath;       // relative to rootdir
+    const char* oldfilepath;    // DMON_ACTION_MOVE only, NULL otherwise
+} dmon_event;
+
+// event of the queue that is filled by the watches of dmon_watch_queue (dmon_extra.h), the paths are copied
+typedef struct dmon_queued_event {
+    dmon_watch_id watch_id;
+    dmon_action action;
+    char filepath[DMON_MAX_PATH];       // relative to the rootdir of the watch
+    char oldfilepath[DMON_MAX_PATH];    // DMON_ACTION_MOVE only, empty otherwise
+} dmon_queued_event;
+
+// counters of a watch, or of all the watches, that are returned by dmon_get_stats (dmon_extra.h)
+typedef struct dmon_stats {
+    uint64_t events_read;           // events that are read from inotify/fanotify
+    uint64_t bytes_read;            // all watches only
+    uint64_t merged_modify;         // repeated MODIFY events of a file, only the last one is delivered
+    uint64_t merged_create_modify;  // MODIFY events right after the CREATE or DELETE of the file
+    uint64_t merged_temp_rename;    // temp files that are created and moved over a file, delivered as one MODIFY
+    uint64_t merged_move;           // MOVED_FROM/MOVED_TO pairs that are delivered as one MOVE
+    uint64_t events_delivered;      // to the callbacks, or to the queue
+    uint64_t dirs_registered;       // directories that are added to inotify
+    uint64_t dirs_skipped;          // directories that could not be watched or read (inotify_add_watch or open
+                                    // failed, or their path is longer than DMON_MAX_PATH)
+    uint64_t dirs_watched;          // single watches only: directories that are watched now, it goes down when
+                                    // they are deleted or moved out of the watch
+    uint64_t flushes;
+    uint64_t callback_ns;           // total time spent in the callbacks
+    uint64_t callback_max_ns;       // longest callback
+    uint64_t peak_events;           // all watches only: most events that are gathered at once
+} dmon_stats;
+
+// optional settings of dmon_watch_ex (dmon_extra.h), zero for the defaults
+typedef struct dmon_watch_options {
+    const char* ignore;     // gitignore-style patterns of the entries that are not watched
+    uint32_t actions;       // DMON_ACTIONMASK bits of the actions to report, DMON_ACTIONMASK_DEFAULT if zero
+} dmon_watch_options;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -131,6 +226,17 @@ DMON_API_DECL  dmon_watch_id dmon_watch(const char* rootdir,
                          uint32_t flags, void* user_data);
 DMON_API_DECL void dmon_unwatch(dmon_watch_id id);
 
+typedef struct dmon_context dmon_context;
+
+DMON_API_DECL dmon_context* dmon_context_create(void);
+DMON_API_DECL void dmon_context_destroy(dmon_context* ctx);
+DMON_API_DECL dmon_watch_id dmon_context_watch(dmon_context* ctx, const char* rootdir,
+                                               void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                const char* rootdir, const char* filepath,
+                                                                const char* oldfilepath, void* user),
+                                               uint32_t flags, void* user_data);
+DMON_API_DECL void dmon_context_unwatch(dmon_context* ctx, dmon_watch_id id);
+
 #ifdef __cplusplus
 }
 #endif
@@ -188,9 +294,20 @@ DMON_API_DECL void dmon_unwatch(dmon_watch_id id);
 #    include <sys/inotify.h>
 #    include <sys/stat.h>
 #    include <sys/time.h>
+#    include <sys/eventfd.h>
+#    include <sys/timerfd.h>
+#    include <sys/mman.h>
+#    include <poll.h>
+#    if !__FreeBSD__
+#        include <sys/epoll.h>
+#        include <sys/syscall.h>
+#        include <sys/fanotify.h>
+#        include <sys/statfs.h>
+#    endif
 #    include <time.h>
 #    include <unistd.h>
 #    include <stdlib.h>
+#    include <limits.h>
 #elif DMON_OS_MACOS
 #   include <pthread.h>
 #   include <CoreServices/CoreServices.h>
@@ -229,10 +346,6 @@ DMON_API_DECL void dmon_unwatch(dmon_watch_id id);
 #   define DMON_MAX_WATCHES 64
 #endif
 
-#ifndef DMON_MAX_PATH
-#   define DMON_MAX_PATH 260
-#endif
-
 #define _DMON_UNUSED(x) (void)(x)
 
 #ifndef _DMON_PRIVATE
@@ -247,6 +360,26 @@ DMON_API_DECL void dmon_unwatch(dmon_watch_id id);
 #   define DMON_SLEEP_INTERVAL 10
 #endif
 
+#ifndef DMON_CRAWL_THREADS
+#   define DMON_CRAWL_THREADS 1
+#endif
+
+#ifndef DMON_POLL_INTERVAL
+#   define DMON_POLL_INTERVAL 1000
+#endif
+
+#ifndef DMON_POLL_BUDGET
+#   define DMON_POLL_BUDGET 16384
+#endif
+
+#ifndef DMON_QUEUE_SIZE
+#   define DMON_QUEUE_SIZE 1024
+#endif
+
+#ifndef DMON_CALLBACK_THREADS
+#   define DMON_CALLBACK_THREADS 0
+#endif
+
 #include <string.h>
 
 #ifndef _DMON_LOG_ERRORF
@@ -412,7 +545,7 @@ typedef struct dmon__watch_state {
     char old_filepath[DMON_MAX_PATH];
 } dmon__watch_state;
 
-typedef struct dmon__state {
+typedef struct dmon_context {
     int num_watches;
     dmon__watch_state* watches[DMON_MAX_WATCHES];
 	int freelist[DMON_MAX_WATCHES];
@@ -420,10 +553,11 @@ typedef struct dmon__state {
     CRITICAL_SECTION mutex;
     dmon__win32_event* events;
     uint32_t quit;
+    bool initialized;
 } dmon__state;
 
-static bool _dmon_init;
-static dmon__state _dmon;
+// the context of dmon_init/dmon_watch, the others are made by dmon_context_create
+static dmon__state _dmon_default;
 
 _DMON_PRIVATE bool _dmon_refresh_watch(dmon__watch_state* watch)
 {
@@ -439,11 +573,11 @@ _DMON_PRIVATE void _dmon_unwatch(dmon__watch_state* watch)
     CloseHandle(watch->dir_handle);
 }
 
-_DMON_PRIVATE void _dmon_win32_process_events(void)
+_DMON_PRIVATE void _dmon_win32_process_events(dmon__state* ctx)
 {
     int i, c;
-    for (i = 0, c = stb_sb_count(_dmon.events); i < c; i++) {
-        dmon__win32_event* ev = &_dmon.events[i];
+    for (i = 0, c = stb_sb_count(ctx->events); i < c; i++) {
+        dmon__win32_event* ev = &ctx->events[i];
         if (ev->skip) {
             continue;
         }
@@ -452,7 +586,7 @@ _DMON_PRIVATE void _dmon_win32_process_events(void)
             // remove duplicate modifies on a single file
             int j;
             for (j = i + 1; j < c; j++) {
-                dmon__win32_event* check_ev = &_dmon.events[j];
+                dmon__win32_event* check_ev = &ctx->events[j];
                 if (check_ev->action == FILE_ACTION_MODIFIED &&
                     strcmp(ev->filepath, check_ev->filepath) == 0) {
                     check_ev->skip = true;
@@ -462,12 +596,12 @@ _DMON_PRIVATE void _dmon_win32_process_events(void)
     }
 
     // trigger user callbacks
-    for (i = 0, c = stb_sb_count(_dmon.events); i < c; i++) {
-        dmon__win32_event* ev = &_dmon.events[i];
+    for (i = 0, c = stb_sb_count(ctx->events); i < c; i++) {
+        dmon__win32_event* ev = &ctx->events[i];
         if (ev->skip) {
             continue;
         }
-        dmon__watch_state* watch = _dmon.watches[ev->watch_id.id - 1];
+        dmon__watch_state* watch = ctx->watches[ev->watch_id.id - 1];
 
         if(watch == NULL || watch->watch_cb == NULL) {
             continue;
@@ -487,7 +621,7 @@ _DMON_PRIVATE void _dmon_win32_process_events(void)
             // this is somewhat API flaw that we have no reference for relating old and new files
             int j;
             for (j = i + 1; j < c; j++) {
-                dmon__win32_event* check_ev = &_dmon.events[j];
+                dmon__win32_event* check_ev = &ctx->events[j];
                 if (check_ev->action == FILE_ACTION_RENAMED_NEW_NAME) {
                     watch->watch_cb(check_ev->watch_id, DMON_ACTION_MOVE, watch->rootdir,
                                     check_ev->filepath, ev->filepath, watch->user_data);
@@ -501,12 +635,12 @@ _DMON_PRIVATE void _dmon_win32_process_events(void)
             break;
         }
     }
-    stb_sb_reset(_dmon.events);
+    stb_sb_reset(ctx->events);
 }
 
 _DMON_PRIVATE DWORD WINAPI _dmon_thread(LPVOID arg)
 {
-    _DMON_UNUSED(arg);
+    dmon__state* ctx = (dmon__state*)arg;
     HANDLE wait_handles[DMON_MAX_WATCHES];
     dmon__watch_state* watch_states[DMON_MAX_WATCHES];
 
@@ -514,20 +648,20 @@ _DMON_PRIVATE DWORD WINAPI _dmon_thread(LPVOID arg)
     GetSystemTime(&starttm);
     uint64_t msecs_elapsed = 0;
 
-    while (InterlockedCompareExchange(&_dmon.quit, 0, 0) == 0) {
+    while (InterlockedCompareExchange(&ctx->quit, 0, 0) == 0) {
         Sleep(DMON_SLEEP_INTERVAL);
-        if (!TryEnterCriticalSection(&_dmon.mutex)) {
+        if (!TryEnterCriticalSection(&ctx->mutex)) {
             continue;
         }
 
-        if (_dmon.num_watches == 0) {
-            LeaveCriticalSection(&_dmon.mutex);
+        if (ctx->num_watches == 0) {
+            LeaveCriticalSection(&ctx->mutex);
             continue;
         }
 
         DWORD active = 0;
         for (unsigned i = 0; i < DMON_MAX_WATCHES; i++) {
-            dmon__watch_state* watch = _dmon.watches[i];
+            dmon__watch_state* watch = ctx->watches[i];
             if (watch) {
                 watch_states[active] = watch;
                 wait_handles[active] = watch->overlapped.hEvent;
@@ -549,7 +683,7 @@ _DMON_PRIVATE DWORD WINAPI _dmon_thread(LPVOID arg)
 
                 if (bytes == 0) {
                     _dmon_refresh_watch(watch);
-                    LeaveCriticalSection(&_dmon.mutex);
+                    LeaveCriticalSection(&ctx->mutex);
                     continue;
                 }
 
@@ -562,17 +696,17 @@ _DMON_PRIVATE DWORD WINAPI _dmon_thread(LPVOID arg)
                     filepath[count] = TEXT('\0');
                     _dmon_unixpath(filepath, sizeof(filepath), filepath);
 
-                    if (stb_sb_count(_dmon.events) == 0) {
+                    if (stb_sb_count(ctx->events) == 0) {
                         msecs_elapsed = 0;
                     }
                     dmon__win32_event wev = { { 0 }, notify->Action, watch->id, false };
                     _dmon_strcpy(wev.filepath, sizeof(wev.filepath), filepath);
-                    stb_sb_push(_dmon.events, wev);
+                    stb_sb_push(ctx->events, wev);
 
                     offset += notify->NextEntryOffset;
                 } while (notify->NextEntryOffset > 0);
 
-                if (InterlockedCompareExchange(&_dmon.quit, 0, 0) == 0) {
+                if (InterlockedCompareExchange(&ctx->quit, 0, 0) == 0) {
                     _dmon_refresh_watch(watch);
                 }
             }
@@ -583,73 +717,81 @@ _DMON_PRIVATE DWORD WINAPI _dmon_thread(LPVOID arg)
         LONG dt =(tm.wSecond - starttm.wSecond) * 1000 + (tm.wMilliseconds - starttm.wMilliseconds);
         starttm = tm;
         msecs_elapsed += dt;
-        if (msecs_elapsed > 100 && stb_sb_count(_dmon.events) > 0) {
-            _dmon_win32_process_events();
+        if (msecs_elapsed > 100 && stb_sb_count(ctx->events) > 0) {
+            _dmon_win32_process_events(ctx);
             msecs_elapsed = 0;
         }
 
-        LeaveCriticalSection(&_dmon.mutex);
+        LeaveCriticalSection(&ctx->mutex);
     }
     return 0;
 }
 
 
-DMON_API_IMPL void dmon_init(void)
+_DMON_PRIVATE void _dmon_context_init(dmon__state* ctx)
 {
-    DMON_ASSERT(!_dmon_init);
-    InitializeCriticalSection(&_dmon.mutex);
+    DMON_ASSERT(!ctx->initialized);
+    InitializeCriticalSection(&ctx->mutex);
 
-    _dmon.thread_handle = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)_dmon_thread, NULL, 0, NULL);
-    DMON_ASSERT(_dmon.thread_handle);
+    ctx->thread_handle = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)_dmon_thread, ctx, 0, NULL);
+    DMON_ASSERT(ctx->thread_handle);
 
-	for (int i = 0; i < DMON_MAX_WATCHES; i++)
     {
-        _dmon.freelist[i] = DMON_MAX_WATCHES - i - 1;
-        _dmon.watches[i] = NULL;
+        int i;
+        for (i = 0; i < DMON_MAX_WATCHES; i++) {
+            ctx->freelist[i] = DMON_MAX_WATCHES - i - 1;
+            ctx->watches[i] = NULL;
+        }
     }
 
-    _dmon_init = true;
+    ctx->initialized = true;
 }
 
 
-DMON_API_IMPL void dmon_deinit(void)
+// the callbacks of the context are called by its monitor thread
+_DMON_PRIVATE bool _dmon_context_thread(dmon__state* ctx)
+{
+    return ctx->thread_handle && GetThreadId(ctx->thread_handle) == GetCurrentThreadId();
+}
+
+_DMON_PRIVATE void _dmon_context_deinit(dmon__state* ctx)
 {
-    DMON_ASSERT(_dmon_init);
-    InterlockedExchange(&_dmon.quit, 1);
-    if (_dmon.thread_handle != INVALID_HANDLE_VALUE) {
-        WaitForSingleObject(_dmon.thread_handle, INFINITE);
-        CloseHandle(_dmon.thread_handle);
+    DMON_ASSERT(ctx->initialized);
+    InterlockedExchange(&ctx->quit, 1);
+    if (ctx->thread_handle != INVALID_HANDLE_VALUE) {
+        WaitForSingleObject(ctx->thread_handle, INFINITE);
+        CloseHandle(ctx->thread_handle);
     }
 
     for (unsigned i = 0; i < DMON_MAX_WATCHES; i++) {
-        if (_dmon.watches[i]) {
-            _dmon_unwatch(_dmon.watches[i]);
-            DMON_FREE(_dmon.watches[i]);
+        if (ctx->watches[i]) {
+            _dmon_unwatch(ctx->watches[i]);
+            DMON_FREE(ctx->watches[i]);
         }
     }
 
-    DeleteCriticalSection(&_dmon.mutex);
-    stb_sb_free(_dmon.events);
-    memset(&_dmon, 0x0, sizeof(_dmon));
-    _dmon_init = false;
+    DeleteCriticalSection(&ctx->mutex);
+    stb_sb_free(ctx->events);
+    memset(ctx, 0x0, sizeof(*ctx));
+    ctx->initialized = false;
 }
 
-DMON_API_IMPL dmon_watch_id dmon_watch(const char* rootdir,
-                                       void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
-                                                        const char* dirname, const char* filename,
-                                                        const char* oldname, void* user),
-                                       uint32_t flags, void* user_data)
+DMON_API_IMPL dmon_watch_id dmon_context_watch(dmon_context* ctx, const char* rootdir,
+                                               void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                const char* dirname, const char* filename,
+                                                                const char* oldname, void* user),
+                                               uint32_t flags, void* user_data)
 {
-	DMON_ASSERT(_dmon_init);
+	DMON_ASSERT(ctx->initialized);
     DMON_ASSERT(watch_cb);
     DMON_ASSERT(rootdir && rootdir[0]);
 
-    EnterCriticalSection(&_dmon.mutex);
+    EnterCriticalSection(&ctx->mutex);
 
-    DMON_ASSERT(_dmon.num_watches < DMON_MAX_WATCHES);
-    if (_dmon.num_watches >= DMON_MAX_WATCHES) {
+    DMON_ASSERT(ctx->num_watches < DMON_MAX_WATCHES);
+    if (ctx->num_watches >= DMON_MAX_WATCHES) {
         DMON_LOG_ERROR("Exceeding maximum number of watches");
-        LeaveCriticalSection(&_dmon.mutex);
+        LeaveCriticalSection(&ctx->mutex);
         return _dmon_make_id(0);
     }
 
@@ -657,8 +799,8 @@ DMON_API_IMPL dmon_watch_id dmon_watch(const char* rootdir,
     unsigned id = 0;
     HANDLE hEvent = INVALID_HANDLE_VALUE;
     HANDLE dir_handle = INVALID_HANDLE_VALUE;
-    int num_freelist = DMON_MAX_WATCHES - _dmon.num_watches;
-    int index = _dmon.freelist[num_freelist - 1];
+    int num_freelist = DMON_MAX_WATCHES - ctx->num_watches;
+    int index = ctx->freelist[num_freelist - 1];
     size_t rootdir_len;
 
     {
@@ -718,11 +860,11 @@ DMON_API_IMPL dmon_watch_id dmon_watch(const char* rootdir,
         goto fail;
     }
 
-    ++_dmon.num_watches;
+    ++ctx->num_watches;
 
 finish:
-    _dmon.watches[index] = watch;
-    LeaveCriticalSection(&_dmon.mutex);
+    ctx->watches[index] = watch;
+    LeaveCriticalSection(&ctx->mutex);
     return _dmon_make_id(id);
 
 fail:
@@ -739,30 +881,30 @@ fail:
     goto finish;
 }
 
-DMON_API_IMPL void dmon_unwatch(dmon_watch_id id)
+DMON_API_IMPL void dmon_context_unwatch(dmon_context* ctx, dmon_watch_id id)
 {
-    EnterCriticalSection(&_dmon.mutex);
+    EnterCriticalSection(&ctx->mutex);
 
-	DMON_ASSERT(_dmon_init);
+	DMON_ASSERT(ctx->initialized);
     DMON_ASSERT(id.id > 0);
     int index = id.id - 1;
     DMON_ASSERT(index < DMON_MAX_WATCHES);
-    DMON_ASSERT(_dmon.num_watches > 0);
+    DMON_ASSERT(ctx->num_watches > 0);
 
-    dmon__watch_state* watch = _dmon.watches[index];
+    dmon__watch_state* watch = ctx->watches[index];
     DMON_ASSERT(watch);
 
     if (watch) {
         _dmon_unwatch(watch);
         DMON_FREE(watch);
-        _dmon.watches[index] = NULL;
+        ctx->watches[index] = NULL;
 
-        --_dmon.num_watches;
-        int num_freelist = DMON_MAX_WATCHES - _dmon.num_watches;
-        _dmon.freelist[num_freelist - 1] = index;
+        --ctx->num_watches;
+        int num_freelist = DMON_MAX_WATCHES - ctx->num_watches;
+        ctx->freelist[num_freelist - 1] = index;
     }
 
-    LeaveCriticalSection(&_dmon.mutex);
+    LeaveCriticalSection(&ctx->mutex);
 }
 
 #elif DMON_OS_INOTIFY
@@ -771,491 +913,5020 @@ DMON_API_IMPL void dmon_unwatch(dmon_watch_id id)
 // inotify linux backend
 #define _DMON_TEMP_BUFFSIZE ((sizeof(struct inotify_event) + NAME_MAX + 1) * 1024)
 
+// watch ids are made of the slot index (+1) in the low bits and the generation of the slot in the high bits
+// so ids of removed watches are rejected, even if the slot is reused. a recursive watch is a single slot, so 65535
+// watches are plenty, and free slots are reused last-in first-out, so the generation bits decide how many
+// dmon_watch/dmon_unwatch cycles it takes for an old id to become valid again
+#define _DMON_WATCH_INDEX_BITS 16
+#define _DMON_WATCH_INDEX_MASK ((1u << _DMON_WATCH_INDEX_BITS) - 1)
+#define _DMON_FLUSH_DELAY_NSECS 100000000ull   // default window: events are gathered for this long before being processed
+#define _DMON_WINDOW_STEP_NSECS 1000000ull     // adaptive windows grow from at least this
+
+// file timestamps are coarse, so entries that are modified this close to the time they are checked (or saved) can
+// change again without a different mtime
+#define _DMON_RACY_NSECS 1000000000
+
+// tags of the file descriptors that the monitor thread waits on
+#define _DMON_TAG_WAKE 0
+#define _DMON_TAG_TIMER 1
+#define _DMON_TAG_INOTIFY 2
+#define _DMON_TAG_FANOTIFY 3
+#define _DMON_TAG_POLL 4
+
+// fanotify needs FAN_REPORT_DFID_NAME to report the names of the files, which is only in linux 5.9+ headers
+#if defined(FAN_REPORT_DFID_NAME) && !__FreeBSD__
+#    define _DMON_FANOTIFY 1
+#    define _DMON_FANOTIFY_MASK (FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_ONDIR)
+#    ifdef FAN_RENAME
+#        define _DMON_FAN_RENAME FAN_RENAME
+#    else
+#        define _DMON_FAN_RENAME 0
+#    endif
+#    define _DMON_MAX_HANDLE_SZ 136  // MAX_HANDLE_SZ of fcntl.h, plus the header of the handle
+#else
+#    define _DMON_FANOTIFY 0
+#endif
+
+#define _DMON_SUBDIR_FREE -2
+
+// watched directory of a watch, see _dmon_subdir_link
 typedef struct dmon__watch_subdir {
-    char rootdir[DMON_MAX_PATH];
+    int wd;             // -1 if only the directories under it are watched, _DMON_SUBDIR_FREE for free nodes
+    uint32_t name;      // offset of the interned name in subdir_names
+    int parent;         // -1 for the top nodes
+    int first_child;
+    int prev_sibling;
+    int next_sibling;   // or next free node
+    int next;           // next node with the same hash of (parent, name)
 } dmon__watch_subdir;
 
+// filepaths of the events are packed in dmon__state.event_paths, which is reset on every flush
 typedef struct dmon__inotify_event {
-    char filepath[DMON_MAX_PATH];
     uint32_t mask;
     uint32_t cookie;
+    uint32_t hash;      // hash of filepath and watch_id, precomputed for coalescing
+    uint32_t path;      // offset of filepath in event_paths
+    int len;            // length of filepath
     dmon_watch_id watch_id;
     bool skip;
 } dmon__inotify_event;
 
+// per-batch coalescing state of a single file path
+typedef struct dmon__inotify_pathkey {
+    int event;          // first event with this path, used for comparing the strings
+    int next;           // next key with the same hash
+    int modify;         // last MODIFY event of the path, or -1
+    int close_write;    // last CLOSE_WRITE event of the path, or -1
+    int attrib;         // last ATTRIB event of the path, or -1
+    int create;         // CREATE event that is still collapsing MODIFY events of the path, or -1
+    bool deleted;       // path is DELETED and the next MODIFY event must be ignored
+} dmon__inotify_pathkey;
+
+// first MOVED_FROM or MOVED_TO event of a (cookie, watch) pair in the batch
+typedef struct dmon__inotify_movekey {
+    int event;
+    int next;           // next key with the same hash
+} dmon__inotify_movekey;
+
+// open-addressing hash table (linear probing) that maps uint32 keys to non-negative int values
+// values of -1 mark empty slots. capacity is always a power of two
+typedef struct dmon__hashtbl {
+    uint32_t* keys;
+    int* values;
+    int capacity;
+    int count;
+} dmon__hashtbl;
+
+// what the snapshot knows about an entry, size and mtime are only kept for DMON_WATCHFLAGS_SNAPSHOT watches
+typedef struct dmon__snapshot_stat {
+    uint64_t inode;     // zero if unknown
+    int64_t size;
+    int64_t mtime;      // nanoseconds
+    uint8_t type;       // DT_DIR, DT_REG, DT_LNK, ...
+    bool has_stat;      // size and mtime are valid
+} dmon__snapshot_stat;
+
+// entry (file or directory) of a watch. nodes only keep their name and are linked to their parent, so moving
+// a directory doesn't touch the nodes under it. node 0 is the root directory
+typedef struct dmon__snapshot_node {
+    dmon__snapshot_stat st;
+    uint32_t hash;      // hash of (parent, name)
+    uint32_t name;      // offset of the interned name in names
+    int parent;         // -1 for the root and free nodes
+    int first_child;
+    int prev_sibling;
+    int next_sibling;   // or next free node
+    int next;           // next node with the same hash
+} dmon__snapshot_node;
+
+// entries that the watch has seen so far, compared against the file system to find lost events
+typedef struct dmon__snapshot {
+    dmon__snapshot_node* nodes;
+    dmon__hashtbl tbl;      // hash of (parent, name) -> first node
+    char* names;            // interned names, each one is prefixed with the offset of the next name with the same hash
+    dmon__hashtbl name_tbl; // hash of name -> first name
+    int free_node;          // head of the free list of nodes
+    int live_names;         // bytes of the names of the live nodes, names are packed when there is too much garbage
+} dmon__snapshot;
+
+// all watches share a single inotify instance, so the same directory (wd) can be owned by more than one
+// watch if their trees overlap. every wd has a chain of refs, one for each watch that owns the directory
+typedef struct dmon__wd_ref {
+    int wd;
+    int watch;          // index of the watch in dmon__state.watches
+    int subdir;         // node of the directory in watch->subdirs
+    int next;           // next ref of the same wd, or next free ref
+} dmon__wd_ref;
+
+// directory of a watch that is moved away (IN_MOVED_FROM), waiting for it's IN_MOVED_TO
+typedef struct dmon__dir_move {
+    int watch;                  // index of the watch in dmon__state.watches
+    char path[DMON_MAX_PATH];   // relative to rootdir, without trailing slash
+} dmon__dir_move;
+
+typedef void (_dmon_watch_batch_cb)(dmon_watch_id, const char*, const dmon_event*, int, void*);
+
+// event of a batch watch that is waiting for the end of the flush
+typedef struct dmon__batch_entry {
+    dmon_watch_id watch_id;
+    dmon_action action;
+    uint32_t path;      // offset of filepath in event_paths
+    int oldpath;        // offset of oldfilepath in event_paths, or -1
+    bool delivered;
+} dmon__batch_entry;
+
+// bounded lock-free queue of the events of the queue watches, that are pulled by dmon_poll_events and
+// dmon_wait_events (Vyukov's MPMC queue). a cell is free for the push of position p when it's seq is p, and holds
+// the event of position p for the pop when it's seq is p + 1
+typedef struct dmon__queue_cell {
+    uint32_t seq;
+    dmon_queued_event event;
+} dmon__queue_cell;
+
+typedef struct dmon__queue {
+    dmon__queue_cell* cells;    // allocated with the first queue watch
+    uint32_t mask;
+    int event_fd;               // eventfd: signaled when events are pushed, the consumers wait on it
+    bool pushed;                // events are pushed in the current flush, the consumers are signaled at the end
+    uint8_t pad0[64];
+    uint32_t head;              // next position to push
+    uint8_t pad1[64];
+    uint32_t tail;              // next position to pop
+    uint8_t pad2[64];
+    uint64_t dropped;           // events that are dropped because the queue is full
+} dmon__queue;
+
+// event that is waiting for a callback thread
+typedef struct dmon__callback {
+    dmon_action action;
+    uint32_t path;      // offset of filepath in the paths of the dispatch
+    int oldpath;        // offset of oldfilepath, or -1
+} dmon__callback;
+
+// callbacks of a watch that are called by the callback threads. it's owned by the callback threads while it's
+// scheduled, so it outlives the watch until the running callbacks are done
+typedef struct dmon__dispatch {
+    dmon_watch_id id;
+    _dmon_watch_cb* watch_cb;
+    _dmon_watch_batch_cb* batch_cb;
+    void* user_data;
+    char rootdir[DMON_MAX_PATH];
+    dmon__callback* staged;     // callbacks of the current flush, only touched by the monitor thread
+    char* staged_paths;
+    dmon__callback* pending;    // flushes that are waiting for a callback thread
+    char* pending_paths;
+    dmon__callback* running;    // swapped with pending by the callback thread that runs them
+    char* running_paths;
+    dmon_event* events;         // running callbacks of batch watches
+    uint64_t callback_ns;       // added to the stats of the watch by dmon_get_stats
+    uint64_t callback_max_ns;
+    bool scheduled;             // in the ready list, or running
+    bool removed;               // the watch is removed, the rest of the callbacks are not called
+} dmon__dispatch;
+
+typedef struct dmon__callback_thread {
+    pthread_t thread;
+    struct dmon_context* ctx;   // context of the pool
+    dmon_watch_id running;      // watch that the thread is calling, 0 if none
+} dmon__callback_thread;
+
+typedef enum dmon__ignore_kind {
+    _DMON_IGNORE_NAME = 0,      // literal, compared with the name of the entry
+    _DMON_IGNORE_SUFFIX,        // "*literal", compared with the end of the name
+    _DMON_IGNORE_GLOB           // anything else, see _dmon_glob_match
+} dmon__ignore_kind;
+
+typedef struct dmon__ignore_rule {
+    int pattern;        // offset in the patterns of the rules
+    int len;
+    dmon__ignore_kind kind;
+    bool negate;        // "!pattern": the entry is included again
+    bool dir_only;      // "pattern/": only matches directories
+    bool anchored;      // matched against the path relative to rootdir instead of the name
+} dmon__ignore_rule;
+
+// compiled ignore rules of a watch, see _dmon_ignore_compile. they are not modified after they are compiled, so
+// they are shared with the crawler threads, which may outlive the watch (async crawls)
+typedef struct dmon__ignore {
+    dmon__ignore_rule* rules;
+    char* patterns;
+    bool anchored;      // one of the rules is anchored, so the paths are needed
+    int refs;
+} dmon__ignore;
+
 typedef struct dmon__watch_state {
     dmon_watch_id id;
-    int fd;
     uint32_t watch_flags;
+    uint32_t actions;                   // DMON_ACTIONMASK bits of the actions that are delivered
     _dmon_watch_cb* watch_cb;
+    _dmon_watch_batch_cb* batch_cb;     // events are delivered at once for every flush, instead of to watch_cb
+    bool queued;                        // events are pushed to the queue, there are no callbacks
+    dmon__dispatch* dispatch;           // created with the first event if there are callback threads
     void* user_data;
     char rootdir[DMON_MAX_PATH];
     dmon__watch_subdir* subdirs;
-    int* wds;
+    char* subdir_names;             // interned names of the subdirs, like the names of the snapshot
+    dmon__hashtbl subdir_tbl;       // hash of (parent, name) -> first node
+    dmon__hashtbl subdir_name_tbl;  // hash of name -> first name
+    int free_subdir;                // head of the free list of subdirs
+    int live_subdir_names;
+    dmon__snapshot snapshot;    // empty for fanotify watches
+    dmon__ignore* ignore;       // entries that are not watched, NULL if there are no rules
+    bool fanotify;      // events come from the fanotify mark of the file system, there are no inotify watches
+    bool poll;          // changes are found by polling the snapshot against the disk, there are no inotify watches
+    int poll_dir;       // next node to check for directories
+    int poll_file;      // next node to check for files
+    uint64_t window_min;    // events are gathered for window before being delivered. it's fixed if min and max are
+    uint64_t window_max;    // the same, otherwise it's adaptive (see _dmon_update_window). nanoseconds
+    uint64_t window;
+    uint64_t deadline;      // monotonic time to deliver the gathered events, 0 if there are none
+    uint64_t last_flush;
+    dmon_stats stats;
 } dmon__watch_state;
 
-typedef struct dmon__state {
-    dmon__watch_state* watches[DMON_MAX_WATCHES];
-   	int freelist[DMON_MAX_WATCHES];
+#if _DMON_FANOTIFY
+// file system that is marked for fanotify, shared by all the fanotify watches on it
+typedef struct dmon__fan_mark {
+    fsid_t fsid;
+    dev_t dev;          // fsids are not unique for every file system, the device is compared as well
+    int mount_fd;       // for open_by_handle_at
+    int refs;           // number of watches, the slot is free when it's zero
+    int close_write_refs;   // number of watches that want FAN_CLOSE_WRITE
+    int attrib_refs;        // number of watches that want FAN_ATTRIB
+    char path[DMON_MAX_PATH];
+} dmon__fan_mark;
+
+typedef struct dmon__fan_watch {
+    dmon_watch_id id;
+    int mark;
+    uint64_t optional;  // FAN_CLOSE_WRITE and FAN_ATTRIB bits that the watch has added to the mark
+    int rootdir_len;
+    char rootdir[DMON_MAX_PATH];    // resolved, with trailing slash
+} dmon__fan_watch;
+
+// struct file_handle of fcntl.h needs _GNU_SOURCE
+typedef struct dmon__file_handle {
+    uint32_t handle_bytes;
+    int handle_type;
+    unsigned char f_handle[1];
+} dmon__file_handle;
+#endif
+
+typedef struct dmon_context {
+    dmon__watch_state** watches;    // slots, NULL for free slots
+    uint32_t* generations;          // generation of each slot, increased when the watch is removed
+    int* freelist;                  // free slots
     dmon__inotify_event* events;
+    char* event_paths;
+    dmon__inotify_pathkey* pathkeys;
+    dmon__hashtbl path_tbl;         // path hash -> pathkeys
+    dmon__inotify_movekey* movekeys;
+    dmon__hashtbl moved_from_tbl;   // (cookie, watch) hash -> movekeys of IN_MOVED_FROM events
+    dmon__hashtbl moved_to_tbl;     // (cookie, watch) hash -> movekeys of IN_MOVED_TO events
+    dmon__batch_entry* batch;       // events of the batch watches in the current flush
+    dmon_event* batch_events;       // the batch events, grouped by watch
+    char* batch_paths;              // event_paths of the flush that is being delivered to the batch watches
+    dmon__queue queue;
+    dmon__callback_thread* cb_threads;
+    dmon__dispatch** cb_ready;      // dispatches that have callbacks to run, in order
+    dmon__dispatch** cb_staged;     // dispatches that have callbacks in the current flush
+    int cb_ready_head;
+    pthread_mutex_t cb_mutex;       // taken after mutex, if both are needed
+    pthread_cond_t cb_cond;         // signaled when a dispatch is ready, or the threads should quit
+    pthread_cond_t cb_done_cond;    // signaled when a callback thread is done with a dispatch
+    bool cb_quit;
     int num_watches;
+    int inotify_fd;     // single inotify instance for all watches
+    dmon__hashtbl wd_tbl;   // wd -> first ref in wd_refs
+    dmon__wd_ref* wd_refs;
+    int wd_refs_free;   // head of the free list of wd_refs
+    dmon__dir_move* dir_moves;  // directories that are moved away with dir_move_cookie
+    uint32_t dir_move_cookie;
+    int wake_fd;        // eventfd: wakes up the thread for quit
+    int timer_fd;       // timerfd: deadline for processing the gathered events
+    int poll_fd;        // timerfd: interval of the poll watches, armed while there are any
+#if !__FreeBSD__
+    int epoll_fd;
+#endif
+#if _DMON_FANOTIFY
+    int fanotify_fd;    // created with the first fanotify watch
+    dmon__fan_mark* fan_marks;
+    dmon__fan_watch* fan_watches;
+    uint32_t fan_cookie;    // fanotify moves don't have cookies, they are made up to pair the events
+    int fan_cache_mark;     // last resolved directory handle, -1 if empty
+    uint8_t fan_cache_handle[_DMON_MAX_HANDLE_SZ];
+    char fan_cache_path[PATH_MAX];
+#endif
+    uint32_t found_cookie;  // cookies of the moves that are found by restores and polls
+    dmon_watch_id* pending;     // watches that have gathered events, waiting for their deadlines
+    int num_scheduled;          // events that are already seen by _dmon_schedule_events
+    dmon__inotify_event* deferred;  // events of the watches that are not due, while the others are processed
+    char* deferred_paths;
+    uint64_t timer_deadline;    // monotonic time that the timer is armed for, 0 if it's not armed
+    dmon_stats stats;           // of all the watches, including the removed ones
+    bool poll_armed;
+    bool overflow;                      // inotify queue is overflowed, the watches should be rescanned
+    struct timespec read_time;          // last time that inotify events are read
+    struct timespec overflow_since;     // files modified after this time are reported by the rescan
     pthread_t thread_handle;
     pthread_mutex_t mutex;
+    pthread_cond_t registered_cond;     // signaled when a background registration is finished
+    int num_registering;                // async watches that are still crawling their directories
+    int crawl_threads;                  // threads of the crawls and restores, see dmon_set_crawl_threads
     bool quit;
+    bool initialized;
+    uint64_t read_buff[_DMON_TEMP_BUFFSIZE / sizeof(uint64_t)];   // aligned for the records
 } dmon__state;
 
-static bool _dmon_init;
-static dmon__state _dmon;
-
-_DMON_PRIVATE void _dmon_watch_recursive(const char* dirname, int fd, uint32_t mask,
-                                         bool followlinks, dmon__watch_state* watch)
-{
-    struct dirent* entry;
-    DIR* dir = opendir(dirname);
-    DMON_ASSERT(dir);
-
-    char watchdir[DMON_MAX_PATH];
+// the context of dmon_init/dmon_watch, the others are made by dmon_context_create
+static dmon__state _dmon_default;
 
-    while ((entry = readdir(dir)) != NULL) {
-        bool entry_valid = false;
-        if (entry->d_type == DT_DIR) {
-            if (strcmp(entry->d_name, "..") != 0 && strcmp(entry->d_name, ".") != 0) {
-                _dmon_strcpy(watchdir, sizeof(watchdir), dirname);
-                _dmon_strcat(watchdir, sizeof(watchdir), entry->d_name);
-                entry_valid = true;
-            }
-        } else if (followlinks && entry->d_type == DT_LNK) {
-            char linkpath[PATH_MAX];
-            _dmon_strcpy(watchdir, sizeof(watchdir), dirname);
-            _dmon_strcat(watchdir, sizeof(watchdir), entry->d_name);
-            char* r = realpath(watchdir, linkpath);
-            _DMON_UNUSED(r);
-            DMON_ASSERT(r);
-            _dmon_strcpy(watchdir, sizeof(watchdir), linkpath);
-            entry_valid = true;
-        }
+// counters are updated with relaxed atomics, so they can be read by dmon_get_stats from other threads
+#define _DMON_STAT_ADD(ctx, watch, field, n) do { \
+        __atomic_fetch_add(&(ctx)->stats.field, (uint64_t)(n), __ATOMIC_RELAXED); \
+        if (watch) __atomic_fetch_add(&(watch)->stats.field, (uint64_t)(n), __ATOMIC_RELAXED); \
+    } while (0)
 
-        // add sub-directory to watch dirs
-        if (entry_valid) {
-            int watchdir_len = (int)strlen(watchdir);
-            if (watchdir[watchdir_len - 1] != '/') {
-                watchdir[watchdir_len] = '/';
-                watchdir[watchdir_len + 1] = '\0';
-            }
-            int wd = inotify_add_watch(fd, watchdir, mask);
-            _DMON_UNUSED(wd);
-            DMON_ASSERT(wd != -1);
+_DMON_PRIVATE void _dmon_stat_max(uint64_t* counter, uint64_t value)
+{
+    uint64_t prev = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (value > prev && !__atomic_compare_exchange_n(counter, &prev, value, true, __ATOMIC_RELAXED,
+                                                        __ATOMIC_RELAXED)) {
+    }
+}
 
-            dmon__watch_subdir subdir;
-            _dmon_strcpy(subdir.rootdir, sizeof(subdir.rootdir), watchdir);
-            if (strstr(subdir.rootdir, watch->rootdir) == subdir.rootdir) {
-                _dmon_strcpy(subdir.rootdir, sizeof(subdir.rootdir), watchdir + strlen(watch->rootdir));
-            }
+_DMON_PRIVATE uint32_t _dmon_hash_u32(uint32_t key)
+{
+    // fibonacci hashing, spreads sequential keys (like wds) over the whole table
+    return key * 2654435769u;
+}
 
-            stb_sb_push(watch->subdirs, subdir);
-            stb_sb_push(watch->wds, wd);
+_DMON_PRIVATE int _dmon_hashtbl_find(const dmon__hashtbl* tbl, uint32_t key)
+{
+    if (tbl->count == 0) {
+        return -1;
+    }
 
-            // recurse
-            _dmon_watch_recursive(watchdir, fd, mask, followlinks, watch);
+    uint32_t mask = (uint32_t)tbl->capacity - 1;
+    uint32_t i = _dmon_hash_u32(key) & mask;
+    while (tbl->values[i] != -1) {
+        if (tbl->keys[i] == key) {
+            return tbl->values[i];
         }
+        i = (i + 1) & mask;
     }
-    closedir(dir);
+    return -1;
 }
 
-_DMON_PRIVATE const char* _dmon_find_subdir(const dmon__watch_state* watch, int wd)
+_DMON_PRIVATE void _dmon_hashtbl_free(dmon__hashtbl* tbl)
 {
-    const int* wds = watch->wds;
-    int i, c;
-    for (i = 0, c = stb_sb_count(wds); i < c; i++) {
-        if (wd == wds[i]) {
-            return watch->subdirs[i].rootdir;
-        }
-    }
+    DMON_FREE(tbl->keys);
+    DMON_FREE(tbl->values);
+    memset(tbl, 0x0, sizeof(dmon__hashtbl));
+}
 
-    return NULL;
+_DMON_PRIVATE void _dmon_hashtbl_clear(dmon__hashtbl* tbl)
+{
+    if (tbl->count > 0) {
+        memset(tbl->values, 0xff, sizeof(int) * tbl->capacity);
+        tbl->count = 0;
+    }
 }
 
-_DMON_PRIVATE void _dmon_gather_recursive(dmon__watch_state* watch, const char* dirname)
+_DMON_PRIVATE void _dmon_hashtbl_insert(dmon__hashtbl* tbl, uint32_t key, int value);
+
+_DMON_PRIVATE void _dmon_hashtbl_reserve(dmon__hashtbl* tbl, int count)
 {
-    struct dirent* entry;
-    DIR* dir = opendir(dirname);
-    DMON_ASSERT(dir);
+    // keep the load factor under 0.5, so probe sequences stay short
+    int capacity = tbl->capacity ? tbl->capacity : 16;
+    while (capacity < count * 2) {
+        capacity <<= 1;
+    }
+    if (capacity == tbl->capacity) {
+        return;
+    }
 
-    char newdir[DMON_MAX_PATH];
-    while ((entry = readdir(dir)) != NULL) {
-        bool entry_valid = false;
-        bool is_dir = false;
-        if (strcmp(entry->d_name, "..") != 0 && strcmp(entry->d_name, ".") != 0) {
-            _dmon_strcpy(newdir, sizeof(newdir), dirname);
-            _dmon_strcat(newdir, sizeof(newdir), entry->d_name);
-            is_dir = (entry->d_type == DT_DIR);
-            entry_valid = true;
-        }
+    dmon__hashtbl newtbl;
+    newtbl.keys = (uint32_t*)DMON_MALLOC(sizeof(uint32_t) * capacity);
+    newtbl.values = (int*)DMON_MALLOC(sizeof(int) * capacity);
+    DMON_ASSERT(newtbl.keys && newtbl.values);
+    newtbl.capacity = capacity;
+    newtbl.count = 0;
+    memset(newtbl.values, 0xff, sizeof(int) * capacity);
 
-        // add sub-directory to watch dirs
-        if (entry_valid) {
-            dmon__watch_subdir subdir;
-            _dmon_strcpy(subdir.rootdir, sizeof(subdir.rootdir), newdir);
-            if (strstr(subdir.rootdir, watch->rootdir) == subdir.rootdir) {
-                _dmon_strcpy(subdir.rootdir, sizeof(subdir.rootdir), newdir + strlen(watch->rootdir));
+    {
+        int i;
+        for (i = 0; i < tbl->capacity; i++) {
+            if (tbl->values[i] != -1) {
+                _dmon_hashtbl_insert(&newtbl, tbl->keys[i], tbl->values[i]);
             }
-
-            dmon__inotify_event dev = { { 0 }, IN_CREATE|(is_dir ? IN_ISDIR : 0U), 0, watch->id, false };
-            _dmon_strcpy(dev.filepath, sizeof(dev.filepath), subdir.rootdir);
-            stb_sb_push(_dmon.events, dev);
         }
     }
-    closedir(dir);
+
+    _dmon_hashtbl_free(tbl);
+    *tbl = newtbl;
 }
 
-_DMON_PRIVATE void _dmon_inotify_process_events(void)
+// inserts or replaces the value of the key
+_DMON_PRIVATE void _dmon_hashtbl_insert(dmon__hashtbl* tbl, uint32_t key, int value)
 {
-    int i, c;
-    for (i = 0, c = stb_sb_count(_dmon.events); i < c; i++) {
-        dmon__inotify_event* ev = &_dmon.events[i];
-        if (ev->skip) {
-            continue;
-        }
-
-        // remove redundant modify events on a single file
-        if (ev->mask & IN_MODIFY) {
-            int j;
-            for (j = i + 1; j < c; j++) {
-                dmon__inotify_event* check_ev = &_dmon.events[j];
-                if ((check_ev->mask & IN_MODIFY) && strcmp(ev->filepath, check_ev->filepath) == 0) {
-                    ev->skip = true;
-                    break;
-                } else if ((ev->mask & IN_ISDIR) && (check_ev->mask & (IN_ISDIR|IN_MODIFY))) {
-                    // in some cases, particularly when created files under sub directories
-                    // there can be two modify events for a single subdir one with trailing slash and one without
-                    // remove trailing slash from both cases and test
-                    int l1 = (int)strlen(ev->filepath);
-                    int l2 = (int)strlen(check_ev->filepath);
-                    if (ev->filepath[l1-1] == '/')          ev->filepath[l1-1] = '\0';
-                    if (check_ev->filepath[l2-1] == '/')    check_ev->filepath[l2-1] = '\0';
-                    if (strcmp(ev->filepath, check_ev->filepath) == 0) {
-                        ev->skip = true;
-                        break;
-                    }
-                }
-            }
-        } else if (ev->mask & IN_CREATE) {
-            int j;
-            bool loop_break = false;
-            for (j = i + 1; j < c && !loop_break; j++) {
-                dmon__inotify_event* check_ev = &_dmon.events[j];
-                if ((check_ev->mask & IN_MOVED_FROM) && strcmp(ev->filepath, check_ev->filepath) == 0) {
-                    // there is a case where some programs (like gedit):
-                    // when we save, it creates a temp file, and moves it to the file being modified
-                    // search for these cases and remove all of them
-                    int k;
-                    for (k = j + 1; k < c; k++) {
-                        dmon__inotify_event* third_ev = &_dmon.events[k];
-                        if (third_ev->mask & IN_MOVED_TO && check_ev->cookie == third_ev->cookie) {
-                            third_ev->mask = IN_MODIFY;    // change to modified
-                            ev->skip = check_ev->skip = true;
-                            loop_break = true;
-                            break;
-                        }
-                    }
-                } else if ((check_ev->mask & IN_MODIFY) && strcmp(ev->filepath, check_ev->filepath) == 0) {
-                    // Another case is that file is copied. CREATE and MODIFY happens sequentially
-                    // so we ignore MODIFY event
-                    check_ev->skip = true;
-                }
-            }
-        } else if (ev->mask & IN_MOVED_FROM) {
-            bool move_valid = false;
-            int j;
-            for (j = i + 1; j < c; j++) {
-                dmon__inotify_event* check_ev = &_dmon.events[j];
-                if (check_ev->mask & IN_MOVED_TO && ev->cookie == check_ev->cookie) {
-                    move_valid = true;
-                    break;
-                }
-            }
-
-            // in some environments like nautilus file explorer:
-            // when a file is deleted, it is moved to recycle bin
-            // so if the destination of the move is not valid, it's probably DELETE
-            if (!move_valid) {
-                ev->mask = IN_DELETE;
-            }
-        } else if (ev->mask & IN_MOVED_TO) {
-            bool move_valid = false;
-            int j;
-            for (j = 0; j < i; j++) {
-                dmon__inotify_event* check_ev = &_dmon.events[j];
-                if (check_ev->mask & IN_MOVED_FROM && ev->cookie == check_ev->cookie) {
-                    move_valid = true;
-                    break;
-                }
-            }
+    DMON_ASSERT(value >= 0);
+    if ((tbl->count + 1) * 2 > tbl->capacity) {
+        _dmon_hashtbl_reserve(tbl, tbl->count + 1);
+    }
 
-            // in some environments like nautilus file explorer:
-            // when a file is deleted, it is moved to recycle bin, on undo it is moved back it
-            // so if the destination of the move is not valid, it's probably CREATE
-            if (!move_valid) {
-                ev->mask = IN_CREATE;
-            }
-        } else if (ev->mask & IN_DELETE) {
-            int j;
-            for (j = i + 1; j < c; j++) {
-                dmon__inotify_event* check_ev = &_dmon.events[j];
-                // if the file is DELETED and then MODIFIED after, just ignore the modify event
-                if ((check_ev->mask & IN_MODIFY) && strcmp(ev->filepath, check_ev->filepath) == 0) {
-                    check_ev->skip = true;
-                    break;
-                }
-            }
+    uint32_t mask = (uint32_t)tbl->capacity - 1;
+    uint32_t i = _dmon_hash_u32(key) & mask;
+    while (tbl->values[i] != -1) {
+        if (tbl->keys[i] == key) {
+            tbl->values[i] = value;
+            return;
         }
+        i = (i + 1) & mask;
     }
+    tbl->keys[i] = key;
+    tbl->values[i] = value;
+    ++tbl->count;
+}
 
-    // trigger user callbacks
-    for (i = 0; i < stb_sb_count(_dmon.events); i++) {
-        dmon__inotify_event* ev = &_dmon.events[i];
-        if (ev->skip) {
-            continue;
-        }
-        dmon__watch_state* watch = _dmon.watches[ev->watch_id.id - 1];
+_DMON_PRIVATE void _dmon_hashtbl_remove(dmon__hashtbl* tbl, uint32_t key)
+{
+    if (tbl->count == 0) {
+        return;
+    }
 
-        if(watch == NULL || watch->watch_cb == NULL) {
-            continue;
+    uint32_t mask = (uint32_t)tbl->capacity - 1;
+    uint32_t i = _dmon_hash_u32(key) & mask;
+    while (tbl->values[i] != -1) {
+        if (tbl->keys[i] == key) {
+            break;
         }
+        i = (i + 1) & mask;
+    }
+    if (tbl->values[i] == -1) {
+        return;
+    }
 
-        if (ev->mask & IN_CREATE) {
-            if (ev->mask & IN_ISDIR) {
-                if (watch->watch_flags & DMON_WATCHFLAGS_RECURSIVE) {
-                    char watchdir[DMON_MAX_PATH];
-                    _dmon_strcpy(watchdir, sizeof(watchdir), watch->rootdir);
-                    _dmon_strcat(watchdir, sizeof(watchdir), ev->filepath);
-                    _dmon_strcat(watchdir, sizeof(watchdir), "/");
-                    uint32_t mask = IN_MOVED_TO | IN_CREATE | IN_MOVED_FROM | IN_DELETE | IN_MODIFY;
-                    int wd = inotify_add_watch(watch->fd, watchdir, mask);
-                    _DMON_UNUSED(wd);
-                    DMON_ASSERT(wd != -1);
-
-                    dmon__watch_subdir subdir;
-                    _dmon_strcpy(subdir.rootdir, sizeof(subdir.rootdir), watchdir);
-                    if (strstr(subdir.rootdir, watch->rootdir) == subdir.rootdir) {
-                        _dmon_strcpy(subdir.rootdir, sizeof(subdir.rootdir), watchdir + strlen(watch->rootdir));
-                    }
-
-                    stb_sb_push(watch->subdirs, subdir);
-                    stb_sb_push(watch->wds, wd);
-
-                    // some directories may be already created, for instance, with the command: mkdir -p
-                    // so we will enumerate them manually and add them to the events
-                    _dmon_gather_recursive(watch, watchdir);
-                    ev = &_dmon.events[i]; // gotta refresh the pointer because it may be relocated
-                }
+    // backward shift deletion: move the following entries of the probe sequence back into the hole,
+    // so we don't need tombstones
+    {
+        uint32_t j = i;
+        while (1) {
+            j = (j + 1) & mask;
+            if (tbl->values[j] == -1) {
+                break;
             }
-            watch->watch_cb(ev->watch_id, DMON_ACTION_CREATE, watch->rootdir, ev->filepath, NULL, watch->user_data);
-        }
-        else if (ev->mask & IN_MODIFY) {
-            watch->watch_cb(ev->watch_id, DMON_ACTION_MODIFY, watch->rootdir, ev->filepath, NULL, watch->user_data);
-        }
-        else if (ev->mask & IN_MOVED_FROM) {
-            int j;
-            for (j = i + 1; j < stb_sb_count(_dmon.events); j++) {
-                dmon__inotify_event* check_ev = &_dmon.events[j];
-                if (check_ev->mask & IN_MOVED_TO && ev->cookie == check_ev->cookie) {
-                    watch->watch_cb(check_ev->watch_id, DMON_ACTION_MOVE, watch->rootdir,
-                                    check_ev->filepath, ev->filepath, watch->user_data);
-                    break;
-                }
+            uint32_t home = _dmon_hash_u32(tbl->keys[j]) & mask;
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                tbl->keys[i] = tbl->keys[j];
+                tbl->values[i] = tbl->values[j];
+                i = j;
             }
         }
-        else if (ev->mask & IN_DELETE) {
-            watch->watch_cb(ev->watch_id, DMON_ACTION_DELETE, watch->rootdir, ev->filepath, NULL, watch->user_data);
-        }
     }
-
-    stb_sb_reset(_dmon.events);
+    tbl->values[i] = -1;
+    --tbl->count;
 }
 
-static void* _dmon_thread(void* arg)
+_DMON_PRIVATE int _dmon_watch_index(dmon_watch_id id)
 {
-    _DMON_UNUSED(arg);
-
-    static uint8_t buff[_DMON_TEMP_BUFFSIZE];
-    struct timespec req = { (time_t)DMON_SLEEP_INTERVAL / 1000, (long)(DMON_SLEEP_INTERVAL * 1000000) };
-    struct timespec rem = { 0, 0 };
-    struct timeval timeout;
-    uint64_t usecs_elapsed = 0;
-
-    struct timeval starttm;
-    gettimeofday(&starttm, 0);
-
-    while (__sync_bool_compare_and_swap(&_dmon.quit, false, false)) {
-        nanosleep(&req, &rem);
-        if (pthread_mutex_trylock(&_dmon.mutex) != 0) {
-            continue;
-        }
+    return (int)(id.id & _DMON_WATCH_INDEX_MASK) - 1;
+}
 
-        if (_dmon.num_watches == 0) {
-            pthread_mutex_unlock(&_dmon.mutex);
-            continue;
-        }
+// returns NULL if the id is not valid or the watch is already removed
+_DMON_PRIVATE dmon__watch_state* _dmon_get_watch(dmon__state* ctx, dmon_watch_id id)
+{
+    int index = _dmon_watch_index(id);
+    if (index < 0 || index >= stb_sb_count(ctx->watches)) {
+        return NULL;
+    }
 
-        // Create read FD set
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        {
-            int i;
-            for (i = 0; i < _dmon.num_watches; i++) {
-                dmon__watch_state* watch = _dmon.watches[i];
-                FD_SET(watch->fd, &rfds);
-            }
-        }
+    dmon__watch_state* watch = ctx->watches[index];
+    return (watch && watch->id.id == id.id) ? watch : NULL;
+}
 
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 100000;
-        if (select(FD_SETSIZE, &rfds, NULL, NULL, &timeout)) {
-            int i;
-            for (i = 0; i < _dmon.num_watches; i++) {
-                dmon__watch_state* watch = _dmon.watches[i];
-                if (FD_ISSET(watch->fd, &rfds)) {
-                    ssize_t offset = 0;
-                    ssize_t len = read(watch->fd, buff, _DMON_TEMP_BUFFSIZE);
-                    if (len <= 0) {
-                        continue;
-                    }
+// events of the inotify watches of the directories of a watch, for it's actions (DMON_ACTIONMASK bits)
+// the events that change the tree are always needed for the snapshot and recursion, the rest are only added for
+// the actions that want them, so the kernel doesn't queue the others. root is the root directory of the watch
+_DMON_PRIVATE uint32_t _dmon_inotify_mask(uint32_t actions, bool root)
+{
+    uint32_t mask = IN_MOVED_TO | IN_CREATE | IN_MOVED_FROM | IN_DELETE;
+    if (actions & DMON_ACTIONMASK(DMON_ACTION_MODIFY)) {
+        mask |= IN_MODIFY;
+    }
+    if (actions & DMON_ACTIONMASK(DMON_ACTION_CLOSE_WRITE)) {
+        mask |= IN_CLOSE_WRITE;
+    }
+    if (actions & DMON_ACTIONMASK(DMON_ACTION_ATTRIB)) {
+        mask |= IN_ATTRIB;
+    }
+    if (root && (actions & DMON_ACTIONMASK(DMON_ACTION_ROOT_DELETE))) {
+        mask |= IN_DELETE_SELF;
+    }
+    if (root && (actions & DMON_ACTIONMASK(DMON_ACTION_ROOT_MOVE))) {
+        mask |= IN_MOVE_SELF;
+    }
+    return mask;
+}
 
-                    while (offset < len) {
-                        struct inotify_event* iev = (struct inotify_event*)&buff[offset];
-
-                        const char *subdir = _dmon_find_subdir(watch, iev->wd);
-                        if (subdir) {
-                            char filepath[DMON_MAX_PATH];
-                            _dmon_strcpy(filepath, sizeof(filepath), subdir);
-                            _dmon_strcat(filepath, sizeof(filepath), iev->name);
-
-                            if (stb_sb_count(_dmon.events) == 0) {
-                                usecs_elapsed = 0;
-                            }
-                            dmon__inotify_event dev = { { 0 }, iev->mask, iev->cookie, watch->id, false };
-                            _dmon_strcpy(dev.filepath, sizeof(dev.filepath), filepath);
-                            stb_sb_push(_dmon.events, dev);
-                        }
+// inotify watches of a directory are shared by the watches, so the optional events that another watch wants
+// are dropped
+_DMON_PRIVATE bool _dmon_watch_accepts(const dmon__watch_state* watch, uint32_t mask, bool root)
+{
+    uint32_t optional = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+    return (mask & optional & ~_dmon_inotify_mask(watch->actions, root)) == 0;
+}
 
-                        offset += sizeof(struct inotify_event) + iev->len;
-                    }
-                }
-            }
-        }
+// modifications that are found by rescans and polls are reported as MODIFY to close-write watches too, since they
+// don't see the writes
+_DMON_PRIVATE bool _dmon_watch_wants(const dmon__watch_state* watch, dmon_action action)
+{
+    uint32_t bits = DMON_ACTIONMASK(action);
+    if (action == DMON_ACTION_MODIFY) {
+        bits |= DMON_ACTIONMASK(DMON_ACTION_CLOSE_WRITE);
+    }
+    return (watch->actions & bits) != 0;
+}
 
-        struct timeval tm;
-        gettimeofday(&tm, 0);
-        long dt = (tm.tv_sec - starttm.tv_sec) * 1000000 + tm.tv_usec - starttm.tv_usec;
-        starttm = tm;
-        usecs_elapsed += dt;
-        if (usecs_elapsed > 100000 && stb_sb_count(_dmon.events) > 0) {
-            _dmon_inotify_process_events();
-            usecs_elapsed = 0;
+// returns the ref of the watch for the wd, or -1 if the watch doesn't own the directory
+_DMON_PRIVATE int _dmon_find_wd_ref(dmon__state* ctx, int wd, int watch_index)
+{
+    int r;
+    for (r = _dmon_hashtbl_find(&ctx->wd_tbl, (uint32_t)wd); r != -1; r = ctx->wd_refs[r].next) {
+        if (ctx->wd_refs[r].watch == watch_index) {
+            return r;
         }
-
-        pthread_mutex_unlock(&_dmon.mutex);
     }
-    return 0x0;
+    return -1;
 }
 
-_DMON_PRIVATE void _dmon_unwatch(dmon__watch_state* watch)
+_DMON_PRIVATE uint32_t _dmon_hash_str(const char* str, int len)
 {
-    close(watch->fd);
-    stb_sb_free(watch->subdirs);
-    stb_sb_free(watch->wds);
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)str[i]) * 16777619u;
+    }
+    return hash;
 }
 
-DMON_API_IMPL void dmon_init(void)
+_DMON_PRIVATE const char* _dmon_event_path(dmon__state* ctx, const dmon__inotify_event* ev)
 {
-    DMON_ASSERT(!_dmon_init);
+    return ctx->event_paths + ev->path;
+}
 
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&_dmon.mutex, &attr);
+// queues an event for filepath "dir + name", the path is relative to the watch rootdir
+_DMON_PRIVATE void _dmon_push_event(dmon__state* ctx, dmon_watch_id watch_id, uint32_t mask, uint32_t cookie,
+                                    const char* dir, const char* name)
+{
+    int dirlen = (int)strlen(dir);
+    int namelen = (int)strlen(name);
+    int len = dirlen + namelen;
+    char* filepath = stb_sb_add(ctx->event_paths, len + 1);
+    memcpy(filepath, dir, dirlen);
+    memcpy(filepath + dirlen, name, namelen);
+
+    // in some cases, particularly when created files under sub directories
+    // there can be events for a single subdir one with trailing slash and one without
+    // so we remove the trailing slash here, then paths can be compared with no extra work
+    if (len > 0 && filepath[len - 1] == '/') {
+        --len;
+    }
+    filepath[len] = '\0';
+
+    dmon__inotify_event* ev = stb_sb_add(ctx->events, 1);
+    ev->mask = mask;
+    ev->cookie = cookie;
+    ev->hash = _dmon_hash_str(filepath, len) ^ _dmon_hash_u32(watch_id.id);
+    ev->path = (uint32_t)(filepath - ctx->event_paths);
+    ev->len = len;
+    ev->watch_id = watch_id;
+    ev->skip = false;
+}
 
-    int r = pthread_create(&_dmon.thread_handle, NULL, _dmon_thread, NULL);
+_DMON_PRIVATE void _dmon_wake_thread(dmon__state* ctx)
+{
+    uint64_t one = 1;
+    ssize_t r = write(ctx->wake_fd, &one, sizeof(one));
     _DMON_UNUSED(r);
-    DMON_ASSERT(r == 0 && "pthread_create failed");
-
-    for (int i = 0; i < DMON_MAX_WATCHES; i++)
-        _dmon.freelist[i] = DMON_MAX_WATCHES - i - 1;
-
-    _dmon_init = true;
 }
 
-DMON_API_IMPL void dmon_deinit(void)
+_DMON_PRIVATE uint64_t _dmon_now_ns(void)
 {
-    DMON_ASSERT(_dmon_init);
-    _DMON_UNUSED(__sync_lock_test_and_set(&_dmon.quit, true));
-    pthread_join(_dmon.thread_handle, NULL);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
-    {
-        int i;
-        for (i = 0; i < _dmon.num_watches; i++) {
-            if (_dmon.watches[i]) {
-                _dmon_unwatch(_dmon.watches[i]);
-                DMON_FREE(_dmon.watches[i]);
-            }
-        }
+// the callback may remove the watch, so it's looked up again
+_DMON_PRIVATE void _dmon_stat_callback(dmon__state* ctx, dmon_watch_id id, uint64_t start)
+{
+    uint64_t ns = _dmon_now_ns() - start;
+    dmon__watch_state* watch = _dmon_get_watch(ctx, id);
+    _DMON_STAT_ADD(ctx, watch, callback_ns, ns);
+    _dmon_stat_max(&ctx->stats.callback_max_ns, ns);
+    if (watch) {
+        _dmon_stat_max(&watch->stats.callback_max_ns, ns);
     }
-
-    pthread_mutex_destroy(&_dmon.mutex);
-    stb_sb_free(_dmon.events);
-    memset(&_dmon, 0x0, sizeof(_dmon));
-    _dmon_init = false;
 }
 
-DMON_API_IMPL dmon_watch_id dmon_watch(const char* rootdir,
-                                       void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
-                                                        const char* dirname, const char* filename,
-                                                        const char* oldname, void* user),
-                                       uint32_t flags, void* user_data)
+_DMON_PRIVATE void _dmon_clock_coarse(struct timespec* ts)
 {
-	DMON_ASSERT(_dmon_init);
-    DMON_ASSERT(watch_cb);
-    DMON_ASSERT(rootdir && rootdir[0]);
+    // file timestamps are taken from the coarse clock, so they can be behind the precise one
+#ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, ts);
+#else
+    clock_gettime(CLOCK_REALTIME, ts);
+#endif
+}
 
-    pthread_mutex_lock(&_dmon.mutex);
+_DMON_PRIVATE bool _dmon_timespec_less(const struct timespec* a, const struct timespec* b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
 
-    DMON_ASSERT(_dmon.num_watches < DMON_MAX_WATCHES);
-    if (_dmon.num_watches >= DMON_MAX_WATCHES) {
-        DMON_LOG_ERROR("Exceeding maximum number of watches");
-        pthread_mutex_unlock(&_dmon.mutex);
-        return _dmon_make_id(0);
+// directory found by the crawler, path is absolute and ends with a slash
+typedef struct dmon__crawl_dir {
+    char path[DMON_MAX_PATH];
+    int wd;                     // -1 if the directory is not crawled by this thread
+    bool is_link;               // path is resolved from a symlink, so it's not a child of the parent path
+    struct timespec registered; // async crawl: time when the directory is added to the watch
+} dmon__crawl_dir;
+
+// shared state of the crawler threads. every thread crawls the sub-tree of the directory it takes from the queue
+// depth-first on it's own, and gives away directories to the queue when there are idle threads
+// the crawl is finished when the queue is empty and no thread is busy anymore
+typedef struct dmon__crawl {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    dmon__crawl_dir* dirs;
+    int* queue;             // indices into dirs
+    dmon__hashtbl seen;     // wd -> index into dirs, stops symlink loops
+    int num_busy;
+    int num_waiting;        // threads that are waiting for the queue
+    dmon__state* ctx;       // context of the watch, the threads of the crawl use it
+    int watch_index;
+    uint32_t mask;
+    bool followlinks;
+    bool cancelled;
+    dmon__ignore* ignore;       // rules of the watch, retained for the crawl
+    dmon_watch_id async_id;     // non-zero for async crawls, which add the directories to the watch as they go
+    char rootdir[DMON_MAX_PATH];
+    int rootdir_len;
+    char* entries;              // sync crawl: packed entries for the snapshot (dmon__snapshot_stat, then path)
+    bool stat;                  // files are kept and stat'ed for DMON_WATCHFLAGS_SNAPSHOT
+    struct timespec start;      // async crawl: time when the watch is requested
+    uint64_t dirs_skipped;      // updated atomically by the threads
+} dmon__crawl;
+
+// directory that a crawler thread is walking, the thread keeps one open fd for each level
+typedef struct dmon__crawl_frame {
+    int fd;
+    int path_len;
+    int child;          // next child to visit, index into the children of the thread
+    int children_end;
+    int dir;            // the directory itself, index into the children of the parent
+    bool read;
+} dmon__crawl_frame;
+
+#define _DMON_CRAWL_BUFFSIZE (64 * 1024)
+#define _DMON_CRAWL_MAX_DEPTH 64    // deeper directories are given to the queue, so they are opened by path
+
+#if __FreeBSD__
+typedef struct dirent dmon__dirent;
+#else
+// record of the getdents64 syscall, glibc does not always declare it
+typedef struct dmon__dirent {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+} dmon__dirent;
+#endif
+
+// reads as many directory entries as fit into buff with a single syscall, returns 0 at the end of the directory
+_DMON_PRIVATE int _dmon_getdents(int fd, char* buff, int size)
+{
+#if __FreeBSD__
+    return (int)getdents(fd, buff, (size_t)size);
+#else
+    return (int)syscall(SYS_getdents64, fd, buff, size);
+#endif
+}
+
+#if !__FreeBSD__ && defined(SYS_statx)
+// record of the statx syscall, glibc does not always declare it. the fields after the birth time are not used
+typedef struct dmon__statx_time {
+    int64_t tv_sec;
+    uint32_t tv_nsec;
+    int32_t reserved;
+} dmon__statx_time;
+
+typedef struct dmon__statx {
+    uint32_t mask;
+    uint32_t blksize;
+    uint64_t attributes;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint16_t mode;
+    uint16_t spare;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t blocks;
+    uint64_t attributes_mask;
+    dmon__statx_time atime;
+    dmon__statx_time btime;
+    uint8_t rest[160];      // the kernel writes 256 bytes
+} dmon__statx;
+
+#define _DMON_STATX_BTIME 0x800
+#endif
+
+// time that the entry is created, if the file system keeps it. otherwise it's the last change of the entry
+// (ctime), which is also updated by writes, chmod and links. returns false if the entry is not there
+_DMON_PRIVATE bool _dmon_created_time(int dirfd, const char* name, struct timespec* created)
+{
+    struct stat st;
+#if !__FreeBSD__ && defined(SYS_statx)
+    dmon__statx stx;
+    if (syscall(SYS_statx, dirfd, name, AT_SYMLINK_NOFOLLOW, _DMON_STATX_BTIME, &stx) == 0 &&
+        (stx.mask & _DMON_STATX_BTIME)) {
+        created->tv_sec = (time_t)stx.btime.tv_sec;
+        created->tv_nsec = (long)stx.btime.tv_nsec;
+        return true;
+    }
+#endif
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return false;
+    }
+#if __FreeBSD__
+    *created = st.st_birthtim.tv_sec > 0 ? st.st_birthtim : st.st_ctim;
+#else
+    *created = st.st_ctim;
+#endif
+    return true;
+}
+
+// returns the type of the entry, file systems that don't fill d_type need an extra stat
+_DMON_PRIVATE unsigned char _dmon_mode_type(mode_t mode)
+{
+    return S_ISDIR(mode) ? DT_DIR : (S_ISLNK(mode) ? DT_LNK : DT_REG);
+}
+
+_DMON_PRIVATE unsigned char _dmon_dirent_type(int dirfd, const dmon__dirent* entry)
+{
+    if (entry->d_type != DT_UNKNOWN) {
+        return entry->d_type;
+    }
+
+    struct stat st;
+    if (fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return DT_UNKNOWN;
+    }
+    return _dmon_mode_type(st.st_mode);
+}
+
+_DMON_PRIVATE bool _dmon_dirent_isdots(const dmon__dirent* entry)
+{
+    return entry->d_name[0] == '.' &&
+           (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0'));
+}
+
+// matches the character with the class that starts after '[', returns the closing ']' or NULL if it's not closed
+_DMON_PRIVATE const char* _dmon_glob_class(const char* p, char c, bool* matched)
+{
+    bool negate = p[0] == '!' || p[0] == '^';
+    if (negate) {
+        ++p;
+    }
+
+    const char* start = p;
+    bool found = false;
+    for (; p[0] != '\0' && (p[0] != ']' || p == start); ++p) {
+        unsigned char lo = (unsigned char)p[0], hi = (unsigned char)p[0];
+        if (p[1] == '-' && p[2] != '\0' && p[2] != ']') {
+            hi = (unsigned char)p[2];
+            p += 2;
+        }
+        found |= (unsigned char)c >= lo && (unsigned char)c <= hi;
+    }
+    *matched = found != negate && c != '/';
+    return p[0] == ']' ? p : NULL;
+}
+
+// gitignore globs: '*', '?' and classes don't match '/', "**" matches across directories and "**/" also matches
+// no directory at all
+_DMON_PRIVATE bool _dmon_glob_match(const char* p, const char* s)
+{
+    for (;;) {
+        if (p[0] == '*') {
+            bool any = p[1] == '*';
+            p += any ? 2 : 1;
+            if (any && p[0] == '/') {
+                for (++p;; ++s) {
+                    if (_dmon_glob_match(p, s)) {
+                        return true;
+                    }
+                    s = strchr(s, '/');
+                    if (s == NULL) {
+                        return false;
+                    }
+                }
+            }
+            if (p[0] == '\0') {
+                return any || strchr(s, '/') == NULL;
+            }
+            for (;; ++s) {
+                if (_dmon_glob_match(p, s)) {
+                    return true;
+                }
+                if (s[0] == '\0' || (!any && s[0] == '/')) {
+                    return false;
+                }
+            }
+        }
+
+        if (p[0] == '\0' || s[0] == '\0') {
+            return p[0] == s[0];
+        }
+
+        bool matched;
+        const char* class_end;
+        if (p[0] == '?') {
+            if (s[0] == '/') {
+                return false;
+            }
+        } else if (p[0] == '[' && (class_end = _dmon_glob_class(p + 1, s[0], &matched)) != NULL) {
+            if (!matched) {
+                return false;
+            }
+            p = class_end;
+        } else {
+            if (p[0] == '\\' && p[1] != '\0') {
+                ++p;
+            }
+            if (p[0] != s[0]) {
+                return false;
+            }
+        }
+        ++p;
+        ++s;
+    }
+}
+
+// compiles newline separated gitignore-style patterns: blank lines and lines that start with '#' are skipped,
+// '!' includes the entries that are excluded by the previous rules, a trailing slash only matches directories and
+// a slash at the start or in the middle anchors the pattern to rootdir, otherwise it's matched with the names
+// returns NULL if there are no rules
+_DMON_PRIVATE dmon__ignore* _dmon_ignore_compile(const char* text)
+{
+    dmon__ignore* ignore = NULL;
+    while (text && text[0] != '\0') {
+        const char* line = text;
+        const char* end = strchr(line, '\n');
+        if (end == NULL) {
+            end = line + strlen(line);
+        }
+        text = end[0] != '\0' ? end + 1 : end;
+
+        // trailing spaces are ignored, unless they are escaped
+        while (end > line && (end[-1] == '\r' || (end[-1] == ' ' && (end - 1 == line || end[-2] != '\\')))) {
+            --end;
+        }
+        if (line == end || line[0] == '#') {
+            continue;
+        }
+
+        dmon__ignore_rule rule;
+        memset(&rule, 0x0, sizeof(rule));
+        if (line[0] == '!') {
+            rule.negate = true;
+            ++line;
+        } else if (line[0] == '\\' && (line[1] == '#' || line[1] == '!')) {
+            ++line;
+        }
+        if (end > line && end[-1] == '/') {
+            rule.dir_only = true;
+            --end;
+        }
+        if (end > line && line[0] == '/') {
+            rule.anchored = true;
+            ++line;
+        }
+        // "**/name" matches the name in any directory
+        if (!rule.anchored && end - line > 3 && memcmp(line, "**/", 3) == 0 && !memchr(line + 3, '/', end - line - 3)) {
+            line += 3;
+        }
+        if (line == end) {
+            continue;
+        }
+
+        rule.len = (int)(end - line);
+        rule.anchored |= memchr(line, '/', rule.len) != NULL;
+        const char* c;
+        rule.kind = _DMON_IGNORE_NAME;
+        for (c = line; c < end; c++) {
+            if (c[0] == '*' || c[0] == '?' || c[0] == '[' || c[0] == '\\') {
+                rule.kind = c == line && c[0] == '*' ? _DMON_IGNORE_SUFFIX : _DMON_IGNORE_GLOB;
+                if (rule.kind == _DMON_IGNORE_GLOB) {
+                    break;
+                }
+            }
+        }
+        if (rule.anchored) {
+            rule.kind = _DMON_IGNORE_GLOB;
+        }
+
+        if (ignore == NULL) {
+            ignore = (dmon__ignore*)DMON_MALLOC(sizeof(dmon__ignore));
+            DMON_ASSERT(ignore);
+            if (ignore == NULL) {
+                return NULL;
+            }
+            memset(ignore, 0x0, sizeof(dmon__ignore));
+            ignore->refs = 1;
+        }
+        rule.pattern = stb_sb_count(ignore->patterns);
+        char* pattern = stb_sb_add(ignore->patterns, rule.len + 1);
+        memcpy(pattern, line, rule.len);
+        pattern[rule.len] = '\0';
+        stb_sb_push(ignore->rules, rule);
+        ignore->anchored |= rule.anchored;
+    }
+    return ignore;
+}
+
+_DMON_PRIVATE dmon__ignore* _dmon_ignore_retain(dmon__ignore* ignore)
+{
+    if (ignore) {
+        __sync_fetch_and_add(&ignore->refs, 1);
+    }
+    return ignore;
+}
+
+_DMON_PRIVATE void _dmon_ignore_release(dmon__ignore* ignore)
+{
+    if (ignore && __sync_sub_and_fetch(&ignore->refs, 1) == 0) {
+        stb_sb_free(ignore->rules);
+        stb_sb_free(ignore->patterns);
+        DMON_FREE(ignore);
+    }
+}
+
+// returns true if the entry is excluded by the rules, the last rule that matches the entry wins
+// reldir is the directory of the entry relative to rootdir, with a trailing slash
+_DMON_PRIVATE bool _dmon_ignore_match(const dmon__ignore* ignore, const char* reldir, int reldir_len,
+                                      const char* name, int name_len, bool is_dir)
+{
+    char path[DMON_MAX_PATH];
+    if (ignore->anchored) {
+        if (reldir_len + name_len >= (int)sizeof(path)) {
+            return false;
+        }
+        memcpy(path, reldir, reldir_len);
+        memcpy(path + reldir_len, name, name_len);
+        path[reldir_len + name_len] = '\0';
+    }
+
+    int i;
+    for (i = stb_sb_count(ignore->rules) - 1; i >= 0; i--) {
+        const dmon__ignore_rule* rule = &ignore->rules[i];
+        const char* pattern = ignore->patterns + rule->pattern;
+        if (rule->dir_only && !is_dir) {
+            continue;
+        }
+
+        bool matched;
+        if (rule->kind == _DMON_IGNORE_NAME) {
+            matched = rule->len == name_len && memcmp(pattern, name, name_len) == 0;
+        } else if (rule->kind == _DMON_IGNORE_SUFFIX) {
+            matched = rule->len - 1 <= name_len &&
+                      memcmp(pattern + 1, name + name_len - (rule->len - 1), rule->len - 1) == 0;
+        } else if (rule->anchored) {
+            matched = _dmon_glob_match(pattern, path);
+        } else {
+            // names that are not terminated are copied for the glob
+            char namebuf[DMON_MAX_PATH];
+            const char* n = name;
+            if (name[name_len] != '\0') {
+                int len = _dmon_min(name_len, (int)sizeof(namebuf) - 1);
+                memcpy(namebuf, name, len);
+                namebuf[len] = '\0';
+                n = namebuf;
+            }
+            matched = _dmon_glob_match(pattern, n);
+        }
+        if (matched) {
+            return !rule->negate;
+        }
+    }
+    return false;
+}
+
+_DMON_PRIVATE bool _dmon_ignored(const dmon__ignore* ignore, const char* reldir, const char* name, bool is_dir)
+{
+    return ignore && name[0] != '\0' &&
+           _dmon_ignore_match(ignore, reldir, (int)strlen(reldir), name, (int)strlen(name), is_dir);
+}
+
+// same as _dmon_ignored, but the parent directories of the entry are checked too, for events of the directories
+// that are not pruned by the crawl (fanotify)
+_DMON_PRIVATE bool _dmon_ignored_path(const dmon__ignore* ignore, const char* reldir, const char* name, bool is_dir)
+{
+    if (ignore == NULL) {
+        return false;
+    }
+
+    const char* dir = reldir;
+    const char* slash;
+    while ((slash = strchr(dir, '/')) != NULL) {
+        if (slash > dir && _dmon_ignore_match(ignore, reldir, (int)(dir - reldir), dir, (int)(slash - dir), true)) {
+            return true;
+        }
+        dir = slash + 1;
+    }
+    return _dmon_ignored(ignore, reldir, name, is_dir);
+}
+
+_DMON_PRIVATE uint32_t _dmon_snapshot_hash(int parent, const char* name, int len)
+{
+    return _dmon_hash_str(name, len) ^ _dmon_hash_u32((uint32_t)parent);
+}
+
+// returns the offset of the name in names, it's added if it's not there yet. each name is prefixed with the offset
+// of the next name with the same hash
+_DMON_PRIVATE uint32_t _dmon_intern(char** names, dmon__hashtbl* name_tbl, const char* name, int len)
+{
+    uint32_t hash = _dmon_hash_str(name, len);
+    int head = _dmon_hashtbl_find(name_tbl, hash);
+    int offset = head;
+    while (offset != -1) {
+        const char* s = *names + offset;
+        if (strncmp(s, name, len) == 0 && s[len] == '\0') {
+            return (uint32_t)offset;
+        }
+        memcpy(&offset, s - sizeof(int), sizeof(int));
+    }
+
+    char* p = stb_sb_add(*names, (int)sizeof(int) + len + 1);
+    memcpy(p, &head, sizeof(int));
+    memcpy(p + sizeof(int), name, len);
+    p[sizeof(int) + len] = '\0';
+    offset = (int)(p + sizeof(int) - *names);
+    _dmon_hashtbl_insert(name_tbl, hash, offset);
+    return (uint32_t)offset;
+}
+
+_DMON_PRIVATE uint32_t _dmon_snapshot_intern(dmon__snapshot* snap, const char* name, int len)
+{
+    return _dmon_intern(&snap->names, &snap->name_tbl, name, len);
+}
+
+_DMON_PRIVATE void _dmon_snapshot_init(dmon__snapshot* snap)
+{
+    memset(snap, 0x0, sizeof(*snap));
+    snap->free_node = -1;
+
+    dmon__snapshot_node* root = stb_sb_add(snap->nodes, 1);
+    memset(root, 0x0, sizeof(*root));
+    root->st.type = DT_DIR;
+    root->parent = root->first_child = root->prev_sibling = root->next_sibling = root->next = -1;
+}
+
+_DMON_PRIVATE void _dmon_snapshot_free(dmon__snapshot* snap)
+{
+    stb_sb_free(snap->nodes);
+    stb_sb_free(snap->names);
+    _dmon_hashtbl_free(&snap->tbl);
+    _dmon_hashtbl_free(&snap->name_tbl);
+    memset(snap, 0x0, sizeof(*snap));
+}
+
+// returns the child of the directory node with the name, or -1
+_DMON_PRIVATE int _dmon_snapshot_child(const dmon__snapshot* snap, int parent, const char* name, int len)
+{
+    int n;
+    for (n = _dmon_hashtbl_find(&snap->tbl, _dmon_snapshot_hash(parent, name, len)); n != -1; n = snap->nodes[n].next) {
+        const char* s = snap->names + snap->nodes[n].name;
+        if (snap->nodes[n].parent == parent && strncmp(s, name, len) == 0 && s[len] == '\0') {
+            return n;
+        }
+    }
+    return -1;
+}
+
+// returns the node of the path (relative to rootdir), or -1
+_DMON_PRIVATE int _dmon_snapshot_lookup(const dmon__snapshot* snap, const char* path)
+{
+    int n = stb_sb_count(snap->nodes) > 0 ? 0 : -1;
+    while (*path && n != -1) {
+        const char* slash = strchr(path, '/');
+        int len = slash ? (int)(slash - path) : (int)strlen(path);
+        if (len > 0) {
+            n = _dmon_snapshot_child(snap, n, path, len);
+        }
+        path += len + (slash ? 1 : 0);
+    }
+    return n;
+}
+
+// writes the path of the node (relative to rootdir), returns false if it doesn't fit
+_DMON_PRIVATE bool _dmon_snapshot_path(const dmon__snapshot* snap, int n, char* path, int path_size)
+{
+    int len = -1, m;
+    for (m = n; m > 0; m = snap->nodes[m].parent) {
+        len += (int)strlen(snap->names + snap->nodes[m].name) + 1;
+    }
+    if (len + 1 > path_size) {
+        return false;
+    }
+
+    path[_dmon_max(len, 0)] = '\0';
+    for (m = n; m > 0; m = snap->nodes[m].parent) {
+        const char* name = snap->names + snap->nodes[m].name;
+        int name_len = (int)strlen(name);
+        len -= name_len;
+        memcpy(path + len, name, name_len);
+        if (--len >= 0) {
+            path[len] = '/';
+        }
+    }
+    return true;
+}
+
+_DMON_PRIVATE void _dmon_snapshot_link(dmon__snapshot* snap, int n, int parent, uint32_t name)
+{
+    dmon__snapshot_node* node = &snap->nodes[n];
+    int len = (int)strlen(snap->names + name);
+    node->name = name;
+    node->parent = parent;
+    node->hash = _dmon_snapshot_hash(parent, snap->names + name, len);
+    node->next = _dmon_hashtbl_find(&snap->tbl, node->hash);
+    _dmon_hashtbl_insert(&snap->tbl, node->hash, n);
+
+    node->prev_sibling = -1;
+    node->next_sibling = snap->nodes[parent].first_child;
+    if (node->next_sibling != -1) {
+        snap->nodes[node->next_sibling].prev_sibling = n;
+    }
+    snap->nodes[parent].first_child = n;
+    snap->live_names += len + 1;
+}
+
+_DMON_PRIVATE void _dmon_snapshot_unlink(dmon__snapshot* snap, int n)
+{
+    dmon__snapshot_node* node = &snap->nodes[n];
+    int head = _dmon_hashtbl_find(&snap->tbl, node->hash);
+    if (head == n) {
+        if (node->next != -1) {
+            _dmon_hashtbl_insert(&snap->tbl, node->hash, node->next);
+        } else {
+            _dmon_hashtbl_remove(&snap->tbl, node->hash);
+        }
+    } else {
+        int prev = head;
+        while (snap->nodes[prev].next != n) {
+            prev = snap->nodes[prev].next;
+        }
+        snap->nodes[prev].next = node->next;
+    }
+
+    if (node->prev_sibling != -1) {
+        snap->nodes[node->prev_sibling].next_sibling = node->next_sibling;
+    } else {
+        snap->nodes[node->parent].first_child = node->next_sibling;
+    }
+    if (node->next_sibling != -1) {
+        snap->nodes[node->next_sibling].prev_sibling = node->prev_sibling;
+    }
+    snap->live_names -= (int)strlen(snap->names + node->name) + 1;
+}
+
+// packs the names of the live nodes, once the names of the removed nodes take more than half of the buffer
+_DMON_PRIVATE void _dmon_snapshot_compact(dmon__snapshot* snap)
+{
+    int size = stb_sb_count(snap->names);
+    if (size < 64 * 1024 || size < snap->live_names * 2) {
+        return;
+    }
+
+    char* names = snap->names;
+    snap->names = NULL;
+    _dmon_hashtbl_clear(&snap->name_tbl);
+    int n;
+    for (n = 1; n < stb_sb_count(snap->nodes); n++) {
+        if (snap->nodes[n].parent != -1) {
+            const char* name = names + snap->nodes[n].name;
+            snap->nodes[n].name = _dmon_snapshot_intern(snap, name, (int)strlen(name));
+        }
+    }
+    stb_sb_free(names);
+}
+
+// adds the entry to the directory node, or updates it if it's already there. returns the node
+_DMON_PRIVATE int _dmon_snapshot_add(dmon__snapshot* snap, int parent, const char* name, int len,
+                                     const dmon__snapshot_stat* st)
+{
+    int n = _dmon_snapshot_child(snap, parent, name, len);
+    if (n == -1) {
+        uint32_t name_offset = _dmon_snapshot_intern(snap, name, len);
+        dmon__snapshot_node* node;
+        if (snap->free_node != -1) {
+            n = snap->free_node;
+            node = &snap->nodes[n];
+            snap->free_node = node->next_sibling;
+        } else {
+            n = stb_sb_count(snap->nodes);
+            node = stb_sb_add(snap->nodes, 1);
+        }
+        node->first_child = -1;
+        _dmon_snapshot_link(snap, n, parent, name_offset);
+    }
+    snap->nodes[n].st = *st;
+    return n;
+}
+
+// adds the entry of the path (relative to rootdir), missing parent directories are added too
+_DMON_PRIVATE int _dmon_snapshot_add_path(dmon__snapshot* snap, const char* path, const dmon__snapshot_stat* st)
+{
+    dmon__snapshot_stat dir_st;
+    memset(&dir_st, 0x0, sizeof(dir_st));
+    dir_st.type = DT_DIR;
+
+    int n = 0;
+    for (;;) {
+        const char* slash = strchr(path, '/');
+        if (slash == NULL || slash[1] == '\0') {
+            int len = slash ? (int)(slash - path) : (int)strlen(path);
+            return len > 0 ? _dmon_snapshot_add(snap, n, path, len, st) : n;
+        }
+
+        int len = (int)(slash - path);
+        if (len > 0) {
+            int child = _dmon_snapshot_child(snap, n, path, len);
+            n = child != -1 ? child : _dmon_snapshot_add(snap, n, path, len, &dir_st);
+        }
+        path = slash + 1;
+    }
+}
+
+// removes the node and everything under it
+_DMON_PRIVATE void _dmon_snapshot_remove(dmon__snapshot* snap, int n)
+{
+    DMON_ASSERT(n > 0);
+    _dmon_snapshot_unlink(snap, n);
+
+    // free the sub-tree from the leaves up
+    int cur = n;
+    for (;;) {
+        while (snap->nodes[cur].first_child != -1) {
+            cur = snap->nodes[cur].first_child;
+        }
+
+        int parent = snap->nodes[cur].parent;
+        if (cur != n) {
+            _dmon_snapshot_unlink(snap, cur);
+        }
+        snap->nodes[cur].parent = -1;
+        snap->nodes[cur].next_sibling = snap->free_node;
+        snap->free_node = cur;
+        if (cur == n) {
+            break;
+        }
+        cur = parent;
+    }
+    _dmon_snapshot_compact(snap);
+}
+
+// moves the node under the directory node with a new name, the nodes under it stay as they are
+_DMON_PRIVATE void _dmon_snapshot_move(dmon__snapshot* snap, int n, int parent, const char* name, int len)
+{
+    DMON_ASSERT(n > 0);
+    int dst = _dmon_snapshot_child(snap, parent, name, len);
+    if (dst == n) {
+        return;
+    }
+    if (dst != -1) {
+        _dmon_snapshot_remove(snap, dst);   // replaced by the moved entry
+    }
+
+    uint32_t name_offset = _dmon_snapshot_intern(snap, name, len);
+    _dmon_snapshot_unlink(snap, n);
+    _dmon_snapshot_link(snap, n, parent, name_offset);
+    _dmon_snapshot_compact(snap);
+}
+
+_DMON_PRIVATE void _dmon_snapshot_from_stat(const struct stat* s, dmon__snapshot_stat* st)
+{
+    st->inode = (uint64_t)s->st_ino;
+    st->size = (int64_t)s->st_size;
+    st->mtime = (int64_t)s->st_mtim.tv_sec * 1000000000 + (int64_t)s->st_mtim.tv_nsec;
+    st->type = _dmon_mode_type(s->st_mode);
+    st->has_stat = true;
+}
+
+// fills the entry from the directory record, size and mtime are only read if full is set
+_DMON_PRIVATE void _dmon_snapshot_stat_dirent(int dirfd, const dmon__dirent* entry, unsigned char type, bool full,
+                                              dmon__snapshot_stat* st)
+{
+    memset(st, 0x0, sizeof(*st));
+    st->inode = (uint64_t)entry->d_ino;
+    st->type = type;
+
+    struct stat s;
+    if (full && fstatat(dirfd, entry->d_name, &s, AT_SYMLINK_NOFOLLOW) == 0) {
+        _dmon_snapshot_from_stat(&s, st);
+    }
+}
+
+// adds the entries of the directory (relative to rootdir, with trailing slash) to the snapshot, files are only
+// added for DMON_WATCHFLAGS_SNAPSHOT
+_DMON_PRIVATE void _dmon_snapshot_read_dir(dmon__watch_state* watch, const char* reldir)
+{
+    char dirname[DMON_MAX_PATH];
+    _dmon_strcpy(dirname, sizeof(dirname), watch->rootdir);
+    _dmon_strcat(dirname, sizeof(dirname), reldir);
+    int fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+
+    dmon__snapshot_stat st;
+    memset(&st, 0x0, sizeof(st));
+    st.type = DT_DIR;
+    int dir = _dmon_snapshot_lookup(&watch->snapshot, reldir);
+    if (dir == -1) {
+        dir = _dmon_snapshot_add_path(&watch->snapshot, reldir, &st);
+    }
+
+    bool full = (watch->watch_flags & DMON_WATCHFLAGS_SNAPSHOT) != 0;
+    uint64_t buff[512];     // aligned for the records
+    int len;
+    while ((len = _dmon_getdents(fd, (char*)buff, sizeof(buff))) > 0) {
+        int offset;
+        for (offset = 0; offset < len; offset += ((dmon__dirent*)((char*)buff + offset))->d_reclen) {
+            const dmon__dirent* entry = (const dmon__dirent*)((char*)buff + offset);
+            if (_dmon_dirent_isdots(entry)) {
+                continue;
+            }
+            unsigned char type = _dmon_dirent_type(fd, entry);
+            if ((full || type == DT_DIR) && !_dmon_ignored(watch->ignore, reldir, entry->d_name, type == DT_DIR)) {
+                _dmon_snapshot_stat_dirent(fd, entry, type, full, &st);
+                _dmon_snapshot_add(&watch->snapshot, dir, entry->d_name, (int)strlen(entry->d_name), &st);
+            }
+        }
+    }
+    close(fd);
+}
+
+// removes the entries that are directly in the directory (relative to rootdir) when it's not watched anymore
+// directories that have watched entries under them are kept
+_DMON_PRIVATE void _dmon_snapshot_remove_dir(dmon__snapshot* snap, const char* reldir)
+{
+    int dir = _dmon_snapshot_lookup(snap, reldir);
+    if (dir == -1) {
+        return;
+    }
+
+    int n = snap->nodes[dir].first_child;
+    while (n != -1) {
+        int next = snap->nodes[n].next_sibling;
+        if (snap->nodes[n].first_child == -1) {
+            _dmon_snapshot_remove(snap, n);
+        }
+        n = next;
+    }
+}
+
+// adds the packed entries of the crawler (dmon__snapshot_stat, then path) to the snapshot
+_DMON_PRIVATE void _dmon_snapshot_add_packed(dmon__snapshot* snap, const char* entries)
+{
+    // entries come in runs of the same directory, so the directory node is looked up once for each run
+    char dirpath[DMON_MAX_PATH];
+    int dirpath_len = -1;
+    int dir = 0;
+
+    int offset = 0, count = stb_sb_count(entries);
+    while (offset < count) {
+        dmon__snapshot_stat st;
+        memcpy(&st, entries + offset, sizeof(st));
+        const char* path = entries + offset + sizeof(st);
+        int len = (int)strlen(path);
+        offset += (int)sizeof(st) + len + 1;
+        if (len == 0) {
+            snap->nodes[0].st = st;     // root directory
+            continue;
+        }
+
+        const char* name = strrchr(path, '/');
+        name = name ? name + 1 : path;
+
+        int path_len = (int)(name - path);
+        if (path_len != dirpath_len || memcmp(path, dirpath, path_len) != 0) {
+            memcpy(dirpath, path, path_len);
+            dirpath[path_len] = '\0';
+            dirpath_len = path_len;
+            dir = _dmon_snapshot_lookup(snap, dirpath);
+            if (dir == -1) {
+                dmon__snapshot_stat dir_st;
+                memset(&dir_st, 0x0, sizeof(dir_st));
+                dir_st.type = DT_DIR;
+                dir = _dmon_snapshot_add_path(snap, dirpath, &dir_st);
+            }
+        }
+        _dmon_snapshot_add(snap, dir, name, len - path_len, &st);
+    }
+}
+
+// watched directories of a watch are a tree like the snapshot: nodes only keep their name and are linked to their
+// parent, so moving a directory is a single node update, and the paths are only built for the events. the root
+// directory (empty name) and the directories that are resolved from symlinks out of the root (absolute path as name)
+// are the top nodes
+_DMON_PRIVATE void _dmon_subdir_link(dmon__watch_state* watch, int n, int parent, uint32_t name)
+{
+    dmon__watch_subdir* node = &watch->subdirs[n];
+    int len = (int)strlen(watch->subdir_names + name);
+    uint32_t hash = _dmon_snapshot_hash(parent, watch->subdir_names + name, len);
+    node->name = name;
+    node->parent = parent;
+    node->next = _dmon_hashtbl_find(&watch->subdir_tbl, hash);
+    _dmon_hashtbl_insert(&watch->subdir_tbl, hash, n);
+
+    node->prev_sibling = -1;
+    node->next_sibling = -1;
+    if (parent != -1) {
+        node->next_sibling = watch->subdirs[parent].first_child;
+        if (node->next_sibling != -1) {
+            watch->subdirs[node->next_sibling].prev_sibling = n;
+        }
+        watch->subdirs[parent].first_child = n;
+    }
+    watch->live_subdir_names += len + 1;
+}
+
+_DMON_PRIVATE void _dmon_subdir_unlink(dmon__watch_state* watch, int n)
+{
+    dmon__watch_subdir* node = &watch->subdirs[n];
+    int len = (int)strlen(watch->subdir_names + node->name);
+    uint32_t hash = _dmon_snapshot_hash(node->parent, watch->subdir_names + node->name, len);
+    int head = _dmon_hashtbl_find(&watch->subdir_tbl, hash);
+    if (head == n) {
+        if (node->next != -1) {
+            _dmon_hashtbl_insert(&watch->subdir_tbl, hash, node->next);
+        } else {
+            _dmon_hashtbl_remove(&watch->subdir_tbl, hash);
+        }
+    } else {
+        int prev = head;
+        while (watch->subdirs[prev].next != n) {
+            prev = watch->subdirs[prev].next;
+        }
+        watch->subdirs[prev].next = node->next;
+    }
+
+    if (node->prev_sibling != -1) {
+        watch->subdirs[node->prev_sibling].next_sibling = node->next_sibling;
+    } else if (node->parent != -1) {
+        watch->subdirs[node->parent].first_child = node->next_sibling;
+    }
+    if (node->next_sibling != -1) {
+        watch->subdirs[node->next_sibling].prev_sibling = node->prev_sibling;
+    }
+    watch->live_subdir_names -= len + 1;
+}
+
+// packs the names of the live directories, see _dmon_snapshot_compact
+_DMON_PRIVATE void _dmon_subdir_compact(dmon__watch_state* watch)
+{
+    int size = stb_sb_count(watch->subdir_names);
+    if (size < 64 * 1024 || size < watch->live_subdir_names * 2) {
+        return;
+    }
+
+    char* names = watch->subdir_names;
+    watch->subdir_names = NULL;
+    _dmon_hashtbl_clear(&watch->subdir_name_tbl);
+    int n;
+    for (n = 0; n < stb_sb_count(watch->subdirs); n++) {
+        if (watch->subdirs[n].wd != _DMON_SUBDIR_FREE) {
+            const char* name = names + watch->subdirs[n].name;
+            watch->subdirs[n].name = _dmon_intern(&watch->subdir_names, &watch->subdir_name_tbl, name,
+                                                  (int)strlen(name));
+        }
+    }
+    stb_sb_free(names);
+}
+
+// returns the child of the directory node with the name (or the top node if parent is -1), or -1
+_DMON_PRIVATE int _dmon_subdir_child(const dmon__watch_state* watch, int parent, const char* name, int len)
+{
+    int n;
+    for (n = _dmon_hashtbl_find(&watch->subdir_tbl, _dmon_snapshot_hash(parent, name, len)); n != -1;
+         n = watch->subdirs[n].next) {
+        const char* s = watch->subdir_names + watch->subdirs[n].name;
+        if (watch->subdirs[n].parent == parent && strncmp(s, name, len) == 0 && s[len] == '\0') {
+            return n;
+        }
+    }
+    return -1;
+}
+
+_DMON_PRIVATE int _dmon_subdir_new(dmon__watch_state* watch, int parent, const char* name, int len)
+{
+    uint32_t name_offset = _dmon_intern(&watch->subdir_names, &watch->subdir_name_tbl, name, len);
+    int n;
+    dmon__watch_subdir* node;
+    if (watch->free_subdir != -1) {
+        n = watch->free_subdir;
+        node = &watch->subdirs[n];
+        watch->free_subdir = node->next_sibling;
+    } else {
+        n = stb_sb_count(watch->subdirs);
+        node = stb_sb_add(watch->subdirs, 1);
+    }
+    node->wd = -1;
+    node->first_child = -1;
+    _dmon_subdir_link(watch, n, parent, name_offset);
+    return n;
+}
+
+// returns the node of the directory (relative to rootdir, or absolute if it's out of the root), or -1
+// the trailing slash is optional. with create, the missing directories are added without a wd
+_DMON_PRIVATE int _dmon_subdir_find(dmon__watch_state* watch, const char* path, int path_len, bool create)
+{
+    if (path_len > 1 && path[path_len - 1] == '/') {
+        path_len--;
+    }
+    if (path_len > 0 && path[0] == '/') {
+        int top = _dmon_subdir_child(watch, -1, path, path_len);
+        return (top == -1 && create) ? _dmon_subdir_new(watch, -1, path, path_len) : top;
+    }
+
+    int n = _dmon_subdir_child(watch, -1, "", 0);
+    if (n == -1 && create) {
+        n = _dmon_subdir_new(watch, -1, "", 0);
+    }
+    const char* end = path + path_len;
+    while (n != -1 && path < end) {
+        const char* slash = (const char*)memchr(path, '/', (size_t)(end - path));
+        int len = slash ? (int)(slash - path) : (int)(end - path);
+        if (len > 0) {
+            int child = _dmon_subdir_child(watch, n, path, len);
+            n = (child == -1 && create) ? _dmon_subdir_new(watch, n, path, len) : child;
+        }
+        path += len + 1;
+    }
+    return n;
+}
+
+// writes the path of the directory (relative to rootdir, with trailing slash), returns false if it doesn't fit
+_DMON_PRIVATE bool _dmon_subdir_path(const dmon__watch_state* watch, int n, char* path, int path_size)
+{
+    int len = 0, m;
+    for (m = n; m != -1; m = watch->subdirs[m].parent) {
+        int name_len = (int)strlen(watch->subdir_names + watch->subdirs[m].name);
+        len += name_len > 0 ? name_len + 1 : 0;
+    }
+    if (len + 1 > path_size) {
+        return false;
+    }
+
+    path[len] = '\0';
+    for (m = n; m != -1; m = watch->subdirs[m].parent) {
+        const char* name = watch->subdir_names + watch->subdirs[m].name;
+        int name_len = (int)strlen(name);
+        if (name_len > 0) {
+            path[--len] = '/';
+            len -= name_len;
+            memcpy(path + len, name, name_len);
+        }
+    }
+    return true;
+}
+
+// releases the ref of the watch for the wd
+// the inotify watch is removed when the last watch that owns the directory lets it go
+_DMON_PRIVATE void _dmon_unref_wd(dmon__state* ctx, int wd, int watch_index)
+{
+    int prev = -1, r;
+    for (r = _dmon_hashtbl_find(&ctx->wd_tbl, (uint32_t)wd); r != -1; prev = r, r = ctx->wd_refs[r].next) {
+        if (ctx->wd_refs[r].watch == watch_index) {
+            break;
+        }
+    }
+    DMON_ASSERT(r != -1);
+
+    if (prev != -1) {
+        ctx->wd_refs[prev].next = ctx->wd_refs[r].next;
+    } else if (ctx->wd_refs[r].next != -1) {
+        _dmon_hashtbl_insert(&ctx->wd_tbl, (uint32_t)wd, ctx->wd_refs[r].next);
+    } else {
+        _dmon_hashtbl_remove(&ctx->wd_tbl, (uint32_t)wd);
+        inotify_rm_watch(ctx->inotify_fd, wd);
+    }
+    ctx->wd_refs[r].next = ctx->wd_refs_free;
+    ctx->wd_refs_free = r;
+}
+
+// frees the node, which has no children anymore
+_DMON_PRIVATE void _dmon_subdir_release(dmon__state* ctx, dmon__watch_state* watch, int n)
+{
+    DMON_ASSERT(watch->subdirs[n].first_child == -1);
+    if (watch->subdirs[n].wd >= 0) {
+        _dmon_unref_wd(ctx, watch->subdirs[n].wd, _dmon_watch_index(watch->id));
+    }
+    _dmon_subdir_unlink(watch, n);
+    watch->subdirs[n].wd = _DMON_SUBDIR_FREE;
+    watch->subdirs[n].next_sibling = watch->free_subdir;
+    watch->free_subdir = n;
+}
+
+// frees the node and everything under it
+_DMON_PRIVATE void _dmon_subdir_release_tree(dmon__state* ctx, dmon__watch_state* watch, int n)
+{
+    int cur = n;
+    for (;;) {
+        while (watch->subdirs[cur].first_child != -1) {
+            cur = watch->subdirs[cur].first_child;
+        }
+
+        int parent = watch->subdirs[cur].parent;
+        _dmon_subdir_release(ctx, watch, cur);
+        if (cur == n) {
+            break;
+        }
+        cur = parent;
+    }
+}
+
+// frees the directory and it's parents, as long as they are not watched and have no children
+_DMON_PRIVATE void _dmon_subdir_prune(dmon__state* ctx, dmon__watch_state* watch, int n)
+{
+    while (n != -1 && watch->subdirs[n].wd == -1 && watch->subdirs[n].first_child == -1) {
+        int parent = watch->subdirs[n].parent;
+        _dmon_subdir_release(ctx, watch, n);
+        n = parent;
+    }
+}
+
+// adds a watched sub-directory (relative to rootdir) to the watch and indexes it with it's wd
+// returns false if the watch already owns the directory, for instance when it's reached by a symlink
+_DMON_PRIVATE bool _dmon_add_subdir(dmon__state* ctx, dmon__watch_state* watch, const char* watchdir, int wd)
+{
+    int watch_index = _dmon_watch_index(watch->id);
+    if (_dmon_find_wd_ref(ctx, wd, watch_index) != -1) {
+        return false;
+    }
+
+    int rootdir_len = (int)strlen(watch->rootdir);
+    if (strncmp(watchdir, watch->rootdir, rootdir_len) == 0) {
+        watchdir += rootdir_len;
+    }
+    int n = _dmon_subdir_find(watch, watchdir, (int)strlen(watchdir), true);
+    if (watch->subdirs[n].wd >= 0) {
+        // the directory is created again before the IN_IGNORED of the old one
+        _dmon_unref_wd(ctx, watch->subdirs[n].wd, watch_index);
+    }
+
+    int r;
+    dmon__wd_ref* ref;
+    if (ctx->wd_refs_free != -1) {
+        r = ctx->wd_refs_free;
+        ref = &ctx->wd_refs[r];
+        ctx->wd_refs_free = ref->next;
+    } else {
+        r = stb_sb_count(ctx->wd_refs);
+        ref = stb_sb_add(ctx->wd_refs, 1);
+    }
+
+    ref->wd = wd;
+    ref->watch = watch_index;
+    ref->subdir = n;
+    ref->next = _dmon_hashtbl_find(&ctx->wd_tbl, (uint32_t)wd);
+    _dmon_hashtbl_insert(&ctx->wd_tbl, (uint32_t)wd, r);
+
+    watch->subdirs[n].wd = wd;
+    _DMON_STAT_ADD(ctx, watch, dirs_registered, 1);
+    return true;
+}
+
+// stops watching the directory, the directories under it are still watched
+_DMON_PRIVATE void _dmon_remove_subdir(dmon__state* ctx, dmon__watch_state* watch, int n)
+{
+    DMON_ASSERT(watch->subdirs[n].wd >= 0);
+    _dmon_unref_wd(ctx, watch->subdirs[n].wd, _dmon_watch_index(watch->id));
+    watch->subdirs[n].wd = -1;
+    _dmon_subdir_prune(ctx, watch, n);
+    _dmon_subdir_compact(watch);
+}
+
+// removes the watched directories of the deleted, or moved out, directory and all the directories under it
+_DMON_PRIVATE void _dmon_remove_subdirs(dmon__state* ctx, dmon__watch_state* watch, const char* path)
+{
+    int n = _dmon_subdir_find(watch, path, (int)strlen(path), false);
+    if (n != -1 && path[0] != '\0') {
+        int parent = watch->subdirs[n].parent;
+        _dmon_subdir_release_tree(ctx, watch, n);
+        _dmon_subdir_prune(ctx, watch, parent);
+        _dmon_subdir_compact(watch);
+    }
+}
+
+// moves the watched directory (relative to rootdir, without trailing slash) to it's new parent and name, the
+// directories under it and their inotify watches stay as they are
+_DMON_PRIVATE void _dmon_move_subdirs(dmon__state* ctx, dmon__watch_state* watch, const char* oldpath, const char* newpath)
+{
+    int n = _dmon_subdir_find(watch, oldpath, (int)strlen(oldpath), false);
+    if (n == -1 || oldpath[0] == '\0') {
+        return;
+    }
+
+    const char* name = strrchr(newpath, '/');
+    name = name ? name + 1 : newpath;
+    int name_len = (int)strlen(name);
+    int parent = _dmon_subdir_find(watch, newpath, (int)(name - newpath), true);
+    int dst = _dmon_subdir_child(watch, parent, name, name_len);
+    if (dst == n) {
+        return;
+    }
+    if (dst != -1) {
+        _dmon_subdir_release_tree(ctx, watch, dst);  // replaced by the moved directory
+    }
+
+    int old_parent = watch->subdirs[n].parent;
+    uint32_t name_offset = _dmon_intern(&watch->subdir_names, &watch->subdir_name_tbl, name, name_len);
+    _dmon_subdir_unlink(watch, n);
+    _dmon_subdir_link(watch, n, parent, name_offset);
+    _dmon_subdir_prune(ctx, watch, old_parent);
+    _dmon_subdir_compact(watch);
+}
+
+// stops watching all the directories of the watch
+_DMON_PRIVATE void _dmon_subdirs_free(dmon__state* ctx, dmon__watch_state* watch)
+{
+    int watch_index = _dmon_watch_index(watch->id);
+    int n;
+    for (n = 0; n < stb_sb_count(watch->subdirs); n++) {
+        if (watch->subdirs[n].wd >= 0) {
+            _dmon_unref_wd(ctx, watch->subdirs[n].wd, watch_index);
+        }
+    }
+    stb_sb_free(watch->subdirs);
+    stb_sb_free(watch->subdir_names);
+    _dmon_hashtbl_free(&watch->subdir_tbl);
+    _dmon_hashtbl_free(&watch->subdir_name_tbl);
+    watch->subdirs = NULL;
+    watch->subdir_names = NULL;
+    watch->free_subdir = -1;
+    watch->live_subdir_names = 0;
+}
+
+// the kernel removed the inotify watch (IN_IGNORED): the directory is deleted, or it's file system is unmounted
+_DMON_PRIVATE void _dmon_forget_wd(dmon__state* ctx, int wd)
+{
+    int r;
+    while ((r = _dmon_hashtbl_find(&ctx->wd_tbl, (uint32_t)wd)) != -1) {
+        _dmon_remove_subdir(ctx, ctx->watches[ctx->wd_refs[r].watch], ctx->wd_refs[r].subdir);
+    }
+}
+
+// tracks the directories that are moved inside the watches while the events are read, so the events that come
+// after the move, even in the same read, get the new paths
+_DMON_PRIVATE void _dmon_track_dir_move(dmon__state* ctx, dmon__watch_state* watch, const struct inotify_event* iev, const char* reldir,
+                                        const char* name, bool ignored)
+{
+    char path[DMON_MAX_PATH];
+    _dmon_strcpy(path, sizeof(path), reldir);
+    _dmon_strcat(path, sizeof(path), name);
+    int watch_index = _dmon_watch_index(watch->id);
+
+    if (iev->mask & IN_MOVED_FROM) {
+        if (ctx->dir_move_cookie != iev->cookie) {
+            stb_sb_reset(ctx->dir_moves);
+            ctx->dir_move_cookie = iev->cookie;
+        }
+        dmon__dir_move* move = stb_sb_add(ctx->dir_moves, 1);
+        move->watch = watch_index;
+        _dmon_strcpy(move->path, sizeof(move->path), path);
+        return;
+    }
+
+    int i;
+    for (i = 0; i < stb_sb_count(ctx->dir_moves) && ctx->dir_move_cookie == iev->cookie; i++) {
+        if (ctx->dir_moves[i].watch == watch_index) {
+            // a directory that is moved to an excluded name is not watched anymore
+            if (ignored) {
+                _dmon_remove_subdirs(ctx, watch, ctx->dir_moves[i].path);
+            } else {
+                _dmon_move_subdirs(ctx, watch, ctx->dir_moves[i].path, path);
+            }
+            ctx->dir_moves[i] = stb_sb_last(ctx->dir_moves);
+            stb_sb_pop(ctx->dir_moves);
+            break;
+        }
+    }
+}
+
+// buffers of a crawler thread
+typedef struct dmon__crawl_worker {
+    dmon__crawl_dir* children;  // child directories of the frames
+    dmon__crawl_dir* created;   // async crawl: entries that are created while registering
+    dmon__crawl_frame* frames;
+    char* entries;              // packed entries of the read directories (dmon__snapshot_stat, then path)
+    char* buff;
+} dmon__crawl_worker;
+
+// reads the directory (path is in children[dir]) and adds the child directories to inotify, without touching
+// the shared state. the entries are gathered for the snapshot of the watch. async crawls also gather
+// the entries that are created after the watch is requested, but before the directory is added to the watch,
+// since their events are lost
+_DMON_PRIVATE void _dmon_crawl_read(dmon__state* ctx, dmon__crawl* crawl, dmon__crawl_worker* w, int fd, int dir)
+{
+    char dirname[DMON_MAX_PATH];
+    _dmon_strcpy(dirname, sizeof(dirname), w->children[dir].path);
+    int dirname_len = (int)strlen(dirname);
+    struct timespec registered = w->children[dir].registered;
+
+    // directories that are resolved from symlinks out of the root are not in the snapshot
+    bool inside_root = dirname_len >= crawl->rootdir_len && memcmp(dirname, crawl->rootdir, crawl->rootdir_len) == 0;
+    const char* reldir = dirname + crawl->rootdir_len;
+
+    // entries can only be added if the directory itself is modified after the watch is requested
+    bool gather = false;
+    struct stat st;
+    if (crawl->async_id.id && inside_root && fstat(fd, &st) == 0) {
+        gather = !_dmon_timespec_less(&st.st_mtim, &crawl->start);
+    }
+
+    int len;
+    while ((len = _dmon_getdents(fd, w->buff, _DMON_CRAWL_BUFFSIZE)) > 0) {
+        int offset;
+        for (offset = 0; offset < len; offset += ((dmon__dirent*)(w->buff + offset))->d_reclen) {
+            const dmon__dirent* entry = (const dmon__dirent*)(w->buff + offset);
+            if (_dmon_dirent_isdots(entry)) {
+                continue;
+            }
+
+            // excluded directories are not read, so nothing under them is watched
+            unsigned char type = _dmon_dirent_type(fd, entry);
+            bool is_dir = type == DT_DIR || (type == DT_LNK && crawl->followlinks);
+            if (_dmon_ignored(crawl->ignore, inside_root ? reldir : "", entry->d_name, is_dir)) {
+                continue;
+            }
+
+            if (inside_root && (crawl->stat || type == DT_DIR)) {
+                dmon__snapshot_stat est;
+                _dmon_snapshot_stat_dirent(fd, entry, type, crawl->stat, &est);
+                int reldir_len = dirname_len - crawl->rootdir_len;
+                int name_len = (int)strlen(entry->d_name);
+                char* e = stb_sb_add(w->entries, (int)sizeof(est) + reldir_len + name_len + 1);
+                memcpy(e, &est, sizeof(est));
+                memcpy(e + sizeof(est), reldir, reldir_len);
+                memcpy(e + sizeof(est) + reldir_len, entry->d_name, name_len + 1);
+            }
+
+            struct timespec created;
+            if (gather && _dmon_created_time(fd, entry->d_name, &created) &&
+                !_dmon_timespec_less(&created, &crawl->start) && !_dmon_timespec_less(&registered, &created)) {
+                dmon__crawl_dir* c = stb_sb_add(w->created, 1);
+                _dmon_strcpy(c->path, sizeof(c->path), reldir);
+                _dmon_strcat(c->path, sizeof(c->path), entry->d_name);
+            }
+
+            if (!is_dir) {
+                continue;
+            }
+
+            // a truncated path would watch the wrong directory, so the ones that don't fit (with the trailing
+            // slash) are skipped
+            int name_len = (int)strlen(entry->d_name);
+            if (dirname_len + name_len + 1 >= DMON_MAX_PATH) {
+                _DMON_LOG_DEBUGF("Directory '%s' is not watched, the path is too long", entry->d_name);
+                __atomic_fetch_add(&crawl->dirs_skipped, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+
+            // add sub-directory to watch dirs
+            dmon__crawl_dir* child = stb_sb_add(w->children, 1);
+            memcpy(child->path, dirname, dirname_len);
+            memcpy(child->path + dirname_len, entry->d_name, name_len + 1);
+            child->is_link = type == DT_LNK;
+            if (child->is_link) {
+                char linkpath[PATH_MAX];
+                if (realpath(child->path, linkpath) == NULL || (int)strlen(linkpath) + 1 >= DMON_MAX_PATH) {
+                    _DMON_LOG_DEBUGF("Directory '%s' is not watched, the link can't be resolved", child->path);
+                    __atomic_fetch_add(&crawl->dirs_skipped, 1, __ATOMIC_RELAXED);
+                    stb_sb_pop(w->children);
+                    continue;
+                }
+                _dmon_strcpy(child->path, sizeof(child->path), linkpath);
+            }
+
+            int child_len = (int)strlen(child->path);
+            if (child->path[child_len - 1] != '/') {
+                child->path[child_len] = '/';
+                child->path[child_len + 1] = '\0';
+            }
+            // out of watches (ENOSPC), no permission (EACCES) or deleted meanwhile (ENOENT): the rest of the tree
+            // is still watched
+            child->wd = inotify_add_watch(ctx->inotify_fd, child->path, crawl->mask | IN_MASK_ADD);
+            if (child->wd == -1) {
+                _DMON_LOG_DEBUGF("Directory '%s' is not watched (inotify_add_watch:err=%d)", child->path, errno);
+                __atomic_fetch_add(&crawl->dirs_skipped, 1, __ATOMIC_RELAXED);
+                stb_sb_pop(w->children);
+            }
+        }
+    }
+}
+
+// async crawl: adds the found directories and entries to the watch and reports the gathered entries as created
+// directories that are not added (already owned by the watch) are marked with wd=-1
+// returns false if the watch is removed or dmon is shutting down, the crawl should stop then
+_DMON_PRIVATE bool _dmon_crawl_register(dmon__state* ctx, dmon__crawl* crawl, dmon__crawl_worker* w, dmon__crawl_dir* found,
+                                        int num_found)
+{
+    pthread_mutex_lock(&ctx->mutex);
+
+    dmon__watch_state* watch = NULL;
+    if (__sync_bool_compare_and_swap(&ctx->quit, false, false)) {
+        watch = _dmon_get_watch(ctx, crawl->async_id);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    int i;
+    for (i = 0; i < num_found; i++) {
+        if (watch == NULL || !_dmon_add_subdir(ctx, watch, found[i].path, found[i].wd)) {
+            // nobody else is interested in the directory
+            if (watch == NULL && _dmon_hashtbl_find(&ctx->wd_tbl, (uint32_t)found[i].wd) == -1) {
+                inotify_rm_watch(ctx->inotify_fd, found[i].wd);
+            }
+            found[i].wd = -1;
+        }
+        found[i].registered = now;
+    }
+
+    if (watch) {
+        _dmon_snapshot_add_packed(&watch->snapshot, w->entries);
+    }
+
+    if (watch && stb_sb_count(w->created) > 0) {
+        for (i = 0; i < stb_sb_count(w->created); i++) {
+            _dmon_push_event(ctx, watch->id, IN_CREATE, 0, "", w->created[i].path);
+        }
+        _dmon_wake_thread(ctx);    // starts the flush timer
+    }
+
+    pthread_mutex_unlock(&ctx->mutex);
+    return watch != NULL;
+}
+
+// merges the directory that is just read into the crawl. child directories that are already crawled, or given
+// away to the queue, are marked with wd=-1 so the thread does not go into them
+_DMON_PRIVATE void _dmon_crawl_merge(dmon__state* ctx, dmon__crawl* crawl, dmon__crawl_worker* w, int first_child, int depth)
+{
+    dmon__crawl_dir* found = w->children + first_child;
+    int num_found = stb_sb_count(w->children) - first_child;
+    bool cancelled = crawl->async_id.id && !_dmon_crawl_register(ctx, crawl, w, found, num_found);
+
+    pthread_mutex_lock(&crawl->mutex);
+    if (cancelled) {
+        crawl->cancelled = true;
+        stb_sb_reset(crawl->queue);
+    }
+
+    bool give_away = crawl->num_waiting > 0 || depth >= _DMON_CRAWL_MAX_DEPTH;
+    int i;
+    for (i = 0; i < num_found; i++) {
+        // directories that are already crawled or owned by the watch are not followed again
+        int wd = found[i].wd;
+        if (crawl->cancelled) {
+            found[i].wd = -1;
+            continue;
+        }
+        if (crawl->async_id.id) {
+            if (wd == -1) {
+                continue;
+            }
+        } else if (_dmon_hashtbl_find(&crawl->seen, (uint32_t)wd) != -1 ||
+                   _dmon_find_wd_ref(ctx, wd, crawl->watch_index) != -1) {
+            found[i].wd = -1;
+            continue;
+        }
+
+        // sync crawls keep all the directories, they are added to the watch at the end
+        if (!crawl->async_id.id || give_away) {
+            _dmon_hashtbl_insert(&crawl->seen, (uint32_t)wd, stb_sb_count(crawl->dirs));
+            if (give_away) {
+                stb_sb_push(crawl->queue, stb_sb_count(crawl->dirs));
+            }
+            stb_sb_push(crawl->dirs, found[i]);
+            if (give_away) {
+                found[i].wd = -1;
+            }
+        }
+    }
+
+    if (give_away && stb_sb_count(crawl->queue) > 0) {
+        pthread_cond_broadcast(&crawl->cond);
+    }
+    pthread_mutex_unlock(&crawl->mutex);
+}
+
+// walks the sub-tree of the directory depth-first, child directories are opened relative to their parent's fd
+_DMON_PRIVATE void _dmon_crawl_tree(dmon__state* ctx, dmon__crawl* crawl, dmon__crawl_worker* w, const dmon__crawl_dir* root)
+{
+    // queued directories are opened by their path, they can be deleted or moved since they are found
+    int fd = open(root->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        _DMON_LOG_DEBUGF("Directory '%s' is not read (open:err=%d)", root->path, errno);
+        __atomic_fetch_add(&crawl->dirs_skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    stb_sb_push(w->children, *root);
+    dmon__crawl_frame frame;
+    frame.fd = fd;
+    frame.dir = 0;
+    frame.path_len = (int)strlen(root->path);
+    frame.child = frame.children_end = 0;
+    frame.read = false;
+    stb_sb_push(w->frames, frame);
+
+    while (stb_sb_count(w->frames) > 0) {
+        dmon__crawl_frame* f = &stb_sb_last(w->frames);
+        if (!f->read) {
+            int first = stb_sb_count(w->children);
+            _dmon_crawl_read(ctx, crawl, w, f->fd, f->dir);
+            f->read = true;
+            f->child = first;
+            f->children_end = stb_sb_count(w->children);
+            // sync crawls keep the entries of the worker until it exits, async ones register them right away
+            bool async = crawl->async_id.id != 0;
+            if (f->children_end > first || stb_sb_count(w->created) > 0 || (async && stb_sb_count(w->entries) > 0)) {
+                _dmon_crawl_merge(ctx, crawl, w, first, stb_sb_count(w->frames));
+            }
+            stb_sb_reset(w->created);
+            if (async) {
+                stb_sb_reset(w->entries);
+            }
+        }
+
+        while (f->child < f->children_end && w->children[f->child].wd == -1) {
+            ++f->child;
+        }
+
+        if (f->child < f->children_end) {
+            const dmon__crawl_dir* child = &w->children[f->child];
+            int child_fd = child->is_link ? open(child->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                                          : openat(f->fd, child->path + f->path_len, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            frame.fd = child_fd;
+            frame.dir = f->child;
+            frame.path_len = (int)strlen(child->path);
+            frame.child = frame.children_end = 0;
+            frame.read = false;
+            ++f->child;
+            if (child_fd != -1) {
+                stb_sb_push(w->frames, frame);
+            } else {
+                _DMON_LOG_DEBUGF("Directory '%s' is not read (open:err=%d)", child->path, errno);
+                __atomic_fetch_add(&crawl->dirs_skipped, 1, __ATOMIC_RELAXED);
+            }
+        } else {
+            close(f->fd);
+            stb_sb_pop(w->frames);
+            if (stb_sb_count(w->frames) > 0) {
+                // children of the directory are not needed anymore
+                stb__sbn(w->children) = stb_sb_last(w->frames).children_end;
+            }
+        }
+    }
+    stb_sb_reset(w->children);
+}
+
+_DMON_PRIVATE void* _dmon_crawl_thread(void* arg)
+{
+    dmon__crawl* crawl = (dmon__crawl*)arg;
+    dmon__state* ctx = crawl->ctx;
+    dmon__crawl_worker w;
+    memset(&w, 0x0, sizeof(w));
+    w.buff = (char*)DMON_MALLOC(_DMON_CRAWL_BUFFSIZE);
+    DMON_ASSERT(w.buff);
+    dmon__crawl_dir root;
+
+    pthread_mutex_lock(&crawl->mutex);
+    for (;;) {
+        ++crawl->num_waiting;
+        while (stb_sb_count(crawl->queue) == 0 && crawl->num_busy > 0) {
+            pthread_cond_wait(&crawl->cond, &crawl->mutex);
+        }
+        --crawl->num_waiting;
+        if (stb_sb_count(crawl->queue) == 0 || w.buff == NULL) {
+            break;
+        }
+
+        int index = stb_sb_last(crawl->queue);
+        stb_sb_pop(crawl->queue);
+        root = crawl->dirs[index];
+        ++crawl->num_busy;
+        pthread_mutex_unlock(&crawl->mutex);
+
+        _dmon_crawl_tree(ctx, crawl, &w, &root);
+
+        pthread_mutex_lock(&crawl->mutex);
+        --crawl->num_busy;
+        if (stb_sb_count(crawl->queue) > 0 || crawl->num_busy == 0) {
+            pthread_cond_broadcast(&crawl->cond);
+        }
+    }
+
+    // entries of sync crawls are added to the snapshot at the end
+    if (stb_sb_count(w.entries) > 0) {
+        memcpy(stb_sb_add(crawl->entries, stb_sb_count(w.entries)), w.entries, stb_sb_count(w.entries));
+    }
+    pthread_mutex_unlock(&crawl->mutex);
+
+    stb_sb_free(w.children);
+    stb_sb_free(w.created);
+    stb_sb_free(w.frames);
+    stb_sb_free(w.entries);
+    DMON_FREE(w.buff);
+    return NULL;
+}
+
+_DMON_PRIVATE int _dmon_crawl_compare(const void* a, const void* b)
+{
+    return strcmp((*(const dmon__crawl_dir* const*)a)->path, (*(const dmon__crawl_dir* const*)b)->path);
+}
+
+_DMON_PRIVATE void _dmon_crawl_init(dmon__state* ctx, dmon__crawl* crawl, const char* dirname, uint32_t mask, bool followlinks,
+                                    dmon__watch_state* watch)
+{
+    memset(crawl, 0x0, sizeof(*crawl));
+    crawl->ctx = ctx;
+    pthread_mutex_init(&crawl->mutex, NULL);
+    pthread_cond_init(&crawl->cond, NULL);
+    crawl->watch_index = _dmon_watch_index(watch->id);
+    crawl->mask = mask;
+    crawl->followlinks = followlinks;
+    crawl->stat = (watch->watch_flags & DMON_WATCHFLAGS_SNAPSHOT) != 0;
+    crawl->ignore = _dmon_ignore_retain(watch->ignore);
+    _dmon_strcpy(crawl->rootdir, sizeof(crawl->rootdir), watch->rootdir);
+    crawl->rootdir_len = (int)strlen(crawl->rootdir);
+
+    // the first entry is dirname itself, which is already added by the caller
+    dmon__crawl_dir* root = stb_sb_add(crawl->dirs, 1);
+    memset(root, 0x0, sizeof(*root));
+    _dmon_strcpy(root->path, sizeof(root->path), dirname);
+    root->wd = -1;
+    stb_sb_push(crawl->queue, 0);
+}
+
+_DMON_PRIVATE void _dmon_crawl_release(dmon__crawl* crawl)
+{
+    stb_sb_free(crawl->dirs);
+    stb_sb_free(crawl->queue);
+    stb_sb_free(crawl->entries);
+    _dmon_hashtbl_free(&crawl->seen);
+    _dmon_ignore_release(crawl->ignore);
+    pthread_cond_destroy(&crawl->cond);
+    pthread_mutex_destroy(&crawl->mutex);
+}
+
+// runs the crawl with num_threads threads, including the calling one
+_DMON_PRIVATE void _dmon_crawl_run(dmon__crawl* crawl, int num_threads)
+{
+    pthread_t* threads = NULL;
+    int i;
+    for (i = 1; i < num_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, _dmon_crawl_thread, crawl) != 0) {
+            break;
+        }
+        stb_sb_push(threads, thread);
+    }
+    _dmon_crawl_thread(crawl);
+    for (i = 0; i < stb_sb_count(threads); i++) {
+        pthread_join(threads[i], NULL);
+    }
+    stb_sb_free(threads);
+}
+
+// adds all child directories of dirname to the watch, using num_threads threads (including the calling one)
+// directories are added sorted by path, so the layout of the watch does not depend on thread scheduling
+// the caller must hold the lock, the crawler threads only read the watch state
+_DMON_PRIVATE void _dmon_crawl(dmon__state* ctx, const char* dirname, uint32_t mask, bool followlinks,
+                               dmon__watch_state* watch, int num_threads)
+{
+    dmon__crawl crawl;
+    _dmon_crawl_init(ctx, &crawl, dirname, mask, followlinks, watch);
+    _dmon_crawl_run(&crawl, num_threads);
+
+    int num_dirs = stb_sb_count(crawl.dirs) - 1;
+    if (num_dirs > 0) {
+        dmon__crawl_dir** sorted = (dmon__crawl_dir**)DMON_MALLOC(sizeof(dmon__crawl_dir*) * num_dirs);
+        DMON_ASSERT(sorted);
+        int i;
+        for (i = 0; i < num_dirs; i++) {
+            sorted[i] = &crawl.dirs[i + 1];
+        }
+        qsort(sorted, (size_t)num_dirs, sizeof(dmon__crawl_dir*), _dmon_crawl_compare);
+        for (i = 0; i < num_dirs; i++) {
+            _dmon_add_subdir(ctx, watch, sorted[i]->path, sorted[i]->wd);
+        }
+        DMON_FREE(sorted);
+    }
+    _dmon_snapshot_add_packed(&watch->snapshot, crawl.entries);
+    _DMON_STAT_ADD(ctx, watch, dirs_skipped, crawl.dirs_skipped);
+
+    _dmon_crawl_release(&crawl);
+}
+
+_DMON_PRIVATE void _dmon_watch_recursive(dmon__state* ctx, const char* dirname, uint32_t mask,
+                                         bool followlinks, dmon__watch_state* watch)
+{
+    _dmon_crawl(ctx, dirname, mask, followlinks, watch, ctx->crawl_threads);
+}
+
+// background registration of an async watch
+typedef struct dmon__register {
+    dmon__crawl crawl;
+    int num_threads;
+    void (*ready_cb)(dmon_watch_id watch_id, bool success, void* user);
+    void* user_data;
+} dmon__register;
+
+_DMON_PRIVATE void* _dmon_register_thread(void* arg)
+{
+    dmon__register* reg = (dmon__register*)arg;
+    dmon__state* ctx = reg->crawl.ctx;
+    _dmon_crawl_run(&reg->crawl, reg->num_threads);
+
+    if (reg->ready_cb) {
+        reg->ready_cb(reg->crawl.async_id, !reg->crawl.cancelled, reg->user_data);
+    }
+
+    dmon_watch_id id = reg->crawl.async_id;
+    uint64_t dirs_skipped = reg->crawl.dirs_skipped;
+    _dmon_crawl_release(&reg->crawl);
+    DMON_FREE(reg);
+
+    pthread_mutex_lock(&ctx->mutex);
+    dmon__watch_state* watch = _dmon_get_watch(ctx, id);
+    _DMON_STAT_ADD(ctx, watch, dirs_skipped, dirs_skipped);
+    --ctx->num_registering;
+    pthread_cond_broadcast(&ctx->registered_cond);
+    pthread_mutex_unlock(&ctx->mutex);
+    return NULL;
+}
+
+// starts the background registration of the child directories of an async watch, the caller must hold the lock
+// returns false if the thread could not be created
+_DMON_PRIVATE bool _dmon_register_async(dmon__state* ctx, dmon__watch_state* watch, uint32_t mask, bool followlinks,
+                                        const struct timespec* start,
+                                        void (*ready_cb)(dmon_watch_id watch_id, bool success, void* user),
+                                        void* user_data)
+{
+    dmon__register* reg = (dmon__register*)DMON_MALLOC(sizeof(dmon__register));
+    DMON_ASSERT(reg);
+    if (reg == NULL) {
+        return false;
+    }
+
+    _dmon_crawl_init(ctx, &reg->crawl, watch->rootdir, mask, followlinks, watch);
+    reg->crawl.async_id = watch->id;
+    reg->crawl.start = *start;
+    clock_gettime(CLOCK_REALTIME, &reg->crawl.dirs[0].registered);
+    reg->num_threads = ctx->crawl_threads;
+    reg->ready_cb = ready_cb;
+    reg->user_data = user_data;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int r = pthread_create(&thread, &attr, _dmon_register_thread, reg);
+    pthread_attr_destroy(&attr);
+    if (r != 0) {
+        _dmon_crawl_release(&reg->crawl);
+        DMON_FREE(reg);
+        return false;
+    }
+
+    ++ctx->num_registering;
+    return true;
+}
+
+// index file of a watch, for restoring the watch after a restart: header, nodes, then names
+// nodes are stored breadth-first, so the children of a node are next to each other (sorted by name). the file is
+// only read back by the same build, the layout is native and checked with the version and node_size
+#define _DMON_INDEX_VERSION 1
+
+typedef struct dmon__index_header {
+    char magic[4];          // "DMIX"
+    uint32_t version;
+    uint32_t node_size;     // sizeof(dmon__index_node)
+    uint32_t num_nodes;
+    uint32_t names_size;
+    uint32_t rootdir;       // offset of the root directory in names
+    int64_t save_time;      // nanoseconds
+} dmon__index_header;
+
+typedef struct dmon__index_node {
+    uint64_t inode;
+    int64_t size;
+    int64_t mtime;
+    uint32_t name;          // offset in names
+    uint32_t first_child;
+    uint32_t num_children;
+    uint8_t type;
+    uint8_t has_stat;
+    uint8_t reserved[2];
+} dmon__index_node;
+
+// memory-mapped index file
+typedef struct dmon__index {
+    const dmon__index_node* nodes;
+    const char* names;
+    int num_nodes;
+    int64_t save_time;
+    void* map;
+    size_t map_size;
+} dmon__index;
+
+typedef struct dmon__index_child {
+    const char* name;
+    int node;
+} dmon__index_child;
+
+_DMON_PRIVATE int _dmon_index_compare_child(const void* a, const void* b)
+{
+    return strcmp(((const dmon__index_child*)a)->name, ((const dmon__index_child*)b)->name);
+}
+
+_DMON_PRIVATE bool _dmon_write_all(int fd, const void* data, size_t size)
+{
+    const char* p = (const char*)data;
+    while (size > 0) {
+        ssize_t r = write(fd, p, size);
+        if (r <= 0) {
+            if (r == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += r;
+        size -= (size_t)r;
+    }
+    return true;
+}
+
+// writes the snapshot of the watch to the file. it's written to a temp file first, so a crash while saving
+// does not leave a broken index behind
+_DMON_PRIVATE bool _dmon_index_save(const dmon__watch_state* watch, const char* filepath)
+{
+    const dmon__snapshot* snap = &watch->snapshot;
+    dmon__index_node* nodes = NULL;
+    int* order = NULL;      // snapshot node of each index node
+    dmon__index_child* children = NULL;
+    int names_size = stb_sb_count(snap->names);
+    int i;
+
+    stb_sb_push(order, 0);
+    for (i = 0; i < stb_sb_count(order); i++) {
+        const dmon__snapshot_node* node = &snap->nodes[order[i]];
+        dmon__index_node* out = stb_sb_add(nodes, 1);
+        memset(out, 0x0, sizeof(*out));
+        out->inode = node->st.inode;
+        out->size = node->st.size;
+        out->mtime = node->st.mtime;
+        out->type = node->st.type;
+        out->has_stat = node->st.has_stat ? 1 : 0;
+        out->name = i == 0 ? (uint32_t)names_size : node->name;
+
+        stb_sb_reset(children);
+        int c;
+        for (c = node->first_child; c != -1; c = snap->nodes[c].next_sibling) {
+            dmon__index_child* child = stb_sb_add(children, 1);
+            child->name = snap->names + snap->nodes[c].name;
+            child->node = c;
+        }
+        if (stb_sb_count(children) > 1) {
+            qsort(children, (size_t)stb_sb_count(children), sizeof(dmon__index_child), _dmon_index_compare_child);
+        }
+
+        out->first_child = (uint32_t)stb_sb_count(order);
+        out->num_children = (uint32_t)stb_sb_count(children);
+        for (c = 0; c < stb_sb_count(children); c++) {
+            stb_sb_push(order, children[c].node);
+        }
+    }
+
+    dmon__index_header header;
+    memset(&header, 0x0, sizeof(header));
+    memcpy(header.magic, "DMIX", 4);
+    header.version = _DMON_INDEX_VERSION;
+    header.node_size = (uint32_t)sizeof(dmon__index_node);
+    header.num_nodes = (uint32_t)stb_sb_count(nodes);
+    header.names_size = (uint32_t)(names_size + strlen(watch->rootdir) + 1);
+    header.rootdir = (uint32_t)names_size;
+    struct timespec now;
+    _dmon_clock_coarse(&now);
+    header.save_time = (int64_t)now.tv_sec * 1000000000 + (int64_t)now.tv_nsec;
+
+    char tmppath[DMON_MAX_PATH];
+    _dmon_strcpy(tmppath, sizeof(tmppath), filepath);
+    _dmon_strcat(tmppath, sizeof(tmppath), ".tmp");
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd != -1 &&
+              _dmon_write_all(fd, &header, sizeof(header)) &&
+              _dmon_write_all(fd, nodes, sizeof(dmon__index_node) * (size_t)stb_sb_count(nodes)) &&
+              _dmon_write_all(fd, snap->names, (size_t)names_size) &&
+              _dmon_write_all(fd, watch->rootdir, strlen(watch->rootdir) + 1);
+    if (fd != -1) {
+        ok = close(fd) == 0 && ok;
+    }
+    ok = ok && rename(tmppath, filepath) == 0;
+    if (!ok) {
+        _DMON_LOG_ERRORF("Could not write index file '%s' (err=%d)", filepath, errno);
+        unlink(tmppath);
+    }
+
+    stb_sb_free(nodes);
+    stb_sb_free(order);
+    stb_sb_free(children);
+    return ok;
+}
+
+_DMON_PRIVATE void _dmon_index_close(dmon__index* index)
+{
+    if (index->map) {
+        munmap(index->map, index->map_size);
+    }
+    memset(index, 0x0, sizeof(*index));
+}
+
+// maps the index file and checks that it's valid and belongs to the root directory
+_DMON_PRIVATE bool _dmon_index_open(dmon__index* index, const char* filepath, const char* rootdir)
+{
+    memset(index, 0x0, sizeof(*index));
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(dmon__index_header)) {
+        close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    index->map = map;
+    index->map_size = (size_t)st.st_size;
+
+    const dmon__index_header* header = (const dmon__index_header*)map;
+    uint64_t nodes_size = (uint64_t)header->num_nodes * sizeof(dmon__index_node);
+    if (memcmp(header->magic, "DMIX", 4) != 0 || header->version != _DMON_INDEX_VERSION ||
+        header->node_size != sizeof(dmon__index_node) || header->num_nodes == 0 ||
+        header->num_nodes > (uint32_t)INT_MAX || header->names_size == 0 ||
+        sizeof(dmon__index_header) + nodes_size + header->names_size != (uint64_t)st.st_size) {
+        _dmon_index_close(index);
+        return false;
+    }
+
+    index->nodes = (const dmon__index_node*)((const char*)map + sizeof(dmon__index_header));
+    index->names = (const char*)index->nodes + nodes_size;
+    index->num_nodes = (int)header->num_nodes;
+    index->save_time = header->save_time;
+    if (index->names[header->names_size - 1] != '\0' || header->rootdir >= header->names_size ||
+        strcmp(index->names + header->rootdir, rootdir) != 0 || index->nodes[0].type != DT_DIR) {
+        _dmon_index_close(index);
+        return false;
+    }
+
+    // children must come after their parent, so walking the nodes always ends. names are joined into paths, so
+    // they must be a single entry of their directory
+    int i;
+    for (i = 0; i < index->num_nodes; i++) {
+        const dmon__index_node* node = &index->nodes[i];
+        if (node->name >= header->names_size ||
+            (node->num_children > 0 && (node->first_child <= (uint32_t)i ||
+                                        (uint64_t)node->first_child + node->num_children > header->num_nodes))) {
+            _dmon_index_close(index);
+            return false;
+        }
+        const char* name = index->names + node->name;
+        if (i > 0 && (name[0] == '\0' || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)) {
+            _dmon_index_close(index);
+            return false;
+        }
+    }
+    return true;
+}
+
+// returns the child of the node with the name, or -1
+_DMON_PRIVATE int _dmon_index_find_child(const dmon__index* index, const dmon__index_node* node, const char* name)
+{
+    int lo = (int)node->first_child, hi = lo + (int)node->num_children - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        int r = strcmp(index->names + index->nodes[mid].name, name);
+        if (r == 0) {
+            return mid;
+        } else if (r < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return -1;
+}
+
+_DMON_PRIVATE bool _dmon_index_modified(const dmon__index* index, const dmon__index_node* node,
+                                        const dmon__snapshot_stat* st)
+{
+    if (node->has_stat && node->mtime + _DMON_RACY_NSECS < index->save_time) {
+        return node->inode != st->inode || node->size != st->size || node->mtime != st->mtime;
+    }
+    return st->mtime + _DMON_RACY_NSECS >= index->save_time;
+}
+
+typedef struct dmon__restore dmon__restore;
+
+// change that is found by comparing the disk with what the watch knows, instead of being reported by inotify
+typedef struct dmon__found_event {
+    uint32_t mask;      // zero if the event is merged into a move
+    uint64_t inode;
+    int64_t mtime;      // -1 if unknown
+    const char* path;
+    int move_to;        // DELETE events: CREATE event of the same file, or -1
+} dmon__found_event;
+
+// results of a restore thread, they are merged into the watch at the end
+typedef struct dmon__restore_worker {
+    dmon__restore* restore;
+    char* entries;          // packed entries for the snapshot (dmon__snapshot_stat, then path)
+    char* events;           // packed events (mask, inode, then path)
+    dmon__crawl_dir* dirs;  // directories that are added to inotify
+    bool* seen;             // children of the current directory that are still there
+    uint64_t buff[_DMON_CRAWL_BUFFSIZE / sizeof(uint64_t)];
+} dmon__restore_worker;
+
+struct dmon__restore {
+    dmon__state* ctx;       // context of the watch, the threads of the restore use it
+    dmon__index index;
+    const char* rootdir;
+    uint32_t mask;
+    bool full;
+    int* dirs;              // index nodes of the directories to check
+    int* dir_paths;         // offset of the relative path of each directory in paths, with trailing slash
+    char* paths;
+    int next_dir;           // next directory to check, taken atomically by the threads
+    uint64_t dirs_skipped;  // updated atomically by the threads
+};
+
+_DMON_PRIVATE void _dmon_restore_entry(dmon__restore_worker* w, const dmon__snapshot_stat* st, const char* reldir,
+                                       const char* name)
+{
+    int reldir_len = (int)strlen(reldir);
+    int name_len = (int)strlen(name);
+    char* e = stb_sb_add(w->entries, (int)sizeof(*st) + reldir_len + name_len + 1);
+    memcpy(e, st, sizeof(*st));
+    memcpy(e + sizeof(*st), reldir, reldir_len);
+    memcpy(e + sizeof(*st) + reldir_len, name, name_len + 1);
+}
+
+// packs the found event (mask, inode, mtime, then path) into events
+_DMON_PRIVATE void _dmon_pack_event(char** events, uint32_t mask, uint64_t inode, int64_t mtime, const char* reldir,
+                                    const char* name)
+{
+    int reldir_len = (int)strlen(reldir);
+    int name_len = (int)strlen(name);
+    int header_size = (int)(sizeof(mask) + sizeof(inode) + sizeof(mtime));
+    char* e = stb_sb_add(*events, header_size + reldir_len + name_len + 1);
+    memcpy(e, &mask, sizeof(mask));
+    memcpy(e + sizeof(mask), &inode, sizeof(inode));
+    memcpy(e + sizeof(mask) + sizeof(inode), &mtime, sizeof(mtime));
+    memcpy(e + header_size, reldir, reldir_len);
+    memcpy(e + header_size + reldir_len, name, name_len + 1);
+}
+
+// appends the packed events to the array, their paths point into the packed buffer
+_DMON_PRIVATE void _dmon_unpack_events(const char* packed, dmon__found_event** events)
+{
+    int offset = 0;
+    while (offset < stb_sb_count(packed)) {
+        dmon__found_event* ev = stb_sb_add(*events, 1);
+        memcpy(&ev->mask, packed + offset, sizeof(ev->mask));
+        memcpy(&ev->inode, packed + offset + sizeof(ev->mask), sizeof(ev->inode));
+        memcpy(&ev->mtime, packed + offset + sizeof(ev->mask) + sizeof(ev->inode), sizeof(ev->mtime));
+        ev->path = packed + offset + sizeof(ev->mask) + sizeof(ev->inode) + sizeof(ev->mtime);
+        ev->move_to = -1;
+        offset += (int)(sizeof(ev->mask) + sizeof(ev->inode) + sizeof(ev->mtime) + strlen(ev->path) + 1);
+    }
+}
+
+// queues the found events of the watch. files that are deleted and created with the same inode are moved
+// while nobody was looking, so they are reported as a move. directories are only paired if move_dirs is set
+// inodes of deleted files are reused by new ones, so files are only paired if their mtime (which is kept by
+// renames) is the same as well
+_DMON_PRIVATE void _dmon_push_found_events(dmon__state* ctx, dmon_watch_id watch_id, dmon__found_event* events, bool move_dirs)
+{
+    uint32_t dirmask = move_dirs ? IN_ISDIR : 0;
+    dmon__hashtbl deleted;
+    memset(&deleted, 0x0, sizeof(deleted));
+    int i;
+    for (i = 0; i < stb_sb_count(events); i++) {
+        if ((events[i].mask & ~dirmask) == IN_DELETE && events[i].inode) {
+            _dmon_hashtbl_insert(&deleted, (uint32_t)(events[i].inode ^ (events[i].inode >> 32)), i);
+        }
+    }
+    for (i = 0; i < stb_sb_count(events) && deleted.count > 0; i++) {
+        if ((events[i].mask & ~dirmask) == IN_CREATE && events[i].inode) {
+            int d = _dmon_hashtbl_find(&deleted, (uint32_t)(events[i].inode ^ (events[i].inode >> 32)));
+            if (d != -1 && events[d].inode == events[i].inode && events[d].move_to == -1 &&
+                (events[d].mask & IN_ISDIR) == (events[i].mask & IN_ISDIR) &&
+                ((events[i].mask & IN_ISDIR) || events[d].mtime == events[i].mtime)) {
+                events[d].move_to = i;
+                events[i].mask = 0;
+            }
+        }
+    }
+    _dmon_hashtbl_free(&deleted);
+
+    // cookies of the made up moves are in a different range than inotify's, which start from zero
+    for (i = 0; i < stb_sb_count(events); i++) {
+        const dmon__found_event* ev = &events[i];
+        if (ev->move_to != -1) {
+            uint32_t cookie = 0x80000000 | ++ctx->found_cookie;
+            _dmon_push_event(ctx, watch_id, IN_MOVED_FROM | (ev->mask & IN_ISDIR), cookie, "", ev->path);
+            _dmon_push_event(ctx, watch_id, IN_MOVED_TO | (ev->mask & IN_ISDIR), cookie, "", events[ev->move_to].path);
+        } else if (ev->mask) {
+            _dmon_push_event(ctx, watch_id, ev->mask, 0, "", ev->path);
+        }
+    }
+}
+
+// compares the entry that is on the disk now with the index, and records the event for the difference
+_DMON_PRIVATE void _dmon_restore_compare(dmon__restore_worker* w, const dmon__index_node* old,
+                                         const dmon__snapshot_stat* st, const char* reldir, const char* name)
+{
+    uint32_t old_dirmask = old && old->type == DT_DIR ? IN_ISDIR : 0;
+    uint32_t dirmask = st->type == DT_DIR ? IN_ISDIR : 0;
+    if (old && old_dirmask != dirmask) {
+        _dmon_pack_event(&w->events, IN_DELETE | old_dirmask, old->inode, old->has_stat ? old->mtime : -1, reldir,
+                         name);
+        old = NULL;
+    }
+
+    if (old == NULL) {
+        _dmon_pack_event(&w->events, IN_CREATE | dirmask, st->inode, st->has_stat ? st->mtime : -1, reldir, name);
+    } else if (!dirmask && _dmon_index_modified(&w->restore->index, old, st)) {
+        _dmon_pack_event(&w->events, IN_MODIFY, 0, -1, reldir, name);
+    }
+    _dmon_restore_entry(w, st, reldir, name);
+}
+
+// checks a directory of the index against the disk. if the directory itself is not changed, only it's entries are
+// stat'ed, otherwise it's read again to find the created and deleted entries
+_DMON_PRIVATE void _dmon_restore_dir(dmon__state* ctx, dmon__restore_worker* w, int d)
+{
+    dmon__restore* restore = w->restore;
+    const dmon__index* index = &restore->index;
+    int n = restore->dirs[d];
+    const dmon__index_node* node = &index->nodes[n];
+    const char* reldir = restore->paths + restore->dir_paths[d];
+
+    // a truncated path would watch the wrong directory
+    char dirname[DMON_MAX_PATH];
+    int rootdir_len = (int)strlen(restore->rootdir);
+    int reldir_len = (int)strlen(reldir);
+    if (rootdir_len + reldir_len >= DMON_MAX_PATH) {
+        __atomic_fetch_add(&restore->dirs_skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    memcpy(dirname, restore->rootdir, rootdir_len);
+    memcpy(dirname + rootdir_len, reldir, reldir_len + 1);
+
+    // add the watch first, so changes after the check are not lost
+    int wd = -1;
+    if (n != 0) {
+        wd = inotify_add_watch(ctx->inotify_fd, dirname, restore->mask | IN_MASK_ADD);
+        if (wd == -1) {
+            return;     // deleted, it's reported by the parent
+        }
+        dmon__crawl_dir* dir = stb_sb_add(w->dirs, 1);
+        memset(dir, 0x0, sizeof(*dir));
+        _dmon_strcpy(dir->path, sizeof(dir->path), dirname);
+        dir->wd = wd;
+    }
+
+    int fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat dir_st;
+    if (fd == -1 || fstat(fd, &dir_st) != 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    dmon__snapshot_stat st;
+    memset(&st, 0x0, sizeof(st));
+    if (n == 0) {
+        _dmon_snapshot_from_stat(&dir_st, &st);
+        _dmon_restore_entry(w, &st, "", "");
+    }
+
+    int64_t mtime = (int64_t)dir_st.st_mtim.tv_sec * 1000000000 + (int64_t)dir_st.st_mtim.tv_nsec;
+    bool unchanged = node->has_stat && node->inode == (uint64_t)dir_st.st_ino && node->mtime == mtime &&
+                     node->mtime + _DMON_RACY_NSECS < index->save_time;
+
+    int c, first = (int)node->first_child, count = (int)node->num_children;
+    if (unchanged) {
+        // no entries are created, deleted or renamed, they may only be modified
+        for (c = first; c < first + count; c++) {
+            const char* name = index->names + index->nodes[c].name;
+            struct stat s;
+            if (fstatat(fd, name, &s, AT_SYMLINK_NOFOLLOW) == 0) {
+                _dmon_snapshot_from_stat(&s, &st);
+                _dmon_restore_compare(w, &index->nodes[c], &st, reldir, name);
+            } else {
+                _dmon_pack_event(&w->events, IN_DELETE | (index->nodes[c].type == DT_DIR ? IN_ISDIR : 0U),
+                                 index->nodes[c].inode, index->nodes[c].has_stat ? index->nodes[c].mtime : -1,
+                                 reldir, name);
+            }
+        }
+    } else {
+        stb_sb_reset(w->seen);
+        memset(stb_sb_add(w->seen, count + 1), 0x0, sizeof(bool) * (count + 1));
+
+        int len;
+        while ((len = _dmon_getdents(fd, (char*)w->buff, sizeof(w->buff))) > 0) {
+            int offset;
+            for (offset = 0; offset < len; offset += ((dmon__dirent*)((char*)w->buff + offset))->d_reclen) {
+                const dmon__dirent* entry = (const dmon__dirent*)((char*)w->buff + offset);
+                if (_dmon_dirent_isdots(entry)) {
+                    continue;
+                }
+                unsigned char type = _dmon_dirent_type(fd, entry);
+                _dmon_snapshot_stat_dirent(fd, entry, type, restore->full || type != DT_DIR, &st);
+
+                c = _dmon_index_find_child(index, node, entry->d_name);
+                if (c != -1) {
+                    w->seen[c - first] = true;
+                }
+                _dmon_restore_compare(w, c != -1 ? &index->nodes[c] : NULL, &st, reldir, entry->d_name);
+            }
+        }
+
+        for (c = first; c < first + count; c++) {
+            if (!w->seen[c - first]) {
+                _dmon_pack_event(&w->events, IN_DELETE | (index->nodes[c].type == DT_DIR ? IN_ISDIR : 0U),
+                                 index->nodes[c].inode, index->nodes[c].has_stat ? index->nodes[c].mtime : -1,
+                                 reldir, index->names + index->nodes[c].name);
+            }
+        }
+    }
+    close(fd);
+}
+
+_DMON_PRIVATE void* _dmon_restore_thread(void* arg)
+{
+    dmon__restore_worker* w = (dmon__restore_worker*)arg;
+    dmon__state* ctx = w->restore->ctx;
+    int num_dirs = stb_sb_count(w->restore->dirs);
+    int d;
+    while ((d = __sync_fetch_and_add(&w->restore->next_dir, 1)) < num_dirs) {
+        _dmon_restore_dir(ctx, w, d);
+    }
+    return NULL;
+}
+
+// restores the watch from the index file: the directories of the index are added to the watch and compared
+// with the disk, in parallel. the changes are reported as events. the caller must hold the lock
+// returns false if the index is not valid for the watch, nothing is done then
+_DMON_PRIVATE bool _dmon_index_restore(dmon__state* ctx, dmon__watch_state* watch, const char* filepath, int num_threads)
+{
+    dmon__restore restore;
+    memset(&restore, 0x0, sizeof(restore));
+    restore.ctx = ctx;
+    if (!_dmon_index_open(&restore.index, filepath, watch->rootdir)) {
+        _DMON_LOG_DEBUGF("Index file '%s' is not valid for the watch", filepath);
+        return false;
+    }
+    restore.rootdir = watch->rootdir;
+    restore.mask = _dmon_inotify_mask(watch->actions, false);
+    restore.full = (watch->watch_flags & DMON_WATCHFLAGS_SNAPSHOT) != 0;
+
+    // directories are found breadth-first, so the path of the parent is always known
+    const dmon__index* index = &restore.index;
+    int* node_paths = (int*)DMON_MALLOC(sizeof(int) * (size_t)index->num_nodes);
+    DMON_ASSERT(node_paths);
+    bool recursive = (watch->watch_flags & DMON_WATCHFLAGS_RECURSIVE) != 0;
+    int rootdir_len = (int)strlen(watch->rootdir);
+    int i, c;
+    for (i = 0; i < index->num_nodes; i++) {
+        node_paths[i] = -1;
+    }
+    node_paths[0] = 0;
+    stb_sb_push(restore.paths, '\0');
+    for (i = 0; i < index->num_nodes; i++) {
+        if (i > 0 && (index->nodes[i].type != DT_DIR || node_paths[i] == -1)) {
+            node_paths[i] = -1;
+            continue;
+        }
+        stb_sb_push(restore.dirs, i);
+        stb_sb_push(restore.dir_paths, node_paths[i]);
+
+        const dmon__index_node* node = &index->nodes[i];
+        for (c = (int)node->first_child; c < (int)(node->first_child + node->num_children); c++) {
+            node_paths[c] = -1;
+            if (recursive && index->nodes[c].type == DT_DIR) {
+                // the directories that don't fit in DMON_MAX_PATH (with the trailing slash) are skipped, like the
+                // crawl does
+                const char* name = index->names + index->nodes[c].name;
+                int parent_len = (int)strlen(restore.paths + node_paths[i]);
+                int name_len = (int)strlen(name);
+                if (rootdir_len + parent_len + name_len + 1 >= DMON_MAX_PATH) {
+                    _DMON_LOG_DEBUGF("Directory '%s' is not watched, the path is too long", name);
+                    ++restore.dirs_skipped;
+                    continue;
+                }
+
+                // the path of the parent is read after the add, since adding to paths may move it
+                char* p = stb_sb_add(restore.paths, parent_len + name_len + 2);
+                memcpy(p, restore.paths + node_paths[i], parent_len);
+                memcpy(p + parent_len, name, name_len);
+                p[parent_len + name_len] = '/';
+                p[parent_len + name_len + 1] = '\0';
+                node_paths[c] = (int)(p - restore.paths);
+            }
+        }
+    }
+    DMON_FREE(node_paths);
+
+    num_threads = _dmon_max(1, _dmon_min(num_threads, stb_sb_count(restore.dirs)));
+    dmon__restore_worker* workers = (dmon__restore_worker*)DMON_MALLOC(sizeof(dmon__restore_worker) * num_threads);
+    DMON_ASSERT(workers);
+    memset(workers, 0x0, sizeof(dmon__restore_worker) * num_threads);
+    pthread_t* threads = NULL;
+    for (i = 0; i < num_threads; i++) {
+        workers[i].restore = &restore;
+    }
+    for (i = 1; i < num_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, _dmon_restore_thread, &workers[i]) != 0) {
+            break;
+        }
+        stb_sb_push(threads, thread);
+    }
+    _dmon_restore_thread(&workers[0]);
+    for (i = 0; i < stb_sb_count(threads); i++) {
+        pthread_join(threads[i], NULL);
+    }
+    stb_sb_free(threads);
+
+    // merge the results, directories are added sorted by path like the crawl does
+    dmon__crawl_dir** sorted = NULL;
+    for (i = 0; i < num_threads; i++) {
+        for (c = 0; c < stb_sb_count(workers[i].dirs); c++) {
+            stb_sb_push(sorted, &workers[i].dirs[c]);
+        }
+    }
+    if (stb_sb_count(sorted) > 1) {
+        qsort(sorted, (size_t)stb_sb_count(sorted), sizeof(dmon__crawl_dir*), _dmon_crawl_compare);
+    }
+    for (i = 0; i < stb_sb_count(sorted); i++) {
+        _dmon_add_subdir(ctx, watch, sorted[i]->path, sorted[i]->wd);
+    }
+    stb_sb_free(sorted);
+    _DMON_STAT_ADD(ctx, watch, dirs_skipped, restore.dirs_skipped);
+
+    _dmon_snapshot_free(&watch->snapshot);
+    _dmon_snapshot_init(&watch->snapshot);
+    dmon__found_event* events = NULL;
+    for (i = 0; i < num_threads; i++) {
+        _dmon_snapshot_add_packed(&watch->snapshot, workers[i].entries);
+        _dmon_unpack_events(workers[i].events, &events);
+    }
+    // moved directories are not added to inotify yet, as created directories they are added on delivery
+    _dmon_push_found_events(ctx, watch->id, events, false);
+    if (stb_sb_count(events) > 0) {
+        _dmon_wake_thread(ctx);    // starts the flush timer
+    }
+    stb_sb_free(events);
+
+    for (i = 0; i < num_threads; i++) {
+        stb_sb_free(workers[i].entries);
+        stb_sb_free(workers[i].events);
+        stb_sb_free(workers[i].dirs);
+        stb_sb_free(workers[i].seen);
+    }
+
+    DMON_FREE(workers);
+    stb_sb_free(restore.dirs);
+    stb_sb_free(restore.dir_paths);
+    stb_sb_free(restore.paths);
+    _dmon_index_close(&restore.index);
+    return true;
+}
+
+_DMON_PRIVATE void _dmon_gather_recursive(dmon__state* ctx, dmon__watch_state* watch, const char* dirname)
+{
+    int fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return;     // already removed
+    }
+
+    // events are relative to rootdir
+    const char* reldir = dirname;
+    if (strstr(dirname, watch->rootdir) == dirname) {
+        reldir = dirname + strlen(watch->rootdir);
+    }
+
+    uint64_t buff[512];     // aligned for the records
+    int len;
+    while ((len = _dmon_getdents(fd, (char*)buff, sizeof(buff))) > 0) {
+        int offset;
+        for (offset = 0; offset < len; offset += ((dmon__dirent*)((char*)buff + offset))->d_reclen) {
+            const dmon__dirent* entry = (const dmon__dirent*)((char*)buff + offset);
+            if (!_dmon_dirent_isdots(entry)) {
+                bool is_dir = _dmon_dirent_type(fd, entry) == DT_DIR;
+                if (_dmon_ignored(watch->ignore, reldir, entry->d_name, is_dir)) {
+                    continue;
+                }
+                _dmon_push_event(ctx, watch->id, IN_CREATE|(is_dir ? IN_ISDIR : 0U), 0, reldir, entry->d_name);
+            }
+        }
+    }
+    close(fd);
+}
+
+// returns the coalescing state of the event's path, creates it if it's the first time we see the path
+_DMON_PRIVATE dmon__inotify_pathkey* _dmon_inotify_pathkey(dmon__state* ctx, int event_index)
+{
+    const dmon__inotify_event* ev = &ctx->events[event_index];
+    int head = _dmon_hashtbl_find(&ctx->path_tbl, ev->hash);
+    int k;
+    for (k = head; k != -1; k = ctx->pathkeys[k].next) {
+        const dmon__inotify_event* key_ev = &ctx->events[ctx->pathkeys[k].event];
+        if (key_ev->watch_id.id == ev->watch_id.id && key_ev->len == ev->len &&
+            memcmp(_dmon_event_path(ctx, key_ev), _dmon_event_path(ctx, ev), ev->len) == 0) {
+            return &ctx->pathkeys[k];
+        }
+    }
+
+    dmon__inotify_pathkey key;
+    key.event = event_index;
+    key.next = head;
+    key.modify = -1;
+    key.close_write = -1;
+    key.attrib = -1;
+    key.create = -1;
+    key.deleted = false;
+    _dmon_hashtbl_insert(&ctx->path_tbl, ev->hash, stb_sb_count(ctx->pathkeys));
+    stb_sb_push(ctx->pathkeys, key);
+    return &stb_sb_last(ctx->pathkeys);
+}
+
+// overlapping watches receive the same move events, so cookies are paired per watch
+_DMON_PRIVATE uint32_t _dmon_move_key(const dmon__inotify_event* ev)
+{
+    return ev->cookie ^ _dmon_hash_u32(ev->watch_id.id);
+}
+
+// returns the first event of the batch in the table with the same cookie and watch, or -1
+_DMON_PRIVATE int _dmon_find_move(dmon__state* ctx, const dmon__hashtbl* tbl, const dmon__inotify_event* ev)
+{
+    int k;
+    for (k = _dmon_hashtbl_find(tbl, _dmon_move_key(ev)); k != -1; k = ctx->movekeys[k].next) {
+        const dmon__inotify_event* key_ev = &ctx->events[ctx->movekeys[k].event];
+        if (key_ev->cookie == ev->cookie && key_ev->watch_id.id == ev->watch_id.id) {
+            return ctx->movekeys[k].event;
+        }
+    }
+    return -1;
+}
+
+// keys of different (cookie, watch) pairs can collide, so the events are chained like pathkeys
+_DMON_PRIVATE void _dmon_add_move(dmon__state* ctx, dmon__hashtbl* tbl, int event_index)
+{
+    const dmon__inotify_event* ev = &ctx->events[event_index];
+    if (_dmon_find_move(ctx, tbl, ev) != -1) {
+        return;
+    }
+
+    dmon__inotify_movekey key;
+    key.event = event_index;
+    key.next = _dmon_hashtbl_find(tbl, _dmon_move_key(ev));
+    _dmon_hashtbl_insert(tbl, _dmon_move_key(ev), stb_sb_count(ctx->movekeys));
+    stb_sb_push(ctx->movekeys, key);
+}
+
+// applies the event to the snapshot, moves are applied with their MOVED_FROM event
+_DMON_PRIVATE void _dmon_snapshot_apply(dmon__state* ctx, dmon__watch_state* watch, int event_index)
+{
+    dmon__snapshot* snap = &watch->snapshot;
+    const dmon__inotify_event* ev = &ctx->events[event_index];
+    bool full = (watch->watch_flags & DMON_WATCHFLAGS_SNAPSHOT) != 0;
+    if (!full && (ev->mask & IN_ISDIR) == 0) {
+        return;     // only the directories are kept
+    }
+    const char* path = _dmon_event_path(ctx, ev);
+
+    dmon__snapshot_stat st;
+    memset(&st, 0x0, sizeof(st));
+    st.type = (ev->mask & IN_ISDIR) ? DT_DIR : DT_REG;
+    if (full && (ev->mask & (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE))) {
+        char fullpath[DMON_MAX_PATH];
+        struct stat s;
+        _dmon_strcpy(fullpath, sizeof(fullpath), watch->rootdir);
+        _dmon_strcat(fullpath, sizeof(fullpath), path);
+        if (lstat(fullpath, &s) == 0) {
+            _dmon_snapshot_from_stat(&s, &st);
+        }
+    }
+
+    if ((ev->mask & IN_ISDIR) && watch->poll) {
+        // the new directory is gathered on delivery, it's read again on the next poll for the entries that are
+        // created in between
+        st.has_stat = false;
+    }
+
+    if (ev->mask & IN_CREATE) {
+        // rescans and restores add the entries before their events, with more than the event knows
+        int n = full ? -1 : _dmon_snapshot_lookup(snap, path);
+        if (n <= 0 || (snap->nodes[n].st.type == DT_DIR) != ((ev->mask & IN_ISDIR) != 0)) {
+            _dmon_snapshot_add_path(snap, path, &st);
+        }
+    } else if (ev->mask & (IN_MODIFY | IN_CLOSE_WRITE)) {
+        if (full) {
+            _dmon_snapshot_add_path(snap, path, &st);
+        }
+    } else if (ev->mask & IN_DELETE) {
+        int n = _dmon_snapshot_lookup(snap, path);
+        if (n > 0) {
+            _dmon_snapshot_remove(snap, n);
+        }
+    } else if (ev->mask & IN_MOVED_FROM) {
+        int move_to = _dmon_find_move(ctx, &ctx->moved_to_tbl, ev);
+        if (move_to > event_index && (ctx->events[move_to].mask & IN_MOVED_TO)) {
+            const char* newpath = _dmon_event_path(ctx, &ctx->events[move_to]);
+            int n = _dmon_snapshot_lookup(snap, path);
+            if (n <= 0) {
+                if (_dmon_snapshot_lookup(snap, newpath) == -1) {
+                    _dmon_snapshot_add_path(snap, newpath, &st);
+                }
+                return;
+            }
+
+            const char* name = strrchr(newpath, '/');
+            name = name ? name + 1 : newpath;
+            char dirpath[DMON_MAX_PATH];
+            _dmon_strcpy(dirpath, _dmon_min((int)sizeof(dirpath), (int)(name - newpath) + 1), newpath);
+            int dir = _dmon_snapshot_lookup(snap, dirpath);
+            if (dir == -1) {
+                st.type = DT_DIR;
+                dir = _dmon_snapshot_add_path(snap, dirpath, &st);
+            }
+            _dmon_snapshot_move(snap, n, dir, name, (int)strlen(name));
+        }
+    }
+}
+
+_DMON_PRIVATE void _dmon_drain_fd(int fd)
+{
+    uint64_t value;
+    ssize_t r = read(fd, &value, sizeof(value));
+    _DMON_UNUSED(r);
+}
+
+_DMON_PRIVATE void _dmon_queue_init(dmon__state* ctx)
+{
+    dmon__queue* q = &ctx->queue;
+    if (q->cells) {
+        return;
+    }
+    DMON_ASSERT((DMON_QUEUE_SIZE & (DMON_QUEUE_SIZE - 1)) == 0 && "DMON_QUEUE_SIZE must be a power of two");
+    dmon__queue_cell* cells = (dmon__queue_cell*)DMON_MALLOC(sizeof(dmon__queue_cell) * DMON_QUEUE_SIZE);
+    DMON_ASSERT(cells);
+    uint32_t i;
+    for (i = 0; i < DMON_QUEUE_SIZE; i++) {
+        cells[i].seq = i;
+    }
+    q->mask = DMON_QUEUE_SIZE - 1;
+    __atomic_store_n(&q->cells, cells, __ATOMIC_RELEASE);
+}
+
+// returns false and counts the event as dropped if the queue is full
+_DMON_PRIVATE bool _dmon_queue_push(dmon__state* ctx, dmon_watch_id watch_id, dmon_action action, const char* filepath,
+                                    const char* oldfilepath)
+{
+    dmon__queue* q = &ctx->queue;
+    uint32_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    for (;;) {
+        dmon__queue_cell* cell = &q->cells[pos & q->mask];
+        int32_t diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->event.watch_id = watch_id;
+                cell->event.action = action;
+                _dmon_strcpy(cell->event.filepath, sizeof(cell->event.filepath), filepath);
+                _dmon_strcpy(cell->event.oldfilepath, sizeof(cell->event.oldfilepath), oldfilepath ? oldfilepath : "");
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                q->pushed = true;
+                return true;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+            return false;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// pops up to max events without blocking, can be called from any thread
+_DMON_PRIVATE int _dmon_queue_pop(dmon__state* ctx, dmon_queued_event* events, int max)
+{
+    dmon__queue* q = &ctx->queue;
+    dmon__queue_cell* cells = (dmon__queue_cell*)__atomic_load_n(&q->cells, __ATOMIC_ACQUIRE);
+    if (cells == NULL) {
+        return 0;
+    }
+
+    int count = 0;
+    uint32_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    while (count < max) {
+        dmon__queue_cell* cell = &cells[pos & q->mask];
+        int32_t diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                dmon_queued_event* ev = &events[count++];
+                ev->watch_id = cell->event.watch_id;
+                ev->action = cell->event.action;
+                _dmon_strcpy(ev->filepath, sizeof(ev->filepath), cell->event.filepath);
+                _dmon_strcpy(ev->oldfilepath, sizeof(ev->oldfilepath), cell->event.oldfilepath);
+                __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+                pos++;
+            }
+        } else if (diff < 0) {
+            break;  // empty
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    return count;
+}
+
+// number of events in the queue, it can be out of date as soon as it's returned
+_DMON_PRIVATE int _dmon_queue_count(dmon__state* ctx)
+{
+    uint32_t tail = __atomic_load_n(&ctx->queue.tail, __ATOMIC_RELAXED);
+    int32_t count = (int32_t)(__atomic_load_n(&ctx->queue.head, __ATOMIC_RELAXED) - tail);
+    return _dmon_max(0, _dmon_min(count, DMON_QUEUE_SIZE));
+}
+
+_DMON_PRIVATE void _dmon_queue_signal(dmon__state* ctx)
+{
+    uint64_t one = 1;
+    ssize_t r = write(ctx->queue.event_fd, &one, sizeof(one));
+    _DMON_UNUSED(r);
+}
+
+// same as _dmon_queue_pop, but waits for at most timeout_ms milliseconds (forever if negative) for the events
+_DMON_PRIVATE int _dmon_queue_wait(dmon__state* ctx, dmon_queued_event* events, int max, int timeout_ms)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        int count = _dmon_queue_pop(ctx, events, max);
+        if (count > 0) {
+            // the signal is consumed by a single waiter, so it's passed on to the others if there are events left
+            if (_dmon_queue_count(ctx) > 0) {
+                _dmon_queue_signal(ctx);
+            }
+            return count;
+        }
+
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int64_t elapsed_ms = (int64_t)(now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (elapsed_ms >= timeout_ms) {
+                return 0;
+            }
+            wait_ms = timeout_ms - (int)elapsed_ms;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = ctx->queue.event_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, wait_ms) > 0) {
+            _dmon_drain_fd(ctx->queue.event_fd);
+        }
+    }
+}
+
+_DMON_PRIVATE uint32_t _dmon_dispatch_add_path(dmon__dispatch* d, const char* path)
+{
+    int len = (int)strlen(path) + 1;
+    uint32_t offset = (uint32_t)stb_sb_count(d->staged_paths);
+    memcpy(stb_sb_add(d->staged_paths, len), path, len);
+    return offset;
+}
+
+// keeps the event for the callback threads, which get it at the end of the flush
+_DMON_PRIVATE void _dmon_dispatch_push(dmon__state* ctx, dmon__watch_state* watch, dmon_action action, const char* filepath,
+                                       const char* oldfilepath)
+{
+    dmon__dispatch* d = watch->dispatch;
+    if (d == NULL) {
+        d = (dmon__dispatch*)DMON_MALLOC(sizeof(dmon__dispatch));
+        DMON_ASSERT(d);
+        memset(d, 0x0, sizeof(dmon__dispatch));
+        d->id = watch->id;
+        d->watch_cb = watch->watch_cb;
+        d->batch_cb = watch->batch_cb;
+        d->user_data = watch->user_data;
+        _dmon_strcpy(d->rootdir, sizeof(d->rootdir), watch->rootdir);
+        watch->dispatch = d;
+    }
+
+    if (stb_sb_count(d->staged) == 0) {
+        stb_sb_push(ctx->cb_staged, d);
+    }
+    dmon__callback* cb = stb_sb_add(d->staged, 1);
+    cb->action = action;
+    cb->path = _dmon_dispatch_add_path(d, filepath);
+    cb->oldpath = oldfilepath ? (int)_dmon_dispatch_add_path(d, oldfilepath) : -1;
+}
+
+// hands the callbacks of the flush over to the callback threads, so batch callbacks get whole flushes
+_DMON_PRIVATE void _dmon_dispatch_flush(dmon__state* ctx)
+{
+    int i, j;
+    pthread_mutex_lock(&ctx->cb_mutex);
+    for (i = 0; i < stb_sb_count(ctx->cb_staged); i++) {
+        dmon__dispatch* d = ctx->cb_staged[i];
+        if (stb_sb_count(d->pending) == 0) {
+            dmon__callback* callbacks = d->pending;
+            char* paths = d->pending_paths;
+            d->pending = d->staged;
+            d->pending_paths = d->staged_paths;
+            d->staged = callbacks;
+            d->staged_paths = paths;
+        } else {
+            // the callbacks of the previous flushes are still waiting
+            int num_paths = stb_sb_count(d->pending_paths);
+            int num_staged = stb_sb_count(d->staged);
+            dmon__callback* cbs = stb_sb_add(d->pending, num_staged);
+            for (j = 0; j < num_staged; j++) {
+                cbs[j] = d->staged[j];
+                cbs[j].path += (uint32_t)num_paths;
+                cbs[j].oldpath = cbs[j].oldpath != -1 ? cbs[j].oldpath + num_paths : -1;
+            }
+            memcpy(stb_sb_add(d->pending_paths, stb_sb_count(d->staged_paths)), d->staged_paths,
+                   stb_sb_count(d->staged_paths));
+        }
+        stb_sb_reset(d->staged);
+        stb_sb_reset(d->staged_paths);
+
+        if (!d->scheduled) {
+            d->scheduled = true;
+            stb_sb_push(ctx->cb_ready, d);
+        }
+    }
+    stb_sb_reset(ctx->cb_staged);
+    pthread_cond_broadcast(&ctx->cb_cond);
+    pthread_mutex_unlock(&ctx->cb_mutex);
+}
+
+_DMON_PRIVATE void _dmon_dispatch_free(dmon__dispatch* d)
+{
+    stb_sb_free(d->staged);
+    stb_sb_free(d->staged_paths);
+    stb_sb_free(d->pending);
+    stb_sb_free(d->pending_paths);
+    stb_sb_free(d->running);
+    stb_sb_free(d->running_paths);
+    stb_sb_free(d->events);
+    DMON_FREE(d);
+}
+
+// the rest of the callbacks are dropped. running callbacks are not waited for, see _dmon_dispatch_wait
+_DMON_PRIVATE void _dmon_dispatch_remove(dmon__state* ctx, dmon__dispatch* d)
+{
+    pthread_mutex_lock(&ctx->cb_mutex);
+    __atomic_store_n(&d->removed, true, __ATOMIC_RELAXED);
+    if (!d->scheduled) {
+        _dmon_dispatch_free(d);
+    }
+    pthread_mutex_unlock(&ctx->cb_mutex);
+}
+
+_DMON_PRIVATE bool _dmon_is_callback_thread(dmon__state* ctx)
+{
+    int i;
+    for (i = 0; i < stb_sb_count(ctx->cb_threads); i++) {
+        if (pthread_equal(ctx->cb_threads[i].thread, pthread_self())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// waits for the callbacks of the removed watch that are still running. callbacks that remove watches don't wait,
+// otherwise two of them could wait for each other
+_DMON_PRIVATE void _dmon_dispatch_wait(dmon__state* ctx, dmon_watch_id id)
+{
+    if (_dmon_is_callback_thread(ctx)) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->cb_mutex);
+    for (;;) {
+        int i;
+        bool running = false;
+        for (i = 0; i < stb_sb_count(ctx->cb_threads); i++) {
+            running |= ctx->cb_threads[i].running.id == id.id;
+        }
+        if (!running) {
+            break;
+        }
+        pthread_cond_wait(&ctx->cb_done_cond, &ctx->cb_mutex);
+    }
+    pthread_mutex_unlock(&ctx->cb_mutex);
+}
+
+// the watch may be gone, so the times are kept in the dispatch until dmon_get_stats
+_DMON_PRIVATE void _dmon_dispatch_stat_callback(dmon__state* ctx, dmon__dispatch* d, uint64_t start)
+{
+    uint64_t ns = _dmon_now_ns() - start;
+    __atomic_fetch_add(&ctx->stats.callback_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&d->callback_ns, ns, __ATOMIC_RELAXED);
+    _dmon_stat_max(&ctx->stats.callback_max_ns, ns);
+    _dmon_stat_max(&d->callback_max_ns, ns);
+}
+
+_DMON_PRIVATE void _dmon_dispatch_run(dmon__state* ctx, dmon__dispatch* d)
+{
+    int i, count = stb_sb_count(d->running);
+    if (d->batch_cb) {
+        stb_sb_reset(d->events);
+        for (i = 0; i < count; i++) {
+            const dmon__callback* cb = &d->running[i];
+            dmon_event* ev = stb_sb_add(d->events, 1);
+            ev->watch_id = d->id;
+            ev->action = cb->action;
+            ev->filepath = d->running_paths + cb->path;
+            ev->oldfilepath = cb->oldpath != -1 ? d->running_paths + cb->oldpath : NULL;
+        }
+        if (count > 0 && !__atomic_load_n(&d->removed, __ATOMIC_RELAXED)) {
+            uint64_t start = _dmon_now_ns();
+            d->batch_cb(d->id, d->rootdir, d->events, count, d->user_data);
+            _dmon_dispatch_stat_callback(ctx, d, start);
+        }
+        return;
+    }
+
+    for (i = 0; i < count && !__atomic_load_n(&d->removed, __ATOMIC_RELAXED); i++) {
+        const dmon__callback* cb = &d->running[i];
+        uint64_t start = _dmon_now_ns();
+        d->watch_cb(d->id, cb->action, d->rootdir, d->running_paths + cb->path,
+                    cb->oldpath != -1 ? d->running_paths + cb->oldpath : NULL, d->user_data);
+        _dmon_dispatch_stat_callback(ctx, d, start);
+    }
+}
+
+// callbacks are called without the lock. a dispatch is run by one thread at a time, which keeps the order of the
+// events of every watch
+_DMON_PRIVATE void* _dmon_callback_thread(void* arg)
+{
+    dmon__callback_thread* self = (dmon__callback_thread*)arg;
+    dmon__state* ctx = self->ctx;
+
+    pthread_mutex_lock(&ctx->cb_mutex);
+    for (;;) {
+        while (!ctx->cb_quit && ctx->cb_ready_head == stb_sb_count(ctx->cb_ready)) {
+            pthread_cond_wait(&ctx->cb_cond, &ctx->cb_mutex);
+        }
+        if (ctx->cb_quit) {
+            break;
+        }
+
+        dmon__dispatch* d = ctx->cb_ready[ctx->cb_ready_head++];
+        if (ctx->cb_ready_head == stb_sb_count(ctx->cb_ready)) {
+            stb_sb_reset(ctx->cb_ready);
+            ctx->cb_ready_head = 0;
+        }
+
+        dmon__callback* callbacks = d->running;
+        char* paths = d->running_paths;
+        d->running = d->pending;
+        d->running_paths = d->pending_paths;
+        d->pending = callbacks;
+        d->pending_paths = paths;
+        stb_sb_reset(d->pending);
+        stb_sb_reset(d->pending_paths);
+        self->running = d->id;
+        pthread_mutex_unlock(&ctx->cb_mutex);
+
+        _dmon_dispatch_run(ctx, d);
+
+        pthread_mutex_lock(&ctx->cb_mutex);
+        self->running = _dmon_make_id(0);
+        pthread_cond_broadcast(&ctx->cb_done_cond);
+        if (d->removed) {
+            _dmon_dispatch_free(d);
+        } else if (stb_sb_count(d->pending) > 0) {
+            // back to the end of the list, so other watches are not held up by a busy one
+            stb_sb_push(ctx->cb_ready, d);
+        } else {
+            d->scheduled = false;
+        }
+    }
+    pthread_mutex_unlock(&ctx->cb_mutex);
+    return NULL;
+}
+
+_DMON_PRIVATE void _dmon_start_callback_threads(dmon__state* ctx)
+{
+    pthread_mutex_init(&ctx->cb_mutex, NULL);
+    pthread_cond_init(&ctx->cb_cond, NULL);
+    pthread_cond_init(&ctx->cb_done_cond, NULL);
+
+    // the threads keep pointers to their own items, so the array is not grown after this
+    int i;
+    if (DMON_CALLBACK_THREADS > 0) {
+        dmon__callback_thread* threads = stb_sb_add(ctx->cb_threads, DMON_CALLBACK_THREADS);
+        memset(threads, 0x0, sizeof(dmon__callback_thread) * DMON_CALLBACK_THREADS);
+    }
+    for (i = 0; i < stb_sb_count(ctx->cb_threads); i++) {
+        ctx->cb_threads[i].ctx = ctx;
+        int r = pthread_create(&ctx->cb_threads[i].thread, NULL, _dmon_callback_thread, &ctx->cb_threads[i]);
+        _DMON_UNUSED(r);
+        DMON_ASSERT(r == 0 && "pthread_create failed");
+    }
+}
+
+// the callbacks that are not called yet are dropped
+_DMON_PRIVATE void _dmon_stop_callback_threads(dmon__state* ctx)
+{
+    pthread_mutex_lock(&ctx->cb_mutex);
+    ctx->cb_quit = true;
+    pthread_cond_broadcast(&ctx->cb_cond);
+    pthread_mutex_unlock(&ctx->cb_mutex);
+
+    int i;
+    for (i = 0; i < stb_sb_count(ctx->cb_threads); i++) {
+        pthread_join(ctx->cb_threads[i].thread, NULL);
+    }
+    for (i = ctx->cb_ready_head; i < stb_sb_count(ctx->cb_ready); i++) {
+        dmon__dispatch* d = ctx->cb_ready[i];
+        d->scheduled = false;
+        if (d->removed) {
+            _dmon_dispatch_free(d);
+        }
+    }
+    stb_sb_free(ctx->cb_ready);
+    stb_sb_free(ctx->cb_staged);
+    stb_sb_free(ctx->cb_threads);
+    ctx->cb_ready = NULL;
+    ctx->cb_staged = NULL;
+    ctx->cb_threads = NULL;
+}
+
+// calls the callback of the watch, keeps the event for the batch of the watch or pushes it to the queue
+// old_ev is the MOVED_FROM event of moves, ev is the one with the new path
+_DMON_PRIVATE void _dmon_deliver(dmon__state* ctx, dmon__watch_state* watch, dmon_action action, const dmon__inotify_event* ev,
+                                 const dmon__inotify_event* old_ev)
+{
+    if (!_dmon_watch_wants(watch, action)) {
+        return;
+    }
+
+    if (watch->queued) {
+        if (_dmon_queue_push(ctx, watch->id, action, _dmon_event_path(ctx, ev), old_ev ? _dmon_event_path(ctx, old_ev) : NULL)) {
+            _DMON_STAT_ADD(ctx, watch, events_delivered, 1);
+        }
+        return;
+    }
+
+    _DMON_STAT_ADD(ctx, watch, events_delivered, 1);
+    if (stb_sb_count(ctx->cb_threads) > 0) {
+        _dmon_dispatch_push(ctx, watch, action, _dmon_event_path(ctx, ev), old_ev ? _dmon_event_path(ctx, old_ev) : NULL);
+    } else if (watch->batch_cb) {
+        dmon__batch_entry* e = stb_sb_add(ctx->batch, 1);
+        e->watch_id = watch->id;
+        e->action = action;
+        e->path = ev->path;
+        e->oldpath = old_ev ? (int)old_ev->path : -1;
+        e->delivered = false;
+    } else {
+        dmon_watch_id id = watch->id;
+        uint64_t start = _dmon_now_ns();
+        watch->watch_cb(id, action, watch->rootdir, _dmon_event_path(ctx, ev),
+                        old_ev ? _dmon_event_path(ctx, old_ev) : NULL, watch->user_data);
+        _dmon_stat_callback(ctx, id, start);
+    }
+}
+
+// calls the batch callbacks, once for each watch with all of it's events of the flush in order
+_DMON_PRIVATE void _dmon_deliver_batches(dmon__state* ctx)
+{
+    int i, j, count = stb_sb_count(ctx->batch);
+    stb_sb_reset(ctx->batch_events);
+    for (i = 0; i < count; i++) {
+        if (ctx->batch[i].delivered) {
+            continue;
+        }
+        for (j = i; j < count; j++) {
+            dmon__batch_entry* e = &ctx->batch[j];
+            if (!e->delivered && e->watch_id.id == ctx->batch[i].watch_id.id) {
+                dmon_event* ev = stb_sb_add(ctx->batch_events, 1);
+                ev->watch_id = e->watch_id;
+                ev->action = e->action;
+                ev->filepath = ctx->batch_paths + e->path;
+                ev->oldfilepath = e->oldpath != -1 ? ctx->batch_paths + e->oldpath : NULL;
+                e->delivered = true;
+            }
+        }
+    }
+    stb_sb_reset(ctx->batch);
+
+    // a callback may remove the watches of the next batches
+    i = 0;
+    while (i < stb_sb_count(ctx->batch_events)) {
+        dmon_watch_id id = ctx->batch_events[i].watch_id;
+        for (j = i; j < stb_sb_count(ctx->batch_events) && ctx->batch_events[j].watch_id.id == id.id; j++) {
+        }
+        dmon__watch_state* watch = _dmon_get_watch(ctx, id);
+        if (watch && watch->batch_cb) {
+            uint64_t start = _dmon_now_ns();
+            watch->batch_cb(id, watch->rootdir, ctx->batch_events + i, j - i, watch->user_data);
+            _dmon_stat_callback(ctx, id, start);
+        }
+        i = j;
+    }
+}
+
+_DMON_PRIVATE void _dmon_inotify_process_events(dmon__state* ctx)
+{
+    int i, c = stb_sb_count(ctx->events);
+
+    // all the rules below are applied in a single pass over the batch. instead of searching the rest
+    // of the events for each event, every event looks back at the state that the previous events
+    // left for it's path (path_tbl) or move cookie (moved_from_tbl/moved_to_tbl)
+    _dmon_hashtbl_reserve(&ctx->path_tbl, c);
+    for (i = 0; i < c; i++) {
+        const dmon__inotify_event* ev = &ctx->events[i];
+        if (ev->mask & IN_MOVED_FROM) {
+            _dmon_add_move(ctx, &ctx->moved_from_tbl, i);
+        } else if (ev->mask & IN_MOVED_TO) {
+            _dmon_add_move(ctx, &ctx->moved_to_tbl, i);
+        }
+    }
+
+    for (i = 0; i < c; i++) {
+        dmon__inotify_event* ev = &ctx->events[i];
+        dmon__inotify_pathkey* key = _dmon_inotify_pathkey(ctx, i);
+
+        // remove redundant modify events on a single file, only the last one survives
+        // directory MODIFY events are also removed if any other event happens later on the directory
+        if (key->modify != -1 && (ev->mask & (IN_MODIFY|IN_ISDIR)) &&
+            ((ev->mask & IN_MODIFY) || (ctx->events[key->modify].mask & IN_ISDIR))) {
+            dmon__watch_state* watch = _dmon_get_watch(ctx, ev->watch_id);
+            _DMON_STAT_ADD(ctx, watch, merged_modify, 1);
+            ctx->events[key->modify].skip = true;
+            key->modify = -1;
+        }
+
+        // MODIFY events with a cookie are moves that are turned into MODIFY by the gedit case below
+        // they are the actual content change of the file, so they are always kept
+        if ((ev->mask & IN_MODIFY) && ev->cookie == 0) {
+            if (key->create != -1) {
+                // Another case is that file is copied. CREATE and MODIFY happens sequentially
+                // so we ignore MODIFY event
+                ev->skip = true;
+            } else if (key->deleted) {
+                // if the file is DELETED and then MODIFIED after, just ignore the modify event
+                ev->skip = true;
+                key->deleted = false;
+            }
+            if (ev->skip) {
+                dmon__watch_state* watch = _dmon_get_watch(ctx, ev->watch_id);
+                _DMON_STAT_ADD(ctx, watch, merged_create_modify, 1);
+            }
+        }
+
+        // the file is complete after the last CLOSE_WRITE, the ones before it are removed. unlike MODIFY, it's
+        // kept after a CREATE, since the file may be still written when it's created
+        if (ev->mask & IN_CLOSE_WRITE) {
+            if (key->close_write != -1) {
+                dmon__watch_state* watch = _dmon_get_watch(ctx, ev->watch_id);
+                _DMON_STAT_ADD(ctx, watch, merged_modify, 1);
+                ctx->events[key->close_write].skip = true;
+            }
+            if (key->deleted && key->create == -1) {
+                ev->skip = true;    // closed after it's deleted
+            }
+        }
+
+        // only the last ATTRIB of a path is kept, and none after it's created or deleted, like touch does
+        if (ev->mask & IN_ATTRIB) {
+            if (key->attrib != -1) {
+                dmon__watch_state* watch = _dmon_get_watch(ctx, ev->watch_id);
+                _DMON_STAT_ADD(ctx, watch, merged_modify, 1);
+                ctx->events[key->attrib].skip = true;
+            }
+            ev->skip = key->create != -1 || key->deleted;
+            key->attrib = ev->skip ? -1 : i;
+        }
+
+        if (ev->mask & IN_MODIFY) {
+            key->modify = i;
+        } else if (ev->mask & IN_CLOSE_WRITE) {
+            key->close_write = ev->skip ? -1 : i;
+        } else if ((ev->mask & IN_MOVED_FROM) && key->create != -1) {
+            // there is a case where some programs (like gedit):
+            // when we save, it creates a temp file, and moves it to the file being modified
+            // search for these cases and remove all of them
+            int move_to = _dmon_find_move(ctx, &ctx->moved_to_tbl, ev);
+            if (move_to > i) {
+                dmon__watch_state* watch = _dmon_get_watch(ctx, ev->watch_id);
+                _DMON_STAT_ADD(ctx, watch, merged_temp_rename, 1);
+                // change to modified, or written for close-write watches, which also drop the write of the temp file
+                bool close_write = watch && (watch->actions & DMON_ACTIONMASK(DMON_ACTION_CLOSE_WRITE));
+                ctx->events[move_to].mask = close_write ? IN_CLOSE_WRITE : IN_MODIFY;
+                if (key->close_write != -1) {
+                    ctx->events[key->close_write].skip = true;
+                    key->close_write = -1;
+                }
+                ctx->events[key->create].skip = ev->skip = true;
+                key->create = -1;
+            }
+        }
+
+        if (ev->skip) {
+            continue;
+        }
+
+        if (ev->mask & (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB)) {
+            // nothing to do, these events are resolved by the events coming after them
+        } else if (ev->mask & IN_CREATE) {
+            if (key->create == -1) {
+                key->create = i;
+            }
+        } else if (ev->mask & IN_MOVED_FROM) {
+            // in some environments like nautilus file explorer:
+            // when a file is deleted, it is moved to recycle bin
+            // so if the destination of the move is not valid, it's probably DELETE
+            if (_dmon_find_move(ctx, &ctx->moved_to_tbl, ev) <= i) {
+                ev->mask = IN_DELETE | (ev->mask & IN_ISDIR);
+            }
+        } else if (ev->mask & IN_MOVED_TO) {
+            // in some environments like nautilus file explorer:
+            // when a file is deleted, it is moved to recycle bin, on undo it is moved back it
+            // so if the destination of the move is not valid, it's probably CREATE
+            int move_from = _dmon_find_move(ctx, &ctx->moved_from_tbl, ev);
+            if (move_from == -1 || move_from > i) {
+                ev->mask = IN_CREATE | (ev->mask & IN_ISDIR);
+            }
+        } else if (ev->mask & IN_DELETE) {
+            key->deleted = true;
+        }
+    }
+
+    // trigger user callbacks
+    for (i = 0; i < stb_sb_count(ctx->events); i++) {
+        dmon__inotify_event* ev = &ctx->events[i];
+        if (ev->skip) {
+            continue;
+        }
+        dmon__watch_state* watch = _dmon_get_watch(ctx, ev->watch_id);
+
+        if(watch == NULL) {
+            continue;
+        }
+
+        // the snapshot is updated before the callback, since the callback may remove the watch
+        if (!watch->fanotify) {
+            _dmon_snapshot_apply(ctx, watch, i);
+        }
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+            _dmon_deliver(ctx, watch, DMON_ACTION_OVERFLOW, ev, NULL);
+        }
+        else if (ev->mask & IN_CREATE) {
+            if (ev->mask & IN_ISDIR) {
+                if ((watch->watch_flags & DMON_WATCHFLAGS_RECURSIVE) && !watch->fanotify) {
+                    char watchdir[DMON_MAX_PATH];
+                    _dmon_strcpy(watchdir, sizeof(watchdir), watch->rootdir);
+                    _dmon_strcat(watchdir, sizeof(watchdir), _dmon_event_path(ctx, ev));
+                    _dmon_strcat(watchdir, sizeof(watchdir), "/");
+                    bool watched = true;
+                    if (!watch->poll) {
+                        // the directory can be already deleted or moved, or there are no inotify watches left
+                        uint32_t mask = _dmon_inotify_mask(watch->actions, false);
+                        int wd = inotify_add_watch(ctx->inotify_fd, watchdir, mask | IN_MASK_ADD);
+                        watched = wd != -1;
+                        if (watched) {
+                            _dmon_add_subdir(ctx, watch, watchdir, wd);
+                        } else {
+                            _DMON_LOG_DEBUGF("Directory '%s' is not watched (inotify_add_watch:err=%d)", watchdir, errno);
+                            _DMON_STAT_ADD(ctx, watch, dirs_skipped, 1);
+                        }
+                    }
+
+                    // some directories may be already created, for instance, with the command: mkdir -p
+                    // so we will enumerate them manually and add them to the events
+                    if (watched) {
+                        _dmon_gather_recursive(ctx, watch, watchdir);
+                        ev = &ctx->events[i]; // gotta refresh the pointer because it may be relocated
+                    }
+                }
+            }
+            _dmon_deliver(ctx, watch, DMON_ACTION_CREATE, ev, NULL);
+        }
+        else if (ev->mask & IN_MODIFY) {
+            _dmon_deliver(ctx, watch, DMON_ACTION_MODIFY, ev, NULL);
+        }
+        else if (ev->mask & IN_CLOSE_WRITE) {
+            _dmon_deliver(ctx, watch, DMON_ACTION_CLOSE_WRITE, ev, NULL);
+        }
+        else if (ev->mask & IN_ATTRIB) {
+            _dmon_deliver(ctx, watch, DMON_ACTION_ATTRIB, ev, NULL);
+        }
+        else if (ev->mask & IN_DELETE_SELF) {
+            _dmon_deliver(ctx, watch, DMON_ACTION_ROOT_DELETE, ev, NULL);
+        }
+        else if (ev->mask & IN_MOVE_SELF) {
+            _dmon_deliver(ctx, watch, DMON_ACTION_ROOT_MOVE, ev, NULL);
+        }
+        else if (ev->mask & IN_MOVED_FROM) {
+            int move_to = _dmon_find_move(ctx, &ctx->moved_to_tbl, ev);
+            if (move_to > i && (ctx->events[move_to].mask & IN_MOVED_TO)) {
+                _DMON_STAT_ADD(ctx, watch, merged_move, 1);
+                _dmon_deliver(ctx, watch, DMON_ACTION_MOVE, &ctx->events[move_to], ev);
+            }
+        }
+        else if (ev->mask & IN_DELETE) {
+            // the inotify watches of a deleted directory are removed by the kernel (IN_IGNORED), but the ones
+            // of a directory that is moved out of the watch are still alive
+            if (ev->mask & IN_ISDIR) {
+                _dmon_remove_subdirs(ctx, watch, _dmon_event_path(ctx, ev));
+            }
+            _dmon_deliver(ctx, watch, DMON_ACTION_DELETE, ev, NULL);
+        }
+    }
+
+    // the paths are kept for the batch callbacks, which are called after the flush is over, so they can queue
+    // new events too
+    bool batches = stb_sb_count(ctx->batch) > 0;
+    if (batches) {
+        char* paths = ctx->batch_paths;
+        ctx->batch_paths = ctx->event_paths;
+        ctx->event_paths = paths;
+    }
+
+    stb_sb_reset(ctx->events);
+    stb_sb_reset(ctx->event_paths);
+    stb_sb_reset(ctx->pathkeys);
+    stb_sb_reset(ctx->movekeys);
+    _dmon_hashtbl_clear(&ctx->path_tbl);
+    _dmon_hashtbl_clear(&ctx->moved_from_tbl);
+    _dmon_hashtbl_clear(&ctx->moved_to_tbl);
+
+    if (stb_sb_count(ctx->cb_staged) > 0) {
+        _dmon_dispatch_flush(ctx);
+    }
+
+    // consumers are woken up once for the whole flush
+    if (ctx->queue.pushed) {
+        ctx->queue.pushed = false;
+        _dmon_queue_signal(ctx);
+    }
+
+    if (batches) {
+        _dmon_deliver_batches(ctx);
+    }
+}
+
+// adaptive watches get the shortest window when they were idle for the longest window, so single events are
+// delivered quickly, and the window is doubled while the events keep coming, so bursts are gathered together
+_DMON_PRIVATE void _dmon_update_window(dmon__watch_state* watch, uint64_t now)
+{
+    if (watch->window_min == watch->window_max) {
+        watch->window = watch->window_min;
+    } else if (now - watch->last_flush < watch->window_max) {
+        watch->window = _dmon_min(_dmon_max(watch->window * 2, _DMON_WINDOW_STEP_NSECS), watch->window_max);
+    } else {
+        watch->window = watch->window_min;
+    }
+}
+
+// starts the deadlines of the watches with the first event that is gathered for them
+_DMON_PRIVATE void _dmon_schedule_events(dmon__state* ctx, uint64_t now)
+{
+    int i, count = stb_sb_count(ctx->events);
+    uint32_t last_id = 0;
+    for (i = ctx->num_scheduled; i < count; i++) {
+        dmon_watch_id id = ctx->events[i].watch_id;
+        if (id.id == last_id) {
+            continue;
+        }
+        last_id = id.id;
+
+        dmon__watch_state* watch = _dmon_get_watch(ctx, id);
+        if (watch && watch->deadline == 0) {
+            // polls have found the changes by now, so they are delivered right away
+            _dmon_update_window(watch, now);
+            watch->deadline = now + (watch->poll ? 0 : watch->window);
+            stb_sb_push(ctx->pending, id);
+        }
+    }
+    ctx->num_scheduled = count;
+    _dmon_stat_max(&ctx->stats.peak_events, (uint64_t)count);
+}
+
+// takes the events of the watches that are not due out of the batch
+_DMON_PRIVATE void _dmon_defer_events(dmon__state* ctx)
+{
+    int i, count = stb_sb_count(ctx->events), num_due = 0;
+    dmon__watch_state* watch = NULL;
+    uint32_t last_id = 0;
+    for (i = 0; i < count; i++) {
+        dmon__inotify_event ev = ctx->events[i];
+        if (ev.watch_id.id != last_id) {
+            last_id = ev.watch_id.id;
+            watch = _dmon_get_watch(ctx, ev.watch_id);
+        }
+        if (watch && watch->deadline != 0) {
+            const char* path = _dmon_event_path(ctx, &ev);
+            ev.path = (uint32_t)stb_sb_count(ctx->deferred_paths);
+            memcpy(stb_sb_add(ctx->deferred_paths, ev.len + 1), path, ev.len + 1);
+            stb_sb_push(ctx->deferred, ev);
+        } else {
+            ctx->events[num_due++] = ev;
+        }
+    }
+    stb__sbn(ctx->events) = num_due;
+}
+
+_DMON_PRIVATE void _dmon_restore_deferred(dmon__state* ctx)
+{
+    int i, count = stb_sb_count(ctx->deferred);
+    uint32_t base = (uint32_t)stb_sb_count(ctx->event_paths);
+    for (i = 0; i < count; i++) {
+        ctx->deferred[i].path += base;
+    }
+    if (stb_sb_count(ctx->deferred_paths) > 0) {
+        memcpy(stb_sb_add(ctx->event_paths, stb_sb_count(ctx->deferred_paths)), ctx->deferred_paths,
+               stb_sb_count(ctx->deferred_paths));
+    }
+    if (count > 0) {
+        memcpy(stb_sb_add(ctx->events, count), ctx->deferred, sizeof(dmon__inotify_event) * count);
+    }
+    stb_sb_reset(ctx->deferred);
+    stb_sb_reset(ctx->deferred_paths);
+}
+
+// processes the events of the watches that are due, or all of them. the others wait for their deadlines
+_DMON_PRIVATE void _dmon_flush(dmon__state* ctx, uint64_t now, bool all)
+{
+    int i, num_pending = 0;
+    bool due = false;
+    for (i = 0; i < stb_sb_count(ctx->pending); i++) {
+        dmon__watch_state* watch = _dmon_get_watch(ctx, ctx->pending[i]);
+        if (watch == NULL) {
+            due = true;     // events of removed watches are dropped
+        } else if (all || watch->deadline <= now) {
+            watch->deadline = 0;
+            watch->last_flush = now;
+            __atomic_fetch_add(&watch->stats.flushes, 1, __ATOMIC_RELAXED);
+            due = true;
+        } else {
+            ctx->pending[num_pending++] = ctx->pending[i];
+        }
+    }
+    if (ctx->pending) {
+        stb__sbn(ctx->pending) = num_pending;
+    }
+
+    if ((due || all) && stb_sb_count(ctx->events) > 0) {
+        if (num_pending > 0) {
+            _dmon_defer_events(ctx);
+        }
+        __atomic_fetch_add(&ctx->stats.flushes, 1, __ATOMIC_RELAXED);
+        _dmon_inotify_process_events(ctx);
+        _dmon_restore_deferred(ctx);
+    }
+    ctx->num_scheduled = stb_sb_count(ctx->events);
+}
+
+// arms the timer for the earliest deadline
+_DMON_PRIVATE void _dmon_arm_timer(dmon__state* ctx)
+{
+    int i;
+    uint64_t deadline = 0;
+    for (i = 0; i < stb_sb_count(ctx->pending); i++) {
+        dmon__watch_state* watch = _dmon_get_watch(ctx, ctx->pending[i]);
+        if (watch && (deadline == 0 || watch->deadline < deadline)) {
+            deadline = watch->deadline;
+        }
+    }
+    if (deadline == ctx->timer_deadline) {
+        return;
+    }
+
+    // zero disarms the timer
+    struct itimerspec its;
+    memset(&its, 0x0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(deadline / 1000000000ull);
+    its.it_value.tv_nsec = (long)(deadline % 1000000000ull);
+    timerfd_settime(ctx->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    ctx->timer_deadline = deadline;
+}
+
+// reads pending events of all the watches at once and routes them to the watches that own the directory
+_DMON_PRIVATE void _dmon_read_events(dmon__state* ctx, uint8_t* buff, size_t buff_size)
+{
+    ssize_t offset = 0;
+    ssize_t len = read(ctx->inotify_fd, buff, buff_size);
+    if (len <= 0) {
+        return;
+    }
+
+    __atomic_fetch_add(&ctx->stats.bytes_read, (uint64_t)len, __ATOMIC_RELAXED);
+
+    // events are only lost after the queue is full, which is after the previous read
+    struct timespec prev_read_time = ctx->read_time;
+    _dmon_clock_coarse(&ctx->read_time);
+
+    while (offset < len) {
+        struct inotify_event* iev = (struct inotify_event*)&buff[offset];
+        const char* name = iev->len > 0 ? iev->name : "";
+        __atomic_fetch_add(&ctx->stats.events_read, 1, __ATOMIC_RELAXED);
+
+        if (iev->mask & IN_Q_OVERFLOW) {
+            if (!ctx->overflow) {
+                ctx->overflow = true;
+                ctx->overflow_since = prev_read_time;
+            }
+        }
+
+        if (iev->mask & IN_IGNORED) {
+            _dmon_forget_wd(ctx, iev->wd);
+            offset += sizeof(struct inotify_event) + iev->len;
+            continue;
+        }
+
+        int r;
+        for (r = _dmon_hashtbl_find(&ctx->wd_tbl, (uint32_t)iev->wd); r != -1; r = ctx->wd_refs[r].next) {
+            const dmon__wd_ref* ref = &ctx->wd_refs[r];
+            dmon__watch_state* watch = ctx->watches[ref->watch];
+            char reldir[DMON_MAX_PATH];
+            __atomic_fetch_add(&watch->stats.events_read, 1, __ATOMIC_RELAXED);
+            if (!_dmon_subdir_path(watch, ref->subdir, reldir, sizeof(reldir))) {
+                continue;
+            }
+            bool ignored = _dmon_ignored(watch->ignore, reldir, name, (iev->mask & IN_ISDIR) != 0);
+            if ((iev->mask & IN_ISDIR) && (iev->mask & (IN_MOVED_FROM | IN_MOVED_TO))) {
+                _dmon_track_dir_move(ctx, watch, iev, reldir, name, ignored);
+                _dmon_subdir_path(watch, ref->subdir, reldir, sizeof(reldir));
+            }
+            if (_dmon_watch_accepts(watch, iev->mask, reldir[0] == '\0') && !ignored) {
+                _dmon_push_event(ctx, watch->id, iev->mask, iev->cookie, reldir, name);
+            }
+        }
+
+        offset += sizeof(struct inotify_event) + iev->len;
+    }
+}
+
+// reads the watched directories again after a queue overflow and reports the difference with the snapshot
+// new entries are CREATE (new directories are added to the watch on delivery), missing entries are DELETE and
+// files that are changed are MODIFY. files are compared by size and mtime if the snapshot has them, otherwise
+// the ones that are modified after the overflow are reported. without DMON_WATCHFLAGS_SNAPSHOT only the
+// directories are known, so only the created and deleted directories are reported
+_DMON_PRIVATE void _dmon_rescan_watch(dmon__state* ctx, dmon__watch_state* watch)
+{
+    dmon__snapshot* old_snap = &watch->snapshot;
+    dmon__snapshot snap;
+    _dmon_snapshot_init(&snap);
+    bool full = (watch->watch_flags & DMON_WATCHFLAGS_SNAPSHOT) != 0;
+
+    _dmon_push_event(ctx, watch->id, IN_Q_OVERFLOW, 0, "", "");
+
+    dmon__snapshot_stat dir_st;
+    memset(&dir_st, 0x0, sizeof(dir_st));
+    dir_st.type = DT_DIR;
+
+    char dirname[DMON_MAX_PATH];
+    char reldir[DMON_MAX_PATH];
+    uint64_t buff[512];     // aligned for the records
+    int i;
+    for (i = stb_sb_count(watch->subdirs) - 1; i >= 0; i--) {
+        if (watch->subdirs[i].wd < 0 || !_dmon_subdir_path(watch, i, reldir, sizeof(reldir))) {
+            continue;
+        }
+        if (reldir[0] == '/') {
+            continue;   // resolved from a symlink, out of the root
+        }
+
+        _dmon_strcpy(dirname, sizeof(dirname), watch->rootdir);
+        _dmon_strcat(dirname, sizeof(dirname), reldir);
+        int fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            if (reldir[0] != '\0') {
+                _dmon_remove_subdir(ctx, watch, i);
+            }
+            continue;
+        }
+
+        int old_dir = _dmon_snapshot_lookup(old_snap, reldir);
+        int dir = _dmon_snapshot_lookup(&snap, reldir);
+        if (dir == -1) {
+            dir = _dmon_snapshot_add_path(&snap, reldir, &dir_st);
+        }
+
+        int len;
+        while ((len = _dmon_getdents(fd, (char*)buff, sizeof(buff))) > 0) {
+            int offset;
+            for (offset = 0; offset < len; offset += ((dmon__dirent*)((char*)buff + offset))->d_reclen) {
+                const dmon__dirent* entry = (const dmon__dirent*)((char*)buff + offset);
+                if (_dmon_dirent_isdots(entry)) {
+                    continue;
+                }
+
+                int name_len = (int)strlen(entry->d_name);
+                unsigned char type = _dmon_dirent_type(fd, entry);
+                if ((!full && type != DT_DIR) || _dmon_ignored(watch->ignore, reldir, entry->d_name, type == DT_DIR)) {
+                    continue;
+                }
+                dmon__snapshot_stat st;
+                _dmon_snapshot_stat_dirent(fd, entry, type, full, &st);
+                _dmon_snapshot_add(&snap, dir, entry->d_name, name_len, &st);
+
+                int old = old_dir != -1 ? _dmon_snapshot_child(old_snap, old_dir, entry->d_name, name_len) : -1;
+                if (old == -1) {
+                    _dmon_push_event(ctx, watch->id, IN_CREATE | (type == DT_DIR ? IN_ISDIR : 0U), 0, reldir, entry->d_name);
+                    continue;
+                }
+                if (type == DT_DIR) {
+                    continue;
+                }
+
+                const dmon__snapshot_stat* old_st = &old_snap->nodes[old].st;
+                struct stat s;
+                bool modified;
+                if (st.has_stat && old_st->has_stat) {
+                    modified = st.size != old_st->size || st.mtime != old_st->mtime || st.inode != old_st->inode;
+                } else {
+                    modified = fstatat(fd, entry->d_name, &s, AT_SYMLINK_NOFOLLOW) == 0 &&
+                               !_dmon_timespec_less(&s.st_mtim, &ctx->overflow_since);
+                }
+                if (modified) {
+                    _dmon_push_event(ctx, watch->id, IN_MODIFY, 0, reldir, entry->d_name);
+                }
+            }
+        }
+        close(fd);
+
+        // entries under a deleted directory are covered by the directory's event
+        if (old_dir != -1) {
+            int n;
+            for (n = old_snap->nodes[old_dir].first_child; n != -1; n = old_snap->nodes[n].next_sibling) {
+                const dmon__snapshot_node* node = &old_snap->nodes[n];
+                const char* name = old_snap->names + node->name;
+                if (_dmon_snapshot_child(&snap, dir, name, (int)strlen(name)) == -1) {
+                    _dmon_push_event(ctx, watch->id, IN_DELETE | (node->st.type == DT_DIR ? IN_ISDIR : 0U), 0, reldir, name);
+                }
+            }
+        }
+    }
+
+    _dmon_snapshot_free(old_snap);
+    *old_snap = snap;
+}
+
+_DMON_PRIVATE void _dmon_rescan(dmon__state* ctx)
+{
+    int i;
+    for (i = 0; i < stb_sb_count(ctx->watches); i++) {
+        dmon__watch_state* watch = ctx->watches[i];
+        if (watch && !watch->fanotify && !watch->poll) {
+            _dmon_rescan_watch(ctx, watch);
+        }
+    }
+}
+
+_DMON_PRIVATE void _dmon_arm_poll(dmon__state* ctx, bool arm)
+{
+    struct itimerspec its;
+    memset(&its, 0x0, sizeof(its));
+    if (arm) {
+        its.it_value.tv_sec = DMON_POLL_INTERVAL / 1000;
+        its.it_value.tv_nsec = (DMON_POLL_INTERVAL % 1000) * 1000000;
+        its.it_interval = its.it_value;
+    }
+    timerfd_settime(ctx->poll_fd, 0, &its, NULL);
+    ctx->poll_armed = arm;
+}
+
+_DMON_PRIVATE int64_t _dmon_poll_now(void)
+{
+    struct timespec now;
+    _dmon_clock_coarse(&now);
+    return (int64_t)now.tv_sec * 1000000000 + (int64_t)now.tv_nsec;
+}
+
+// fills the snapshot of a new poll watch, directories are read breadth-first from the snapshot itself
+_DMON_PRIVATE void _dmon_poll_begin(dmon__state* ctx, dmon__watch_state* watch, const struct stat* root_st)
+{
+    dmon__snapshot* snap = &watch->snapshot;
+    watch->poll = true;
+    _dmon_snapshot_from_stat(root_st, &snap->nodes[0].st);
+
+    int64_t now = _dmon_poll_now();
+    char reldir[DMON_MAX_PATH];
+    int* dirs = NULL;
+    int i, c;
+    stb_sb_push(dirs, 0);
+    for (i = 0; i < stb_sb_count(dirs); i++) {
+        int dir = dirs[i];
+        if (!_dmon_snapshot_path(snap, dir, reldir, sizeof(reldir) - 1)) {
+            continue;
+        }
+        if (dir > 0) {
+            _dmon_strcat(reldir, sizeof(reldir), "/");
+        }
+        _dmon_snapshot_read_dir(watch, reldir);
+
+        // the stat of the directory is taken before reading it. entries that are created right after that
+        // may not change the mtime, so the directory is read again on the first poll
+        if (snap->nodes[dir].st.mtime + _DMON_RACY_NSECS >= now) {
+            snap->nodes[dir].st.has_stat = false;
+        }
+
+        if (watch->watch_flags & DMON_WATCHFLAGS_RECURSIVE) {
+            for (c = snap->nodes[dir].first_child; c != -1; c = snap->nodes[c].next_sibling) {
+                if (snap->nodes[c].st.type == DT_DIR) {
+                    stb_sb_push(dirs, c);
+                }
+            }
+        }
+    }
+    stb_sb_free(dirs);
+
+    if (!ctx->poll_armed) {
+        _dmon_arm_poll(ctx, true);
+    }
+}
+
+_DMON_PRIVATE bool _dmon_poll_changed(const dmon__snapshot_stat* old, const dmon__snapshot_stat* st)
+{
+    return old->has_stat && st->has_stat &&
+           (old->inode != st->inode || old->size != st->size || old->mtime != st->mtime);
+}
+
+// reads the directory of the poll watch again and packs the events of the entries that are created, deleted or
+// changed since the snapshot. the snapshot itself is updated by the events on delivery
+_DMON_PRIVATE void _dmon_poll_read_dir(dmon__watch_state* watch, int dir, const char* reldir, int fd,
+                                       char** events, dmon__hashtbl* seen, int* budget)
+{
+    const dmon__snapshot* snap = &watch->snapshot;
+    _dmon_hashtbl_clear(seen);
+
+    uint64_t buff[512];     // aligned for the records
+    int len;
+    while ((len = _dmon_getdents(fd, (char*)buff, sizeof(buff))) > 0) {
+        int offset;
+        for (offset = 0; offset < len; offset += ((dmon__dirent*)((char*)buff + offset))->d_reclen) {
+            const dmon__dirent* entry = (const dmon__dirent*)((char*)buff + offset);
+            if (_dmon_dirent_isdots(entry)) {
+                continue;
+            }
+
+            unsigned char type = _dmon_dirent_type(fd, entry);
+            if (_dmon_ignored(watch->ignore, reldir, entry->d_name, type == DT_DIR)) {
+                continue;
+            }
+            dmon__snapshot_stat st;
+            _dmon_snapshot_stat_dirent(fd, entry, type, true, &st);
+            --*budget;
+
+            uint32_t dirmask = type == DT_DIR ? IN_ISDIR : 0;
+            int old = _dmon_snapshot_child(snap, dir, entry->d_name, (int)strlen(entry->d_name));
+            if (old != -1) {
+                const dmon__snapshot_stat* old_st = &snap->nodes[old].st;
+                _dmon_hashtbl_insert(seen, (uint32_t)old, old);
+                if ((old_st->type == DT_DIR ? IN_ISDIR : 0U) == dirmask) {
+                    if (!dirmask && _dmon_poll_changed(old_st, &st)) {
+                        _dmon_pack_event(events, IN_MODIFY, 0, -1, reldir, entry->d_name);
+                    }
+                    continue;
+                }
+                _dmon_pack_event(events, IN_DELETE | (old_st->type == DT_DIR ? IN_ISDIR : 0U), old_st->inode,
+                                 old_st->has_stat ? old_st->mtime : -1, reldir, entry->d_name);
+            }
+            _dmon_pack_event(events, IN_CREATE | dirmask, st.inode, st.has_stat ? st.mtime : -1, reldir, entry->d_name);
+        }
+    }
+
+    int n;
+    for (n = snap->nodes[dir].first_child; n != -1; n = snap->nodes[n].next_sibling) {
+        if (_dmon_hashtbl_find(seen, (uint32_t)n) == -1) {
+            const dmon__snapshot_node* node = &snap->nodes[n];
+            _dmon_pack_event(events, IN_DELETE | (node->st.type == DT_DIR ? IN_ISDIR : 0U), node->st.inode,
+                             node->st.has_stat ? node->st.mtime : -1, reldir, snap->names + node->name);
+        }
+    }
+}
+
+// checks the poll watch against the disk, with a limited number of stats. every directory that is watched is
+// stat'ed and only the ones with a different mtime are read again. then the files are stat'ed for modifications,
+// starting from where the previous poll is stopped
+_DMON_PRIVATE void _dmon_poll_watch(dmon__watch_state* watch, char** events, dmon__hashtbl* seen)
+{
+    dmon__snapshot* snap = &watch->snapshot;
+    bool recursive = (watch->watch_flags & DMON_WATCHFLAGS_RECURSIVE) != 0;
+    int64_t now = _dmon_poll_now();
+    int budget = DMON_POLL_BUDGET;
+    int count = stb_sb_count(snap->nodes);
+    char path[DMON_MAX_PATH];
+    char fullpath[DMON_MAX_PATH];
+    struct stat s;
+    dmon__snapshot_stat st;
+    int k;
+
+    for (k = 0; k < count && budget > 0; k++) {
+        int n = (watch->poll_dir + k) % count;
+        const dmon__snapshot_node* node = &snap->nodes[n];
+        if (n > 0 && (!recursive || node->parent == -1 || node->st.type != DT_DIR)) {
+            continue;
+        }
+        if (!_dmon_snapshot_path(snap, n, path, sizeof(path) - 1)) {
+            continue;
+        }
+        if (n > 0) {
+            _dmon_strcat(path, sizeof(path), "/");
+        }
+        _dmon_strcpy(fullpath, sizeof(fullpath), watch->rootdir);
+        _dmon_strcat(fullpath, sizeof(fullpath), path);
+
+        --budget;
+        if (stat(fullpath, &s) != 0 || !S_ISDIR(s.st_mode)) {
+            continue;   // removed, it's reported by the parent
+        }
+        _dmon_snapshot_from_stat(&s, &st);
+        if (node->st.has_stat && node->st.inode == st.inode && node->st.mtime == st.mtime) {
+            continue;
+        }
+
+        int fd = open(fullpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        _dmon_poll_read_dir(watch, n, path, fd, events, seen, &budget);
+        close(fd);
+
+        // entries that are created right after reading may not change the mtime, read it again on the next poll
+        st.has_stat = st.mtime + _DMON_RACY_NSECS < now;
+        snap->nodes[n].st = st;
+    }
+    watch->poll_dir = count > 0 ? (watch->poll_dir + k) % count : 0;
+
+    budget = _dmon_max(budget, DMON_POLL_BUDGET / 4);
+    for (k = 0; k < count && budget > 0; k++) {
+        int n = (watch->poll_file + k) % count;
+        const dmon__snapshot_node* node = &snap->nodes[n];
+        if (n == 0 || node->parent == -1 || node->st.type == DT_DIR) {
+            continue;
+        }
+        if (!_dmon_snapshot_path(snap, n, path, sizeof(path))) {
+            continue;
+        }
+        _dmon_strcpy(fullpath, sizeof(fullpath), watch->rootdir);
+        _dmon_strcat(fullpath, sizeof(fullpath), path);
+
+        --budget;
+        if (lstat(fullpath, &s) != 0 || S_ISDIR(s.st_mode)) {
+            continue;   // removed or replaced, it's reported by the directory
+        }
+        _dmon_snapshot_from_stat(&s, &st);
+        if (_dmon_poll_changed(&node->st, &st)) {
+            _dmon_pack_event(events, IN_MODIFY, 0, -1, "", path);
+        }
+    }
+    watch->poll_file = count > 0 ? (watch->poll_file + k) % count : 0;
+}
+
+// checks all the poll watches, called every DMON_POLL_INTERVAL. the timer is stopped when there are no poll
+// watches anymore
+_DMON_PRIVATE void _dmon_poll(dmon__state* ctx)
+{
+    char* events = NULL;
+    dmon__found_event* found = NULL;
+    dmon__hashtbl seen;
+    memset(&seen, 0x0, sizeof(seen));
+
+    bool any = false;
+    int i;
+    for (i = 0; i < stb_sb_count(ctx->watches); i++) {
+        dmon__watch_state* watch = ctx->watches[i];
+        if (watch && watch->poll) {
+            any = true;
+            stb_sb_reset(events);
+            stb_sb_reset(found);
+            _dmon_poll_watch(watch, &events, &seen);
+            _dmon_unpack_events(events, &found);
+            _dmon_push_found_events(ctx, watch->id, found, true);
+        }
+    }
+    if (!any) {
+        _dmon_arm_poll(ctx, false);
+    }
+
+    stb_sb_free(events);
+    stb_sb_free(found);
+    _dmon_hashtbl_free(&seen);
+}
+
+// blocks until any of the descriptors are ready, and returns their tags
+_DMON_PRIVATE int _dmon_wait(dmon__state* ctx, uint64_t* tags, int max_tags)
+{
+#if __FreeBSD__
+    static const uint64_t fd_tags[] = { _DMON_TAG_WAKE, _DMON_TAG_TIMER, _DMON_TAG_INOTIFY, _DMON_TAG_POLL };
+    struct pollfd fds[4];
+    int i, n;
+
+    fds[0].fd = ctx->wake_fd;
+    fds[1].fd = ctx->timer_fd;
+    fds[2].fd = ctx->inotify_fd;
+    fds[3].fd = ctx->poll_fd;
+    for (i = 0; i < 4; i++) {
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+
+    n = poll(fds, 4, -1);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = 0;
+    for (i = 0; i < 4 && n < max_tags; i++) {
+        if (fds[i].revents & POLLIN) {
+            tags[n++] = fd_tags[i];
+        }
+    }
+    return n;
+#else
+    struct epoll_event evs[64];
+    int i, n = epoll_wait(ctx->epoll_fd, evs, _dmon_min(max_tags, 64), -1);
+    for (i = 0; i < n; i++) {
+        tags[i] = evs[i].data.u64;
+    }
+    return n;
+#endif
+}
+
+_DMON_PRIVATE void _dmon_watch_fd(dmon__state* ctx, int fd, uint64_t tag)
+{
+#if __FreeBSD__
+    // the descriptors are fixed, see _dmon_wait
+    _DMON_UNUSED(ctx);
+    _DMON_UNUSED(fd);
+    _DMON_UNUSED(tag);
+#else
+    struct epoll_event ev;
+    memset(&ev, 0x0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = tag;
+    int r = epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    _DMON_UNUSED(r);
+    DMON_ASSERT(r == 0);
+#endif
+}
+
+#if _DMON_FANOTIFY
+// creates the fanotify instance with the first fanotify watch, returns false if it's not supported
+_DMON_PRIVATE bool _dmon_fanotify_init(dmon__state* ctx)
+{
+    if (ctx->fanotify_fd != -1) {
+        return true;
+    }
+
+    ctx->fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY);
+    if (ctx->fanotify_fd == -1) {
+        return false;
+    }
+    _dmon_watch_fd(ctx, ctx->fanotify_fd, _DMON_TAG_FANOTIFY);
+    return true;
+}
+
+_DMON_PRIVATE bool _dmon_fanotify_mark(dmon__state* ctx, int flags, const char* path)
+{
+    uint64_t mask = _DMON_FANOTIFY_MASK;
+#ifdef FAN_RENAME
+    // moves are reported as a single event on linux 5.17+, so they can be paired
+    if (fanotify_mark(ctx->fanotify_fd, flags, mask | FAN_RENAME, AT_FDCWD, path) == 0) {
+        return true;
+    }
+#endif
+    return fanotify_mark(ctx->fanotify_fd, flags, mask | FAN_MOVED_FROM | FAN_MOVED_TO, AT_FDCWD, path) == 0;
+}
+
+// watches the whole file system of the root directory, the events are filtered by their path
+// returns false if fanotify is not supported or not permitted, the watch uses inotify then
+_DMON_PRIVATE bool _dmon_fanotify_watch(dmon__state* ctx, dmon__watch_state* watch)
+{
+    char rootdir[PATH_MAX];
+    struct statfs st;
+    struct stat root_st;
+    if (!_dmon_fanotify_init(ctx) || realpath(watch->rootdir, rootdir) == NULL || statfs(rootdir, &st) != 0 ||
+        stat(rootdir, &root_st) != 0) {
+        return false;
+    }
+
+    // the events are matched to their file system by the fsid, it can't be told apart if it's zero
+    fsid_t zero_fsid;
+    memset(&zero_fsid, 0x0, sizeof(zero_fsid));
+    if (memcmp(&st.f_fsid, &zero_fsid, sizeof(zero_fsid)) == 0) {
+        _DMON_LOG_DEBUGF("'%s' has no fsid, falling back to inotify", watch->rootdir);
+        return false;
+    }
+
+    int i, mark = -1;
+    for (i = 0; i < stb_sb_count(ctx->fan_marks); i++) {
+        if (ctx->fan_marks[i].refs > 0 && memcmp(&ctx->fan_marks[i].fsid, &st.f_fsid, sizeof(st.f_fsid)) == 0 &&
+            ctx->fan_marks[i].dev == root_st.st_dev) {
+            mark = i;
+            break;
+        }
+    }
+
+    if (mark == -1) {
+        int mount_fd = open(rootdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (mount_fd == -1) {
+            return false;
+        }
+        if (!_dmon_fanotify_mark(ctx, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, rootdir)) {
+            _DMON_LOG_DEBUGF("fanotify_mark failed for '%s' (err=%d), falling back to inotify", watch->rootdir, errno);
+            close(mount_fd);
+            return false;
+        }
+
+        for (mark = 0; mark < stb_sb_count(ctx->fan_marks) && ctx->fan_marks[mark].refs > 0; mark++) {}
+        dmon__fan_mark* m = mark < stb_sb_count(ctx->fan_marks) ? &ctx->fan_marks[mark] : stb_sb_add(ctx->fan_marks, 1);
+        memcpy(&m->fsid, &st.f_fsid, sizeof(m->fsid));
+        m->dev = root_st.st_dev;
+        m->mount_fd = mount_fd;
+        m->refs = m->close_write_refs = m->attrib_refs = 0;
+        _dmon_strcpy(m->path, sizeof(m->path), rootdir);
+    }
+    dmon__fan_mark* m = &ctx->fan_marks[mark];
+    ++m->refs;
+
+    // the mark is shared, the optional events are added while there are watches that want them, and dropped for the
+    // others. they are removed from the mark with the last watch that wants them
+    uint64_t optional = _dmon_inotify_mask(watch->actions, false) & (FAN_CLOSE_WRITE | FAN_ATTRIB);
+    uint64_t added = 0;
+    if ((optional & FAN_CLOSE_WRITE) && m->close_write_refs++ == 0) {
+        added |= FAN_CLOSE_WRITE;
+    }
+    if ((optional & FAN_ATTRIB) && m->attrib_refs++ == 0) {
+        added |= FAN_ATTRIB;
+    }
+    if (added) {
+        fanotify_mark(ctx->fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, added | FAN_ONDIR, AT_FDCWD, m->path);
     }
 
-    int num_freelist = DMON_MAX_WATCHES - _dmon.num_watches;
-    int index = _dmon.freelist[num_freelist - 1];
-    uint32_t id = (uint32_t)(index + 1);
+    dmon__fan_watch* fw = stb_sb_add(ctx->fan_watches, 1);
+    fw->id = watch->id;
+    fw->mark = mark;
+    fw->optional = optional;
+    _dmon_strcpy(fw->rootdir, sizeof(fw->rootdir) - 1, rootdir);
+    fw->rootdir_len = (int)strlen(fw->rootdir);
+    if (fw->rootdir[fw->rootdir_len - 1] != '/') {
+        fw->rootdir[fw->rootdir_len++] = '/';
+        fw->rootdir[fw->rootdir_len] = '\0';
+    }
 
-    if (_dmon.watches[index] == NULL) {
-        dmon__watch_state* state =  (dmon__watch_state*)DMON_MALLOC(sizeof(dmon__watch_state));
-        DMON_ASSERT(state);
-        if (state == NULL) {
-            pthread_mutex_unlock(&_dmon.mutex);
-            return _dmon_make_id(0);
+    watch->fanotify = true;
+    return true;
+}
+
+_DMON_PRIVATE void _dmon_fanotify_unwatch(dmon__state* ctx, dmon__watch_state* watch)
+{
+    int i;
+    for (i = 0; i < stb_sb_count(ctx->fan_watches); i++) {
+        if (ctx->fan_watches[i].id.id == watch->id.id) {
+            break;
         }
-        memset(state, 0x0, sizeof(dmon__watch_state));
-        _dmon.watches[index] = state;
     }
+    DMON_ASSERT(i < stb_sb_count(ctx->fan_watches));
+    if (i == stb_sb_count(ctx->fan_watches)) {
+        return;
+    }
+
+    dmon__fan_mark* m = &ctx->fan_marks[ctx->fan_watches[i].mark];
+    uint64_t optional = ctx->fan_watches[i].optional;
+    uint64_t removed = 0;
+    if ((optional & FAN_CLOSE_WRITE) && --m->close_write_refs == 0) {
+        removed |= FAN_CLOSE_WRITE;
+    }
+    if ((optional & FAN_ATTRIB) && --m->attrib_refs == 0) {
+        removed |= FAN_ATTRIB;
+    }
+    // FAN_ONDIR is left alone, the events of the mark need it
+    if (removed) {
+        fanotify_mark(ctx->fanotify_fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, removed, AT_FDCWD, m->path);
+    }
+
+    if (--m->refs == 0) {
+        _dmon_fanotify_mark(ctx, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, m->path);
+        close(m->mount_fd);
+    }
+
+    ctx->fan_watches[i] = stb_sb_last(ctx->fan_watches);
+    stb_sb_pop(ctx->fan_watches);
+}
+
+// resolves the directory of the event to an absolute path with a trailing slash
+// the last resolved directory is cached, since events usually come in runs for the same directory
+_DMON_PRIVATE bool _dmon_fanotify_dirpath(dmon__state* ctx, int mark, const dmon__file_handle* handle, char* path, int path_size)
+{
+    int handle_size = (int)(sizeof(uint32_t) + sizeof(int) + handle->handle_bytes);
+    if (handle_size > (int)sizeof(ctx->fan_cache_handle)) {
+        return false;
+    }
+
+    if (ctx->fan_cache_mark != mark || memcmp(ctx->fan_cache_handle, handle, handle_size) != 0) {
+        ctx->fan_cache_mark = -1;
+        int fd = (int)syscall(SYS_open_by_handle_at, ctx->fan_marks[mark].mount_fd, handle, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;   // already deleted
+        }
+
+        char fdpath[32];
+        snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", fd);
+        ssize_t len = readlink(fdpath, ctx->fan_cache_path, sizeof(ctx->fan_cache_path) - 2);
+        close(fd);
+        if (len <= 0) {
+            return false;
+        }
+        if (ctx->fan_cache_path[len - 1] != '/') {
+            ctx->fan_cache_path[len++] = '/';
+        }
+        ctx->fan_cache_path[len] = '\0';
+
+        memcpy(ctx->fan_cache_handle, handle, handle_size);
+        ctx->fan_cache_mark = mark;
+    }
+
+    _dmon_strcpy(path, path_size, ctx->fan_cache_path);
+    return true;
+}
+
+// queues the event for all the watches that contain the directory
+_DMON_PRIVATE void _dmon_fanotify_push_event(dmon__state* ctx, const struct fanotify_event_info_fid* fid, uint32_t mask, uint32_t cookie)
+{
+    const dmon__file_handle* handle = (const dmon__file_handle*)fid->handle;
+    const char* name = (const char*)handle->f_handle + handle->handle_bytes;
+    if (strcmp(name, ".") == 0) {
+        return;     // the directory itself
+    }
+
+    char dirpath[PATH_MAX];
+    int mark = -1;
+    bool resolved = false;
+    int i;
+    for (i = 0; i < stb_sb_count(ctx->fan_watches); i++) {
+        const dmon__fan_watch* fw = &ctx->fan_watches[i];
+        if (memcmp(&ctx->fan_marks[fw->mark].fsid, &fid->fsid, sizeof(fid->fsid)) != 0) {
+            continue;
+        }
+        // marks of different file systems can have the same fsid, the handle only opens on it's own
+        if (mark != fw->mark) {
+            resolved = _dmon_fanotify_dirpath(ctx, fw->mark, handle, dirpath, sizeof(dirpath));
+            mark = fw->mark;
+        }
+
+        if (!resolved || strncmp(dirpath, fw->rootdir, fw->rootdir_len) != 0) {
+            continue;
+        }
+
+        const char* reldir = dirpath + fw->rootdir_len;
+        dmon__watch_state* watch = _dmon_get_watch(ctx, fw->id);
+        if (watch && (reldir[0] == '\0' || (watch->watch_flags & DMON_WATCHFLAGS_RECURSIVE))) {
+            __atomic_fetch_add(&watch->stats.events_read, 1, __ATOMIC_RELAXED);
+            if (_dmon_watch_accepts(watch, mask, false) &&
+                !_dmon_ignored_path(watch->ignore, reldir, name, (mask & IN_ISDIR) != 0)) {
+                _dmon_push_event(ctx, fw->id, mask, cookie, reldir, name);
+            }
+        }
+    }
+}
+
+_DMON_PRIVATE void _dmon_fanotify_read_events(dmon__state* ctx, uint8_t* buff, size_t buff_size)
+{
+    ssize_t len = read(ctx->fanotify_fd, buff, buff_size);
+    if (len <= 0) {
+        return;
+    }
+    __atomic_fetch_add(&ctx->stats.bytes_read, (uint64_t)len, __ATOMIC_RELAXED);
+
+    // directories may be renamed in the meantime
+    ctx->fan_cache_mark = -1;
+
+    const struct fanotify_event_metadata* meta = (const struct fanotify_event_metadata*)buff;
+    for (; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+        if (meta->vers != FANOTIFY_METADATA_VERSION) {
+            DMON_LOG_ERROR("Unsupported fanotify version");
+            return;
+        }
+        if (meta->fd >= 0) {
+            close(meta->fd);
+        }
+        __atomic_fetch_add(&ctx->stats.events_read, 1, __ATOMIC_RELAXED);
+
+        // fanotify watches have no snapshot to rescan, so only the overflow is reported
+        if (meta->mask & FAN_Q_OVERFLOW) {
+            int i;
+            for (i = 0; i < stb_sb_count(ctx->fan_watches); i++) {
+                _dmon_push_event(ctx, ctx->fan_watches[i].id, IN_Q_OVERFLOW, 0, "", "");
+            }
+            continue;
+        }
+
+        // FAN_* event bits are the same as IN_* bits, so the events go through the same coalescing
+        uint32_t mask = (uint32_t)meta->mask;
+        uint32_t dirmask = (mask & FAN_ONDIR) ? IN_ISDIR : 0;
+        const struct fanotify_event_info_fid* dfid = NULL;
+        const struct fanotify_event_info_fid* old_dfid = NULL;
+        const struct fanotify_event_info_fid* new_dfid = NULL;
+        uint32_t offset;
+        for (offset = meta->metadata_len; offset < meta->event_len;) {
+            const struct fanotify_event_info_header* hdr =
+                (const struct fanotify_event_info_header*)((const uint8_t*)meta + offset);
+            if (hdr->len == 0) {
+                break;
+            }
+            if (hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                dfid = (const struct fanotify_event_info_fid*)hdr;
+            }
+#ifdef FAN_RENAME
+            else if (hdr->info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME) {
+                old_dfid = (const struct fanotify_event_info_fid*)hdr;
+            } else if (hdr->info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME) {
+                new_dfid = (const struct fanotify_event_info_fid*)hdr;
+            }
+#endif
+            offset += hdr->len;
+        }
+
+        // events on the same file can be merged into one, so split them in the order they possibly happened
+        if (old_dfid && new_dfid) {
+            if (++ctx->fan_cookie == 0) {
+                ++ctx->fan_cookie;
+            }
+            _dmon_fanotify_push_event(ctx, old_dfid, IN_MOVED_FROM | dirmask, ctx->fan_cookie);
+            _dmon_fanotify_push_event(ctx, new_dfid, IN_MOVED_TO | dirmask, ctx->fan_cookie);
+        }
+        if (dfid) {
+            static const uint32_t order[] = { IN_CREATE, IN_MOVED_TO, IN_MODIFY, IN_CLOSE_WRITE, IN_ATTRIB,
+                                              IN_MOVED_FROM, IN_DELETE };
+            int i;
+            for (i = 0; i < (int)(sizeof(order) / sizeof(order[0])); i++) {
+                if (mask & order[i]) {
+                    _dmon_fanotify_push_event(ctx, dfid, order[i] | dirmask, 0);
+                }
+            }
+        }
+
+        // cached path of the directory, or it's children, is not valid anymore
+        if (dirmask && (mask & (IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | _DMON_FAN_RENAME))) {
+            ctx->fan_cache_mark = -1;
+        }
+    }
+}
+#endif // _DMON_FANOTIFY
+
+static void* _dmon_thread(void* arg)
+{
+    dmon__state* ctx = (dmon__state*)arg;
+
+    uint64_t tags[64];
+
+    while (__sync_bool_compare_and_swap(&ctx->quit, false, false)) {
+        // sleep in the kernel until there are new events, the flush timer is expired or we are woken up
+        int i, n = _dmon_wait(ctx, tags, 64);
+        if (n <= 0) {
+            DMON_ASSERT(n == 0 || errno == EINTR);
+            continue;
+        }
+
+        pthread_mutex_lock(&ctx->mutex);
+
+        for (i = 0; i < n; i++) {
+            if (tags[i] == _DMON_TAG_WAKE) {
+                _dmon_drain_fd(ctx->wake_fd);
+            } else if (tags[i] == _DMON_TAG_TIMER) {
+                _dmon_drain_fd(ctx->timer_fd);
+                ctx->timer_deadline = 0;
+            } else if (tags[i] == _DMON_TAG_INOTIFY) {
+                _dmon_read_events(ctx, (uint8_t*)ctx->read_buff, sizeof(ctx->read_buff));
+            } else if (tags[i] == _DMON_TAG_POLL) {
+                _dmon_drain_fd(ctx->poll_fd);
+                _dmon_poll(ctx);
+            }
+#if _DMON_FANOTIFY
+            else if (tags[i] == _DMON_TAG_FANOTIFY) {
+                _dmon_fanotify_read_events(ctx, (uint8_t*)ctx->read_buff, sizeof(ctx->read_buff));
+            }
+#endif
+        }
+
+        uint64_t now = _dmon_now_ns();
+
+        // the events that are read so far are delivered first, the rescan diffs against their result
+        if (ctx->overflow) {
+            ctx->overflow = false;
+            _dmon_flush(ctx, now, true);
+            _dmon_rescan(ctx);
+        }
+
+        _dmon_schedule_events(ctx, now);
+        _dmon_flush(ctx, now, false);
+        _dmon_arm_timer(ctx);
+
+        pthread_mutex_unlock(&ctx->mutex);
+    }
+    return 0x0;
+}
+
+_DMON_PRIVATE void _dmon_unwatch(dmon__state* ctx, dmon__watch_state* watch)
+{
+    if (watch->dispatch) {
+        _dmon_dispatch_remove(ctx, watch->dispatch);
+        watch->dispatch = NULL;
+    }
+
+#if _DMON_FANOTIFY
+    if (watch->fanotify) {
+        _dmon_fanotify_unwatch(ctx, watch);
+    }
+#endif
 
-    ++_dmon.num_watches;
+    _dmon_subdirs_free(ctx, watch);
+    _dmon_snapshot_free(&watch->snapshot);
+    _dmon_ignore_release(watch->ignore);
+}
 
-    dmon__watch_state* watch = _dmon.watches[index];
+// takes a free slot, or grows the watch table if there is none
+_DMON_PRIVATE dmon__watch_state* _dmon_alloc_watch(dmon__state* ctx)
+{
+    dmon__watch_state* watch = (dmon__watch_state*)DMON_MALLOC(sizeof(dmon__watch_state));
     DMON_ASSERT(watch);
-    watch->id = _dmon_make_id(id);
+    if (watch == NULL) {
+        DMON_LOG_ERROR("Out of memory");
+        return NULL;
+    }
+    memset(watch, 0x0, sizeof(dmon__watch_state));
+    watch->free_subdir = -1;
+    _dmon_snapshot_init(&watch->snapshot);
+
+    int index;
+    if (stb_sb_count(ctx->freelist) > 0) {
+        index = stb_sb_last(ctx->freelist);
+        stb_sb_pop(ctx->freelist);
+    } else {
+        index = stb_sb_count(ctx->watches);
+        if (index >= (int)_DMON_WATCH_INDEX_MASK) {
+            DMON_LOG_ERROR("Exceeding maximum number of watches");
+            DMON_FREE(watch);
+            return NULL;
+        }
+        stb_sb_push(ctx->watches, NULL);
+        stb_sb_push(ctx->generations, 0);
+    }
+
+    watch->id = _dmon_make_id((ctx->generations[index] << _DMON_WATCH_INDEX_BITS) | (uint32_t)(index + 1));
+    ctx->watches[index] = watch;
+    ++ctx->num_watches;
+    return watch;
+}
+
+_DMON_PRIVATE void _dmon_free_watch(dmon__state* ctx, dmon__watch_state* watch)
+{
+    int index = _dmon_watch_index(watch->id);
+    DMON_ASSERT(ctx->watches[index] == watch);
+
+    _dmon_unwatch(ctx, watch);
+    DMON_FREE(watch);
+
+    ctx->watches[index] = NULL;
+    ctx->generations[index] = (ctx->generations[index] + 1) & (UINT32_MAX >> _DMON_WATCH_INDEX_BITS);
+    stb_sb_push(ctx->freelist, index);
+    --ctx->num_watches;
+}
+
+_DMON_PRIVATE void _dmon_context_init(dmon__state* ctx)
+{
+    DMON_ASSERT(!ctx->initialized);
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&ctx->mutex, &attr);
+    pthread_cond_init(&ctx->registered_cond, NULL);
+
+    ctx->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    ctx->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ctx->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ctx->poll_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ctx->queue.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    DMON_ASSERT(ctx->inotify_fd != -1 && ctx->wake_fd != -1 && ctx->timer_fd != -1 && ctx->poll_fd != -1 &&
+                ctx->queue.event_fd != -1);
+#if _DMON_FANOTIFY
+    ctx->fanotify_fd = -1;
+    ctx->fan_cache_mark = -1;
+#endif
+    if (ctx->inotify_fd == -1) {
+        DMON_LOG_ERROR("could not create inotify instance");
+    }
+    ctx->wd_refs_free = -1;
+    ctx->crawl_threads = DMON_CRAWL_THREADS;
+    _dmon_clock_coarse(&ctx->read_time);
+#if !__FreeBSD__
+    ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    DMON_ASSERT(ctx->epoll_fd != -1);
+#endif
+    _dmon_watch_fd(ctx, ctx->wake_fd, _DMON_TAG_WAKE);
+    _dmon_watch_fd(ctx, ctx->timer_fd, _DMON_TAG_TIMER);
+    _dmon_watch_fd(ctx, ctx->inotify_fd, _DMON_TAG_INOTIFY);
+    _dmon_watch_fd(ctx, ctx->poll_fd, _DMON_TAG_POLL);
+
+    _dmon_start_callback_threads(ctx);
+
+    int r = pthread_create(&ctx->thread_handle, NULL, _dmon_thread, ctx);
+    _DMON_UNUSED(r);
+    DMON_ASSERT(r == 0 && "pthread_create failed");
+
+    ctx->initialized = true;
+}
+
+// the callbacks of the context are called by its monitor thread, or by its callback threads
+_DMON_PRIVATE bool _dmon_context_thread(dmon__state* ctx)
+{
+    return pthread_equal(ctx->thread_handle, pthread_self()) || _dmon_is_callback_thread(ctx);
+}
+
+_DMON_PRIVATE void _dmon_context_deinit(dmon__state* ctx)
+{
+    DMON_ASSERT(ctx->initialized);
+    _DMON_UNUSED(__sync_lock_test_and_set(&ctx->quit, true));
+
+    // background registrations stop at the next directory when they see the quit flag
+    pthread_mutex_lock(&ctx->mutex);
+    while (ctx->num_registering > 0) {
+        pthread_cond_wait(&ctx->registered_cond, &ctx->mutex);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+
+    _dmon_wake_thread(ctx);
+    pthread_join(ctx->thread_handle, NULL);
+    _dmon_stop_callback_threads(ctx);
+
+    {
+        int i;
+        for (i = 0; i < stb_sb_count(ctx->watches); i++) {
+            if (ctx->watches[i]) {
+                _dmon_unwatch(ctx, ctx->watches[i]);
+                DMON_FREE(ctx->watches[i]);
+            }
+        }
+    }
+    stb_sb_free(ctx->watches);
+    stb_sb_free(ctx->generations);
+    stb_sb_free(ctx->freelist);
+
+    close(ctx->inotify_fd);
+    close(ctx->wake_fd);
+    close(ctx->timer_fd);
+    close(ctx->poll_fd);
+    close(ctx->queue.event_fd);
+#if !__FreeBSD__
+    close(ctx->epoll_fd);
+#endif
+#if _DMON_FANOTIFY
+    if (ctx->fanotify_fd != -1) {
+        close(ctx->fanotify_fd);
+    }
+    stb_sb_free(ctx->fan_marks);
+    stb_sb_free(ctx->fan_watches);
+#endif
+    _dmon_hashtbl_free(&ctx->wd_tbl);
+    stb_sb_free(ctx->wd_refs);
+    stb_sb_free(ctx->dir_moves);
+    pthread_mutex_destroy(&ctx->mutex);
+    pthread_cond_destroy(&ctx->registered_cond);
+    pthread_mutex_destroy(&ctx->cb_mutex);
+    pthread_cond_destroy(&ctx->cb_cond);
+    pthread_cond_destroy(&ctx->cb_done_cond);
+    stb_sb_free(ctx->events);
+    stb_sb_free(ctx->event_paths);
+    stb_sb_free(ctx->pathkeys);
+    stb_sb_free(ctx->movekeys);
+    _dmon_hashtbl_free(&ctx->path_tbl);
+    _dmon_hashtbl_free(&ctx->moved_from_tbl);
+    _dmon_hashtbl_free(&ctx->moved_to_tbl);
+    stb_sb_free(ctx->batch);
+    stb_sb_free(ctx->batch_events);
+    stb_sb_free(ctx->batch_paths);
+    stb_sb_free(ctx->pending);
+    stb_sb_free(ctx->deferred);
+    stb_sb_free(ctx->deferred_paths);
+    DMON_FREE(ctx->queue.cells);
+    memset(ctx, 0x0, sizeof(*ctx));
+    ctx->initialized = false;
+}
+
+// creates the watch and adds the root directory, the caller must hold the lock
+// watches without watch_cb and batch_cb push their events to the queue
+// options can be NULL for the defaults
+_DMON_PRIVATE dmon__watch_state* _dmon_watch_begin(dmon__state* ctx, const char* rootdir,
+                                                   void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                    const char* dirname, const char* filename,
+                                                                    const char* oldname, void* user),
+                                                   _dmon_watch_batch_cb* batch_cb, uint32_t flags, void* user_data,
+                                                   const dmon_watch_options* options)
+{
+    DMON_ASSERT(ctx->initialized);
+    DMON_ASSERT(rootdir && rootdir[0]);
+
+    dmon__watch_state* watch = _dmon_alloc_watch(ctx);
+    if (watch == NULL) {
+        return NULL;
+    }
+
+    // polls compare the sizes and mtimes of the entries
+    if (flags & DMON_WATCHFLAGS_POLL) {
+        flags |= DMON_WATCHFLAGS_SNAPSHOT;
+    }
     watch->watch_flags = flags;
     watch->watch_cb = watch_cb;
+    watch->batch_cb = batch_cb;
+    watch->queued = watch_cb == NULL && batch_cb == NULL;
     watch->user_data = user_data;
+    watch->window_min = watch->window_max = watch->window = _DMON_FLUSH_DELAY_NSECS;
+    watch->ignore = options ? _dmon_ignore_compile(options->ignore) : NULL;
+    watch->actions = options && options->actions ? options->actions : DMON_ACTIONMASK_DEFAULT;
+    if (flags & DMON_WATCHFLAGS_CLOSE_WRITE) {
+        watch->actions &= ~DMON_ACTIONMASK(DMON_ACTION_MODIFY);
+        watch->actions |= DMON_ACTIONMASK(DMON_ACTION_CLOSE_WRITE);
+    }
+    if (watch->queued) {
+        _dmon_queue_init(ctx);
+    }
 
     struct stat root_st;
     if (stat(rootdir, &root_st) != 0 || !S_ISDIR(root_st.st_mode) || (root_st.st_mode & S_IRUSR) != S_IRUSR) {
         _DMON_LOG_ERRORF("Could not open/read directory: %s", rootdir);
-        pthread_mutex_unlock(&_dmon.mutex);
-        return _dmon_make_id(0);
+        _dmon_free_watch(ctx, watch);
+        return NULL;
     }
 
     if (S_ISLNK(root_st.st_mode)) {
@@ -1269,8 +5940,8 @@ DMON_API_IMPL dmon_watch_id dmon_watch(const char* rootdir,
         } else {
             _DMON_LOG_ERRORF("symlinks are unsupported: %s. use DMON_WATCHFLAGS_FOLLOW_SYMLINKS",
                              rootdir);
-            pthread_mutex_unlock(&_dmon.mutex);
-            return _dmon_make_id(0);
+            _dmon_free_watch(ctx, watch);
+            return NULL;
         }
     } else {
         _dmon_strcpy(watch->rootdir, sizeof(watch->rootdir) - 1, rootdir);
@@ -1283,58 +5954,174 @@ DMON_API_IMPL dmon_watch_id dmon_watch(const char* rootdir,
         watch->rootdir[rootdir_len + 1] = '\0';
     }
 
-    watch->fd = inotify_init();
-    if (watch->fd < -1) {
-        DMON_LOG_ERROR("could not create inotify instance");
-        pthread_mutex_unlock(&_dmon.mutex);
-        return _dmon_make_id(0);
+    if (flags & DMON_WATCHFLAGS_POLL) {
+        _dmon_poll_begin(ctx, watch, &root_st);
+        return watch;
+    }
+
+#if _DMON_FANOTIFY
+    if ((flags & DMON_WATCHFLAGS_FANOTIFY) && _dmon_fanotify_watch(ctx, watch)) {
+        return watch;
     }
+#endif
 
-    uint32_t inotify_mask = IN_MOVED_TO | IN_CREATE | IN_MOVED_FROM | IN_DELETE | IN_MODIFY;
-    int wd = inotify_add_watch(watch->fd, watch->rootdir, inotify_mask);
+    uint32_t inotify_mask = _dmon_inotify_mask(watch->actions, true);
+    int wd = inotify_add_watch(ctx->inotify_fd, watch->rootdir, inotify_mask | IN_MASK_ADD);
     if (wd < 0) {
        _DMON_LOG_ERRORF("Error watching directory '%s'. (inotify_add_watch:err=%d)", watch->rootdir, errno);
-        pthread_mutex_unlock(&_dmon.mutex);
+        _dmon_free_watch(ctx, watch);
+        return NULL;
+    }
+    _dmon_add_subdir(ctx, watch, "", wd);   // root dir is just a dummy entry
+
+    // recursive watches fill the snapshot while crawling
+    if (flags & DMON_WATCHFLAGS_SNAPSHOT) {
+        _dmon_snapshot_from_stat(&root_st, &watch->snapshot.nodes[0].st);
+    }
+    if ((flags & DMON_WATCHFLAGS_RECURSIVE) == 0) {
+        _dmon_snapshot_read_dir(watch, "");
+    }
+    return watch;
+}
+
+// events are delivered to batch_cb if it's set, otherwise to watch_cb, or to the queue if neither is set
+_DMON_PRIVATE dmon_watch_id _dmon_watch(dmon__state* ctx, const char* rootdir,
+                                        void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                         const char* dirname, const char* filename,
+                                                         const char* oldname, void* user),
+                                        _dmon_watch_batch_cb* batch_cb, uint32_t flags, void* user_data,
+                                        const dmon_watch_options* options)
+{
+    pthread_mutex_lock(&ctx->mutex);
+
+    dmon__watch_state* watch = _dmon_watch_begin(ctx, rootdir, watch_cb, batch_cb, flags, user_data, options);
+    if (watch == NULL) {
+        pthread_mutex_unlock(&ctx->mutex);
         return _dmon_make_id(0);
     }
-    dmon__watch_subdir subdir;
-    _dmon_strcpy(subdir.rootdir, sizeof(subdir.rootdir), "");   // root dir is just a dummy entry
-    stb_sb_push(watch->subdirs, subdir);
-    stb_sb_push(watch->wds, wd);
 
     // recursive mode: enumerate all child directories and add them to watch
-    if (flags & DMON_WATCHFLAGS_RECURSIVE) {
-        _dmon_watch_recursive(watch->rootdir, watch->fd, inotify_mask,
+    if ((flags & DMON_WATCHFLAGS_RECURSIVE) && !watch->fanotify && !watch->poll) {
+        uint32_t inotify_mask = _dmon_inotify_mask(watch->actions, false);
+        _dmon_watch_recursive(ctx, watch->rootdir, inotify_mask,
                               (flags & DMON_WATCHFLAGS_FOLLOW_SYMLINKS) ? true : false, watch);
     }
 
+    // the watch can be removed by a callback as soon as the lock is released
+    dmon_watch_id id = watch->id;
+    pthread_mutex_unlock(&ctx->mutex);
+    return id;
+}
 
-    pthread_mutex_unlock(&_dmon.mutex);
-    return _dmon_make_id(id);
+DMON_API_IMPL dmon_watch_id dmon_context_watch(dmon_context* ctx, const char* rootdir,
+                                               void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                const char* dirname, const char* filename,
+                                                                const char* oldname, void* user),
+                                               uint32_t flags, void* user_data)
+{
+    DMON_ASSERT(watch_cb);
+    return _dmon_watch(ctx, rootdir, watch_cb, NULL, flags, user_data, NULL);
 }
 
-DMON_API_IMPL void dmon_unwatch(dmon_watch_id id)
+// same as dmon_watch, but child directories of recursive watches are added by a background thread
+// ready_cb is called when all the directories are added, or when the watch is removed in the meantime
+_DMON_PRIVATE dmon_watch_id _dmon_watch_async(dmon__state* ctx, const char* rootdir,
+                                              void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                               const char* dirname, const char* filename,
+                                                               const char* oldname, void* user),
+                                              uint32_t flags, void* user_data,
+                                              void (*ready_cb)(dmon_watch_id watch_id, bool success, void* user),
+                                              const dmon_watch_options* options)
 {
-	DMON_ASSERT(_dmon_init);
-    DMON_ASSERT(id.id > 0);
-    int index = id.id - 1;
-    DMON_ASSERT(index < DMON_MAX_WATCHES);
-    DMON_ASSERT(_dmon.watches[index]);
-    DMON_ASSERT(_dmon.num_watches > 0);
+    DMON_ASSERT(watch_cb);
+
+    // entries that are created from now on, but before their directory is added, are reported by the crawl
+    struct timespec start;
+    _dmon_clock_coarse(&start);
+
+    pthread_mutex_lock(&ctx->mutex);
+
+    dmon__watch_state* watch = _dmon_watch_begin(ctx, rootdir, watch_cb, NULL, flags, user_data, options);
+    if (watch == NULL) {
+        pthread_mutex_unlock(&ctx->mutex);
+        return _dmon_make_id(0);
+    }
+    dmon_watch_id id = watch->id;
+
+    bool registering = false;
+    if ((flags & DMON_WATCHFLAGS_RECURSIVE) && !watch->fanotify && !watch->poll) {
+        uint32_t inotify_mask = _dmon_inotify_mask(watch->actions, false);
+        bool followlinks = (flags & DMON_WATCHFLAGS_FOLLOW_SYMLINKS) ? true : false;
+        registering = _dmon_register_async(ctx, watch, inotify_mask, followlinks, &start, ready_cb, user_data);
+        if (!registering) {
+            _dmon_watch_recursive(ctx, watch->rootdir, inotify_mask, followlinks, watch);
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->mutex);
+
+    if (!registering && ready_cb) {
+        ready_cb(id, true, user_data);
+    }
+    return id;
+}
+
+// same as dmon_watch, but the watch is restored from the index file that is saved by _dmon_index_save
+// the changes since the save are reported as events. falls back to dmon_watch if the index can't be used
+_DMON_PRIVATE dmon_watch_id _dmon_watch_restore(dmon__state* ctx, const char* rootdir,
+                                                void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                 const char* dirname, const char* filename,
+                                                                 const char* oldname, void* user),
+                                                uint32_t flags, void* user_data, const char* indexfile,
+                                                const dmon_watch_options* options)
+{
+    DMON_ASSERT(watch_cb);
+    // the files are compared with the index
+    flags |= DMON_WATCHFLAGS_SNAPSHOT;
+    pthread_mutex_lock(&ctx->mutex);
+
+    dmon__watch_state* watch = _dmon_watch_begin(ctx, rootdir, watch_cb, NULL, flags, user_data, options);
+    if (watch == NULL) {
+        pthread_mutex_unlock(&ctx->mutex);
+        return _dmon_make_id(0);
+    }
+
+    // directories that are reached by symlinks are not in the index. poll watches are already read
+    bool restored = !watch->fanotify && !watch->poll && (flags & DMON_WATCHFLAGS_FOLLOW_SYMLINKS) == 0 &&
+                    _dmon_index_restore(ctx, watch, indexfile, ctx->crawl_threads);
+    if (!restored && (flags & DMON_WATCHFLAGS_RECURSIVE) && !watch->fanotify && !watch->poll) {
+        uint32_t inotify_mask = _dmon_inotify_mask(watch->actions, false);
+        _dmon_watch_recursive(ctx, watch->rootdir, inotify_mask,
+                              (flags & DMON_WATCHFLAGS_FOLLOW_SYMLINKS) ? true : false, watch);
+    }
+
+    // the watch can be removed by a callback as soon as the lock is released
+    dmon_watch_id id = watch->id;
+    pthread_mutex_unlock(&ctx->mutex);
+    return id;
+}
 
-    if (_dmon.watches[index]) {
-        pthread_mutex_lock(&_dmon.mutex);
 
-        _dmon_unwatch(_dmon.watches[index]);
-        DMON_FREE(_dmon.watches[index]);
-        _dmon.watches[index] = NULL;
+DMON_API_IMPL void dmon_context_unwatch(dmon_context* ctx, dmon_watch_id id)
+{
+	DMON_ASSERT(ctx->initialized);
+    DMON_ASSERT(id.id > 0);
 
-        --_dmon.num_watches;
-        int num_freelist = DMON_MAX_WATCHES - _dmon.num_watches;
-        _dmon.freelist[num_freelist - 1] = index;
+    pthread_mutex_lock(&ctx->mutex);
 
-        pthread_mutex_unlock(&_dmon.mutex);
+    // stale ids, of watches that are already removed, are rejected by their generation
+    dmon__watch_state* watch = _dmon_get_watch(ctx, id);
+    if (watch == NULL) {
+        _DMON_LOG_DEBUGF("Watch id %u is not valid, it's already removed", id.id);
+        pthread_mutex_unlock(&ctx->mutex);
+        return;
     }
+    _dmon_free_watch(ctx, watch);
+
+    pthread_mutex_unlock(&ctx->mutex);
+
+    // the running callbacks may take the lock
+    _dmon_dispatch_wait(ctx, id);
 }
 #elif DMON_OS_MACOS
 // ---------------------------------------------------------------------------------------------------------------------
@@ -1358,10 +6145,11 @@ typedef struct dmon__watch_state {
     void* user_data;
     char rootdir[DMON_MAX_PATH];
     char rootdir_unmod[DMON_MAX_PATH];
+    struct dmon_context* ctx;   // the stream calls back on the dispatch queue, which has no context
     bool init;
 } dmon__watch_state;
 
-typedef struct dmon__state {
+typedef struct dmon_context {
     dmon__watch_state* watches[DMON_MAX_WATCHES];
    	int freelist[DMON_MAX_WATCHES];
     dmon__fsevent_event* events;
@@ -1372,15 +6160,11 @@ typedef struct dmon__state {
     CFRunLoopRef cf_loop_ref;
     CFAllocatorRef cf_alloc_ref;
     bool quit;
+    bool initialized;
 } dmon__state;
 
-union dmon__cast_userdata {
-    void* ptr;
-    uint32_t id;
-};
-
-static bool _dmon_init;
-static dmon__state _dmon;
+// the context of dmon_init/dmon_watch, the others are made by dmon_context_create
+static dmon__state _dmon_default;
 
 _DMON_PRIVATE void* _dmon_cf_malloc(CFIndex size, CFOptionFlags hints, void* info)
 {
@@ -1402,11 +6186,11 @@ _DMON_PRIVATE void* _dmon_cf_realloc(void* ptr, CFIndex newsize, CFOptionFlags h
     return DMON_REALLOC(ptr, (size_t)newsize);
 }
 
-_DMON_PRIVATE void _dmon_fsevent_process_events(void)
+_DMON_PRIVATE void _dmon_fsevent_process_events(dmon__state* ctx)
 {
     int i, c;
-    for (i = 0, c = stb_sb_count(_dmon.events); i < c; i++) {
-        dmon__fsevent_event* ev = &_dmon.events[i];
+    for (i = 0, c = stb_sb_count(ctx->events); i < c; i++) {
+        dmon__fsevent_event* ev = &ctx->events[i];
         if (ev->skip) {
             continue;
         }
@@ -1415,7 +6199,7 @@ _DMON_PRIVATE void _dmon_fsevent_process_events(void)
         if (ev->event_flags & kFSEventStreamEventFlagItemModified) {
             int j;
             for (j = i + 1; j < c; j++) {
-                dmon__fsevent_event* check_ev = &_dmon.events[j];
+                dmon__fsevent_event* check_ev = &ctx->events[j];
                 if ((check_ev->event_flags & kFSEventStreamEventFlagItemModified) &&
                     strcmp(ev->filepath, check_ev->filepath) == 0) {
                     ev->skip = true;
@@ -1425,7 +6209,7 @@ _DMON_PRIVATE void _dmon_fsevent_process_events(void)
         } else if ((ev->event_flags & kFSEventStreamEventFlagItemRenamed) && !ev->move_valid) {
             int j;
             for (j = i + 1; j < c; j++) {
-                dmon__fsevent_event* check_ev = &_dmon.events[j];
+                dmon__fsevent_event* check_ev = &ctx->events[j];
                 if ((check_ev->event_flags & kFSEventStreamEventFlagItemRenamed) &&
                     check_ev->event_id == (ev->event_id + 1)) {
                     ev->move_valid = check_ev->move_valid = true;
@@ -1441,7 +6225,7 @@ _DMON_PRIVATE void _dmon_fsevent_process_events(void)
                 ev->event_flags &= ~kFSEventStreamEventFlagItemRenamed;
 
                 char abs_filepath[DMON_MAX_PATH];
-                dmon__watch_state* watch = _dmon.watches[ev->watch_id.id-1];
+                dmon__watch_state* watch = ctx->watches[ev->watch_id.id-1];
                 _dmon_strcpy(abs_filepath, sizeof(abs_filepath), watch->rootdir);
                 _dmon_strcat(abs_filepath, sizeof(abs_filepath), ev->filepath);
 
@@ -1456,12 +6240,12 @@ _DMON_PRIVATE void _dmon_fsevent_process_events(void)
     }
 
     // trigger user callbacks
-    for (i = 0, c = stb_sb_count(_dmon.events); i < c; i++) {
-        dmon__fsevent_event* ev = &_dmon.events[i];
+    for (i = 0, c = stb_sb_count(ctx->events); i < c; i++) {
+        dmon__fsevent_event* ev = &ctx->events[i];
         if (ev->skip) {
             continue;
         }
-        dmon__watch_state* watch = _dmon.watches[ev->watch_id.id - 1];
+        dmon__watch_state* watch = ctx->watches[ev->watch_id.id - 1];
 
         if(watch == NULL || watch->watch_cb == NULL) {
             continue;
@@ -1477,7 +6261,7 @@ _DMON_PRIVATE void _dmon_fsevent_process_events(void)
         } else if (ev->event_flags & kFSEventStreamEventFlagItemRenamed) {
             int j;
             for (j = i + 1; j < c; j++) {
-                dmon__fsevent_event* check_ev = &_dmon.events[j];
+                dmon__fsevent_event* check_ev = &ctx->events[j];
                 if (check_ev->event_flags & kFSEventStreamEventFlagItemRenamed) {
                     watch->watch_cb(check_ev->watch_id, DMON_ACTION_MOVE, watch->rootdir_unmod,
                                     check_ev->filepath, ev->filepath, watch->user_data);
@@ -1490,33 +6274,33 @@ _DMON_PRIVATE void _dmon_fsevent_process_events(void)
         }
     }
 
-    stb_sb_reset(_dmon.events);
+    stb_sb_reset(ctx->events);
 }
 
 _DMON_PRIVATE void* _dmon_thread(void* arg)
 {
-    _DMON_UNUSED(arg);
+    dmon__state* ctx = (dmon__state*)arg;
 
     struct timespec req = { (time_t)DMON_SLEEP_INTERVAL / 1000, (long)(DMON_SLEEP_INTERVAL * 1000000) };
     struct timespec rem = { 0, 0 };
 
-    _dmon.cf_loop_ref = CFRunLoopGetCurrent();
-    dispatch_semaphore_signal(_dmon.thread_sem);
+    ctx->cf_loop_ref = CFRunLoopGetCurrent();
+    dispatch_semaphore_signal(ctx->thread_sem);
 
-    while (__sync_bool_compare_and_swap(&_dmon.quit, false, false)) {
+    while (__sync_bool_compare_and_swap(&ctx->quit, false, false)) {
         int i;
         nanosleep(&req, &rem);
-        if (pthread_mutex_trylock(&_dmon.mutex) != 0) {
+        if (pthread_mutex_trylock(&ctx->mutex) != 0) {
             continue;
         }
 
-        if (_dmon.num_watches == 0) {
-            pthread_mutex_unlock(&_dmon.mutex);
+        if (ctx->num_watches == 0) {
+            pthread_mutex_unlock(&ctx->mutex);
             continue;
         }
 
-        for (i = 0; i < _dmon.num_watches; i++) {
-            dmon__watch_state* watch = _dmon.watches[i];
+        for (i = 0; i < ctx->num_watches; i++) {
+            dmon__watch_state* watch = ctx->watches[i];
             if (!watch->init) {
                 DMON_ASSERT(watch->fsev_stream_ref);
                 FSEventStreamStart(watch->fsev_stream_ref);
@@ -1526,13 +6310,13 @@ _DMON_PRIVATE void* _dmon_thread(void* arg)
         }
 
         CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.5, kCFRunLoopRunTimedOut);
-        _dmon_fsevent_process_events();
+        _dmon_fsevent_process_events(ctx);
 
-        pthread_mutex_unlock(&_dmon.mutex);
+        pthread_mutex_unlock(&ctx->mutex);
     }
 
-    CFRunLoopStop(_dmon.cf_loop_ref);
-    _dmon.cf_loop_ref = NULL;
+    CFRunLoopStop(ctx->cf_loop_ref);
+    ctx->cf_loop_ref = NULL;
     return 0x0;
 }
 
@@ -1546,62 +6330,71 @@ _DMON_PRIVATE void _dmon_unwatch(dmon__watch_state* watch)
     }
 }
 
-DMON_API_IMPL void dmon_init(void)
+_DMON_PRIVATE void _dmon_context_init(dmon__state* ctx)
 {
-    DMON_ASSERT(!_dmon_init);
+    DMON_ASSERT(!ctx->initialized);
 
     pthread_mutexattr_t attr;
     pthread_mutexattr_init(&attr);
     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&_dmon.mutex, &attr);
+    pthread_mutex_init(&ctx->mutex, &attr);
 
     CFAllocatorContext cf_alloc_ctx = { 0 };
     cf_alloc_ctx.allocate = _dmon_cf_malloc;
     cf_alloc_ctx.deallocate = _dmon_cf_free;
     cf_alloc_ctx.reallocate = _dmon_cf_realloc;
-    _dmon.cf_alloc_ref = CFAllocatorCreate(NULL, &cf_alloc_ctx);
+    ctx->cf_alloc_ref = CFAllocatorCreate(NULL, &cf_alloc_ctx);
 
-    _dmon.thread_sem = dispatch_semaphore_create(0);
-    DMON_ASSERT(_dmon.thread_sem);
+    ctx->thread_sem = dispatch_semaphore_create(0);
+    DMON_ASSERT(ctx->thread_sem);
 
-    int r = pthread_create(&_dmon.thread_handle, NULL, _dmon_thread, NULL);
+    int r = pthread_create(&ctx->thread_handle, NULL, _dmon_thread, ctx);
     _DMON_UNUSED(r);
     DMON_ASSERT(r == 0 && "pthread_create failed");
 
     // wait for thread to initialize loop object
-    dispatch_semaphore_wait(_dmon.thread_sem, DISPATCH_TIME_FOREVER);
+    dispatch_semaphore_wait(ctx->thread_sem, DISPATCH_TIME_FOREVER);
 
-    for (int i = 0; i < DMON_MAX_WATCHES; i++)
-        _dmon.freelist[i] = DMON_MAX_WATCHES - i - 1;
+    {
+        int i;
+        for (i = 0; i < DMON_MAX_WATCHES; i++)
+            ctx->freelist[i] = DMON_MAX_WATCHES - i - 1;
+    }
 
-    _dmon_init = true;
+    ctx->initialized = true;
 }
 
-DMON_API_IMPL void dmon_deinit(void)
+// the callbacks of the context are called by its monitor thread
+_DMON_PRIVATE bool _dmon_context_thread(dmon__state* ctx)
+{
+    return pthread_equal(ctx->thread_handle, pthread_self());
+}
+
+_DMON_PRIVATE void _dmon_context_deinit(dmon__state* ctx)
 {
-    DMON_ASSERT(_dmon_init);
-    _DMON_UNUSED(__sync_lock_test_and_set(&_dmon.quit, true));
-    pthread_join(_dmon.thread_handle, NULL);
+    DMON_ASSERT(ctx->initialized);
+    _DMON_UNUSED(__sync_lock_test_and_set(&ctx->quit, true));
+    pthread_join(ctx->thread_handle, NULL);
 
-    dispatch_release(_dmon.thread_sem);
+    dispatch_release(ctx->thread_sem);
 
     {
         int i;
-        for (i = 0; i < _dmon.num_watches; i++) {
-            if (_dmon.watches[i]) {
-                _dmon_unwatch(_dmon.watches[i]);
-                DMON_FREE(_dmon.watches[i]);
+        for (i = 0; i < ctx->num_watches; i++) {
+            if (ctx->watches[i]) {
+                _dmon_unwatch(ctx->watches[i]);
+                DMON_FREE(ctx->watches[i]);
             }
         }
     }
 
-    pthread_mutex_destroy(&_dmon.mutex);
-    stb_sb_free(_dmon.events);
-    if (_dmon.cf_alloc_ref)
-        CFRelease(_dmon.cf_alloc_ref);
+    pthread_mutex_destroy(&ctx->mutex);
+    stb_sb_free(ctx->events);
+    if (ctx->cf_alloc_ref)
+        CFRelease(ctx->cf_alloc_ref);
 
-    memset(&_dmon, 0x0, sizeof(_dmon));
-    _dmon_init = false;
+    memset(ctx, 0x0, sizeof(*ctx));
+    ctx->initialized = false;
 }
 
 _DMON_PRIVATE void _dmon_fsevent_callback(ConstFSEventStreamRef stream_ref, void* user_data,
@@ -1611,11 +6404,10 @@ _DMON_PRIVATE void _dmon_fsevent_callback(ConstFSEventStreamRef stream_ref, void
 {
     _DMON_UNUSED(stream_ref);
 
-    union dmon__cast_userdata _userdata;
-    _userdata.ptr = user_data;
-    dmon_watch_id watch_id = _dmon_make_id(_userdata.id);
+    dmon__watch_state* watch = (dmon__watch_state*)user_data;
+    dmon__state* ctx = watch->ctx;
+    dmon_watch_id watch_id = watch->id;
     DMON_ASSERT(watch_id.id > 0);
-    dmon__watch_state* watch = _dmon.watches[watch_id.id - 1];
     char abs_filepath[DMON_MAX_PATH];
     char abs_filepath_lower[DMON_MAX_PATH];
 
@@ -1641,49 +6433,49 @@ _DMON_PRIVATE void _dmon_fsevent_callback(ConstFSEventStreamRef stream_ref, void
             ev.event_flags = flags;
             ev.event_id = event_id;
             ev.watch_id = watch_id;
-            stb_sb_push(_dmon.events, ev);
+            stb_sb_push(ctx->events, ev);
         }
     }
 }
 
-DMON_API_IMPL dmon_watch_id dmon_watch(const char* rootdir,
-                                       void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
-                                                        const char* dirname, const char* filename,
-                                                        const char* oldname, void* user),
-                                       uint32_t flags, void* user_data)
+DMON_API_IMPL dmon_watch_id dmon_context_watch(dmon_context* ctx, const char* rootdir,
+                                               void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                const char* dirname, const char* filename,
+                                                                const char* oldname, void* user),
+                                               uint32_t flags, void* user_data)
 {
-	DMON_ASSERT(_dmon_init);
+	DMON_ASSERT(ctx->initialized);
     DMON_ASSERT(watch_cb);
     DMON_ASSERT(rootdir && rootdir[0]);
 
-    pthread_mutex_lock(&_dmon.mutex);
+    pthread_mutex_lock(&ctx->mutex);
 
-    DMON_ASSERT(_dmon.num_watches < DMON_MAX_WATCHES);
-    if (_dmon.num_watches >= DMON_MAX_WATCHES) {
+    DMON_ASSERT(ctx->num_watches < DMON_MAX_WATCHES);
+    if (ctx->num_watches >= DMON_MAX_WATCHES) {
         DMON_LOG_ERROR("Exceeding maximum number of watches");
-        pthread_mutex_unlock(&_dmon.mutex);
+        pthread_mutex_unlock(&ctx->mutex);
         return _dmon_make_id(0);
     }
 
 
-    int num_freelist = DMON_MAX_WATCHES - _dmon.num_watches;
-    int index = _dmon.freelist[num_freelist - 1];
+    int num_freelist = DMON_MAX_WATCHES - ctx->num_watches;
+    int index = ctx->freelist[num_freelist - 1];
     uint32_t id = (uint32_t)(index + 1);
 
-    if (_dmon.watches[index] == NULL) {
+    if (ctx->watches[index] == NULL) {
         dmon__watch_state* state =  (dmon__watch_state*)DMON_MALLOC(sizeof(dmon__watch_state));
         DMON_ASSERT(state);
         if (state == NULL) {
-            pthread_mutex_unlock(&_dmon.mutex);
+            pthread_mutex_unlock(&ctx->mutex);
             return _dmon_make_id(0);
         }
         memset(state, 0x0, sizeof(dmon__watch_state));
-        _dmon.watches[index] = state;
+        ctx->watches[index] = state;
     }
 
-    ++_dmon.num_watches;
+    ++ctx->num_watches;
 
-    dmon__watch_state* watch = _dmon.watches[id - 1];
+    dmon__watch_state* watch = ctx->watches[id - 1];
     DMON_ASSERT(watch);
     watch->id = _dmon_make_id(id);
     watch->watch_flags = flags;
@@ -1694,7 +6486,7 @@ DMON_API_IMPL dmon_watch_id dmon_watch(const char* rootdir,
     if (stat(rootdir, &root_st) != 0 || !S_ISDIR(root_st.st_mode) ||
         (root_st.st_mode & S_IRUSR) != S_IRUSR) {
         _DMON_LOG_ERRORF("Could not open/read directory: %s", rootdir);
-        pthread_mutex_unlock(&_dmon.mutex);
+        pthread_mutex_unlock(&ctx->mutex);
         return _dmon_make_id(0);
     }
 
@@ -1708,7 +6500,7 @@ DMON_API_IMPL dmon_watch_id dmon_watch(const char* rootdir,
             _dmon_strcpy(watch->rootdir, sizeof(watch->rootdir) - 1, linkpath);
         } else {
             _DMON_LOG_ERRORF("symlinks are unsupported: %s. use DMON_WATCHFLAGS_FOLLOW_SYMLINKS", rootdir);
-            pthread_mutex_unlock(&_dmon.mutex);
+            pthread_mutex_unlock(&ctx->mutex);
             return _dmon_make_id(0);
         }
     } else {
@@ -1736,22 +6528,21 @@ DMON_API_IMPL dmon_watch_id dmon_watch(const char* rootdir,
     CFStringRef cf_dir = CFStringCreateWithCString(NULL, watch->rootdir_unmod, kCFStringEncodingUTF8);
     CFArrayRef cf_dirarr = CFArrayCreate(NULL, (const void**)&cf_dir, 1, NULL);
 
-    FSEventStreamContext ctx;
-    union dmon__cast_userdata userdata;
-    userdata.id = id;
-    ctx.version = 0;
-    ctx.info = userdata.ptr;
-    ctx.retain = NULL;
-    ctx.release = NULL;
-    ctx.copyDescription = NULL;
-    watch->fsev_stream_ref = FSEventStreamCreate(_dmon.cf_alloc_ref, _dmon_fsevent_callback, &ctx,
+    FSEventStreamContext stream_ctx;
+    watch->ctx = ctx;
+    stream_ctx.version = 0;
+    stream_ctx.info = watch;
+    stream_ctx.retain = NULL;
+    stream_ctx.release = NULL;
+    stream_ctx.copyDescription = NULL;
+    watch->fsev_stream_ref = FSEventStreamCreate(ctx->cf_alloc_ref, _dmon_fsevent_callback, &stream_ctx,
                                                  cf_dirarr, kFSEventStreamEventIdSinceNow, 0.25,
                                                  kFSEventStreamCreateFlagFileEvents);
                 
     watch->queue = dispatch_queue_create("com.septag.dmon", NULL);
     if(!watch->queue) {
         _DMON_LOG_ERRORF("Could not create dispatch queue: %s.", rootdir);
-        pthread_mutex_unlock(&_dmon.mutex);
+        pthread_mutex_unlock(&ctx->mutex);
         return _dmon_make_id(0);
     }
     FSEventStreamSetDispatchQueue(watch->fsev_stream_ref, watch->queue);
@@ -1759,35 +6550,85 @@ DMON_API_IMPL dmon_watch_id dmon_watch(const char* rootdir,
     CFRelease(cf_dirarr);
     CFRelease(cf_dir);
 
-    pthread_mutex_unlock(&_dmon.mutex);
+    pthread_mutex_unlock(&ctx->mutex);
     return _dmon_make_id(id);
 }
 
-DMON_API_IMPL void dmon_unwatch(dmon_watch_id id)
+DMON_API_IMPL void dmon_context_unwatch(dmon_context* ctx, dmon_watch_id id)
 {
-   	DMON_ASSERT(_dmon_init);
+   	DMON_ASSERT(ctx->initialized);
     DMON_ASSERT(id.id > 0);
     int index = id.id - 1;
     DMON_ASSERT(index < DMON_MAX_WATCHES);
-    DMON_ASSERT(_dmon.watches[index]);
-    DMON_ASSERT(_dmon.num_watches > 0);
+    DMON_ASSERT(ctx->watches[index]);
+    DMON_ASSERT(ctx->num_watches > 0);
 
-    if (_dmon.watches[index]) {
-        pthread_mutex_lock(&_dmon.mutex);
+    if (ctx->watches[index]) {
+        pthread_mutex_lock(&ctx->mutex);
 
-        _dmon_unwatch(_dmon.watches[index]);
-        DMON_FREE(_dmon.watches[index]);
-        _dmon.watches[index] = NULL;
+        _dmon_unwatch(ctx->watches[index]);
+        DMON_FREE(ctx->watches[index]);
+        ctx->watches[index] = NULL;
 
-        --_dmon.num_watches;
-        int num_freelist = DMON_MAX_WATCHES - _dmon.num_watches;
-        _dmon.freelist[num_freelist - 1] = index;
+        --ctx->num_watches;
+        int num_freelist = DMON_MAX_WATCHES - ctx->num_watches;
+        ctx->freelist[num_freelist - 1] = index;
 
-        pthread_mutex_unlock(&_dmon.mutex);
+        pthread_mutex_unlock(&ctx->mutex);
     }
 }
 
 #endif
 
+DMON_API_IMPL void dmon_init(void)
+{
+    _dmon_context_init(&_dmon_default);
+}
+
+DMON_API_IMPL void dmon_deinit(void)
+{
+    _dmon_context_deinit(&_dmon_default);
+}
+
+DMON_API_IMPL dmon_watch_id dmon_watch(const char* rootdir,
+                                       void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                        const char* rootdir, const char* filepath,
+                                                        const char* oldfilepath, void* user),
+                                       uint32_t flags, void* user_data)
+{
+    return dmon_context_watch(&_dmon_default, rootdir, watch_cb, flags, user_data);
+}
+
+DMON_API_IMPL void dmon_unwatch(dmon_watch_id id)
+{
+    dmon_context_unwatch(&_dmon_default, id);
+}
+
+// the state of a context is the same as the default one, the threads of the context are bound to it
+DMON_API_IMPL dmon_context* dmon_context_create(void)
+{
+    dmon__state* ctx = (dmon__state*)DMON_MALLOC(sizeof(dmon__state));
+    DMON_ASSERT(ctx);
+    if (ctx == NULL) {
+        DMON_LOG_ERROR("Out of memory");
+        return NULL;
+    }
+    memset(ctx, 0x0, sizeof(dmon__state));
+    _dmon_context_init(ctx);
+    return ctx;
+}
+
+DMON_API_IMPL void dmon_context_destroy(dmon_context* ctx)
+{
+    DMON_ASSERT(ctx && ctx != &_dmon_default);
+    // the thread would wait for itself
+    if (_dmon_context_thread(ctx)) {
+        DMON_LOG_ERROR("Context can't be destroyed from it's own callbacks");
+        return;
+    }
+    _dmon_context_deinit(ctx);
+    DMON_FREE(ctx);
+}
+
 #endif    // DMON_IMPL
 #endif  // __DMON_H__
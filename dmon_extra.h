@@ -18,6 +18,102 @@
 //          sub-directories to be watched based on application-specific logic about which sub-directory actually needs to be watched.
 //          The function dmon_watch_add and dmon_watch_rm are used to this purpose.
 //
+//  Async watch:
+//  dmon_watch_async: Same as dmon_watch, but returns right after the root directory is watched. In recursive mode, sub-directories
+//          are added by a background thread and ready_cb is called when it's done. success is false if the watch is removed
+//          (or dmon is shut down) before all the sub-directories are added. Other watches keep receiving events in the meantime.
+//          Entries that are created after the call, but before their directory is added to the watch, are reported as
+//          DMON_ACTION_CREATE, entries created right at the time their directory is added may be reported twice.
+//          They are found by their birth time, file systems that don't keep it (or kernels before 4.11) use the last
+//          change instead, so files that are written, chmod'ed or linked in that window are reported as created too.
+//          ready_cb is called from the background thread, or from the calling thread for non-recursive watches.
+//
+//  Batched events:
+//  dmon_watch_batch: Same as dmon_watch, but instead of one call for every event, batch_cb is called once for every
+//          flush of the events (their window, see dmon_watch_set_window) with all the events of the watch in a single
+//          array, in order. The array and it's paths are only valid during the callback. New directories of recursive
+//          watches are already added to the watch before the batch is delivered. With DMON_CALLBACK_THREADS, the
+//          flushes that come while the previous batch is still running are delivered together.
+//
+//  Ignore rules:
+//  dmon_watch_filtered: Same as dmon_watch, but the entries that match the patterns are left out of the watch.
+//          patterns is the text of a .gitignore file: one pattern per line, blank lines and lines starting with '#'
+//          are skipped, '*', '?' and [a-z] don't match '/', "**" matches any number of directories, a trailing '/'
+//          only matches directories, a leading or middle '/' matches the path relative to rootdir instead of the
+//          name, and '!' includes the entries that are excluded by the previous patterns (the last match wins).
+//          Excluded directories are not crawled or watched at all, so nothing under them can be included again.
+//          Events of excluded entries are dropped before they are queued. For example: "node_modules/\n.git/objects/\n*.o"
+//
+//  Watch options:
+//  dmon_watch_ex: Same as dmon_watch, with the options that are zero for the defaults: ignore is the same as the
+//          patterns of dmon_watch_filtered, and actions are the DMON_ACTIONMASK bits of the actions to report
+//          (DMON_ACTIONMASK_DEFAULT: create, delete, modify, move and overflow). The actions decide which events are
+//          added to the inotify watches, so the kernel doesn't even queue the events of the actions that are not
+//          wanted: MODIFY, CLOSE_WRITE, ATTRIB, ROOT_DELETE and ROOT_MOVE are only added for the watches that want
+//          them. The events that change the directory tree are always read, since the watch keeps the tree, and
+//          only delivered for their actions. ROOT_DELETE and ROOT_MOVE are not reported by fanotify and poll watches.
+//          dmon_watch_async, dmon_watch_batch, dmon_watch_queue and dmon_watch_restore take the same options, NULL for
+//          the defaults.
+//
+//  Event latency:
+//  dmon_watch_set_window: Sets how long the events of the watch are gathered before they are delivered (100ms by
+//          default). Events of the same file in the window are merged, and moves are paired. If min_ms and max_ms are
+//          the same, the window is fixed, 0 delivers the events as soon as they are read. Otherwise the window is
+//          adaptive: it's min_ms for the first events after the watch was idle for max_ms, and it's doubled up to
+//          max_ms while the events keep coming within max_ms of the previous flush. Every watch has it's own deadline, so a short
+//          window is not held up by the other watches. Poll watches deliver their changes right after every check.
+//          Returns false, and leaves the window as it is, if min_ms is negative or larger than max_ms.
+//
+//  Event queue:
+//  dmon_watch_queue: Same as dmon_watch, but there is no callback. The events of the watch are pushed to a single queue
+//          that is shared by all the queue watches, and pulled by the application from any thread, with:
+//  dmon_poll_events: Copies up to max events from the queue to events and returns their count, without blocking.
+//  dmon_wait_events: Same as dmon_poll_events, but waits at most timeout_ms milliseconds for the events to come, or
+//          forever if timeout_ms is negative. Returns 0 on timeout.
+//  dmon_get_queue_info: Returns the capacity (DMON_QUEUE_SIZE), the number of events in the queue and the number of
+//          events that are dropped so far because the queue was full.
+//          The queue is lock-free, any number of threads can pull from it, and the events of a watch come in order.
+//          The monitor thread never waits for the consumers, so the events are dropped if the queue is full; a
+//          growing dropped count means that the queue should be larger, or the application should rescan.
+//          These functions must not be called during dmon_deinit.
+//
+//  Statistics:
+//  dmon_get_stats: Fills stats with the counters of the watch, or of all the watches (including the removed ones) if
+//          id is zero. The counters are updated with relaxed atomics, so they are cheap to keep and can be read at
+//          any time from any thread, but they are not a consistent snapshot of each other.
+//
+//  Index file:
+//  dmon_watch_save: Saves what the watch knows about it's directory tree to a file, for restoring the watch later.
+//          Only the watches with DMON_WATCHFLAGS_SNAPSHOT can be saved, the others don't keep their files.
+//  dmon_watch_restore: Same as dmon_watch, but the tree is loaded from the index file (memory-mapped) instead of crawling
+//          it, and only checked against the disk. Directories that are not modified since the save are not read again,
+//          only their entries are stat'ed, by dmon_set_crawl_threads threads. The changes since the save are reported as
+//          events. Files are compared by size and mtime, the restored watch always has DMON_WATCHFLAGS_SNAPSHOT.
+//          Falls back to dmon_watch if the index file is missing or doesn't belong to rootdir, and for
+//          DMON_WATCHFLAGS_FOLLOW_SYMLINKS.
+//
+//  Crawl threads:
+//  dmon_set_crawl_threads: Sets the number of threads (including the calling one) that crawl the directory trees of
+//          the recursive and async watches, and check the index files of restores, that are added from now on.
+//          DMON_CRAWL_THREADS by default. Returns false if num_threads is less than 1.
+//          Reading the directories is spread over the threads, but the kernel adds the watches of an inotify
+//          instance one at a time, and the directories are sorted and added to the watch on one thread. In bench.c,
+//          inotify_add_watch alone takes about a quarter of the crawl of a 4368 directory tree, so the crawl can't
+//          get more than about 3x faster with any number of threads, and not at all without idle cores.
+//
+//  Snapshot queries:
+//  dmon_watch_stat: Returns what dmon knows about the file (relative to the watch root_dir), without touching the disk.
+//  dmon_watch_list: Calls list_cb for every entry of the directory (relative to the watch root_dir, "" for the root).
+//          Returns the number of entries, or -1 if the directory is not known.
+//          Watches with DMON_WATCHFLAGS_SNAPSHOT keep the names, types, inodes, sizes and mtimes of all the entries
+//          they have seen. The other watches only keep the directories, with -1 for size and mtime. Non-recursive
+//          watches only know about the entries of the root directory and the directories added by dmon_watch_add.
+//          Queries are not supported for fanotify watches.
+//
+//  Contexts:
+//  Every function above works on the default context, the dmon_context_* variants take the context as the first
+//          argument, see dmon_context_create in dmon.h.
+//
 
 #ifndef __DMON_H__
 #error "Include 'dmon.h' before including this file"
@@ -27,37 +123,146 @@
 extern "C" {
 #endif
 
+typedef struct dmon_queue_info {
+    int capacity;
+    int count;
+    uint64_t dropped;
+} dmon_queue_info;
+
+typedef struct dmon_entry_info {
+    uint64_t inode;
+    int64_t size;       // -1 if unknown
+    int64_t mtime;      // nanoseconds since epoch, -1 if unknown
+    bool is_dir;
+} dmon_entry_info;
+
 DMON_API_DECL bool dmon_watch_add(dmon_watch_id id, const char* subdir);
 DMON_API_DECL bool dmon_watch_rm(dmon_watch_id id, const char* watchdir);
+DMON_API_DECL dmon_watch_id dmon_watch_async(const char* rootdir,
+                                             void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                              const char* rootdir, const char* filepath,
+                                                              const char* oldfilepath, void* user),
+                                             uint32_t flags, void* user_data,
+                                             void (*ready_cb)(dmon_watch_id watch_id, bool success, void* user),
+                                             const dmon_watch_options* options);
+DMON_API_DECL dmon_watch_id dmon_watch_batch(const char* rootdir,
+                                             void (*batch_cb)(dmon_watch_id watch_id, const char* rootdir,
+                                                              const dmon_event* events, int count, void* user),
+                                             uint32_t flags, void* user_data, const dmon_watch_options* options);
+DMON_API_DECL dmon_watch_id dmon_watch_filtered(const char* rootdir,
+                                                void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                 const char* rootdir, const char* filepath,
+                                                                 const char* oldfilepath, void* user),
+                                                uint32_t flags, void* user_data, const char* patterns);
+DMON_API_DECL dmon_watch_id dmon_watch_ex(const char* rootdir,
+                                          void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                           const char* rootdir, const char* filepath,
+                                                           const char* oldfilepath, void* user),
+                                          uint32_t flags, void* user_data, const dmon_watch_options* options);
+DMON_API_DECL bool dmon_get_stats(dmon_watch_id id, dmon_stats* stats);
+DMON_API_DECL bool dmon_watch_set_window(dmon_watch_id id, int min_ms, int max_ms);
+DMON_API_DECL dmon_watch_id dmon_watch_queue(const char* rootdir, uint32_t flags, const dmon_watch_options* options);
+DMON_API_DECL int dmon_poll_events(dmon_queued_event* events, int max);
+DMON_API_DECL int dmon_wait_events(dmon_queued_event* events, int max, int timeout_ms);
+DMON_API_DECL void dmon_get_queue_info(dmon_queue_info* info);
+DMON_API_DECL bool dmon_watch_save(dmon_watch_id id, const char* indexfile);
+DMON_API_DECL dmon_watch_id dmon_watch_restore(const char* rootdir,
+                                               void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                const char* rootdir, const char* filepath,
+                                                                const char* oldfilepath, void* user),
+                                               uint32_t flags, void* user_data, const char* indexfile,
+                                               const dmon_watch_options* options);
+DMON_API_DECL bool dmon_set_crawl_threads(int num_threads);
+DMON_API_DECL bool dmon_watch_stat(dmon_watch_id id, const char* filepath, dmon_entry_info* info);
+DMON_API_DECL int dmon_watch_list(dmon_watch_id id, const char* dirpath,
+                                  void (*list_cb)(const char* filepath, const dmon_entry_info* info, void* user),
+                                  void* user);
+
+// the same functions on a context, see dmon_context_create
+DMON_API_DECL bool dmon_context_watch_add(dmon_context* ctx, dmon_watch_id id, const char* subdir);
+DMON_API_DECL bool dmon_context_watch_rm(dmon_context* ctx, dmon_watch_id id, const char* watchdir);
+DMON_API_DECL dmon_watch_id dmon_context_watch_async(dmon_context* ctx, const char* rootdir,
+                                                     void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                      const char* rootdir, const char* filepath,
+                                                                      const char* oldfilepath, void* user),
+                                                     uint32_t flags, void* user_data,
+                                                     void (*ready_cb)(dmon_watch_id watch_id, bool success, void* user),
+                                                     const dmon_watch_options* options);
+DMON_API_DECL dmon_watch_id dmon_context_watch_batch(dmon_context* ctx, const char* rootdir,
+                                                     void (*batch_cb)(dmon_watch_id watch_id, const char* rootdir,
+                                                                      const dmon_event* events, int count, void* user),
+                                                     uint32_t flags, void* user_data, const dmon_watch_options* options);
+DMON_API_DECL dmon_watch_id dmon_context_watch_filtered(dmon_context* ctx, const char* rootdir,
+                                                        void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                         const char* rootdir, const char* filepath,
+                                                                         const char* oldfilepath, void* user),
+                                                        uint32_t flags, void* user_data, const char* patterns);
+DMON_API_DECL dmon_watch_id dmon_context_watch_ex(dmon_context* ctx, const char* rootdir,
+                                                  void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                   const char* rootdir, const char* filepath,
+                                                                   const char* oldfilepath, void* user),
+                                                  uint32_t flags, void* user_data, const dmon_watch_options* options);
+DMON_API_DECL bool dmon_context_get_stats(dmon_context* ctx, dmon_watch_id id, dmon_stats* stats);
+DMON_API_DECL bool dmon_context_watch_set_window(dmon_context* ctx, dmon_watch_id id, int min_ms, int max_ms);
+DMON_API_DECL dmon_watch_id dmon_context_watch_queue(dmon_context* ctx, const char* rootdir, uint32_t flags,
+                                                     const dmon_watch_options* options);
+DMON_API_DECL int dmon_context_poll_events(dmon_context* ctx, dmon_queued_event* events, int max);
+DMON_API_DECL int dmon_context_wait_events(dmon_context* ctx, dmon_queued_event* events, int max, int timeout_ms);
+DMON_API_DECL void dmon_context_get_queue_info(dmon_context* ctx, dmon_queue_info* info);
+DMON_API_DECL bool dmon_context_watch_save(dmon_context* ctx, dmon_watch_id id, const char* indexfile);
+DMON_API_DECL dmon_watch_id dmon_context_watch_restore(dmon_context* ctx, const char* rootdir,
+                                                       void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                        const char* rootdir, const char* filepath,
+                                                                        const char* oldfilepath, void* user),
+                                                       uint32_t flags, void* user_data, const char* indexfile,
+                                                       const dmon_watch_options* options);
+DMON_API_DECL bool dmon_context_set_crawl_threads(dmon_context* ctx, int num_threads);
+DMON_API_DECL bool dmon_context_watch_stat(dmon_context* ctx, dmon_watch_id id, const char* filepath,
+                                           dmon_entry_info* info);
+DMON_API_DECL int dmon_context_watch_list(dmon_context* ctx, dmon_watch_id id, const char* dirpath,
+                                          void (*list_cb)(const char* filepath, const dmon_entry_info* info, void* user),
+                                          void* user);
 
 #ifdef __cplusplus
 }
 #endif
 
 #ifdef DMON_IMPL
-#if DMON_OS_LINUX
-DMON_API_IMPL bool dmon_watch_add(dmon_watch_id id, const char* watchdir)
+#if DMON_OS_INOTIFY
+DMON_API_IMPL bool dmon_context_watch_add(dmon_context* ctx, dmon_watch_id id, const char* watchdir)
 {
-    DMON_ASSERT(id.id > 0 && id.id <= DMON_MAX_WATCHES);
+    DMON_ASSERT(id.id > 0);
 
-    bool skip_lock = pthread_self() == _dmon.thread_handle;
+    bool skip_lock = pthread_self() == ctx->thread_handle;
 
     if (!skip_lock)
-        pthread_mutex_lock(&_dmon.mutex);
+        pthread_mutex_lock(&ctx->mutex);
 
-    dmon__watch_state* watch = _dmon.watches[id.id - 1];
+    dmon__watch_state* watch = _dmon_get_watch(ctx, id);
+    if (watch == NULL) {
+        DMON_LOG_ERROR("Invalid watch id");
+        if (!skip_lock)
+            pthread_mutex_unlock(&ctx->mutex);
+        return false;
+    }
+    if (watch->poll) {
+        DMON_LOG_ERROR("Sub-directories can't be added to poll watches");
+        if (!skip_lock)
+            pthread_mutex_unlock(&ctx->mutex);
+        return false;
+    }
 
-    int dirlen, i, c;
+    int dirlen;
 
     // check if the directory exists
     // if watchdir contains absolute/root-included path, try to strip the rootdir from it
     // else, we assume that watchdir is correct, so save it as it is
     struct stat st;
-    dmon__watch_subdir subdir;
+    char subdir[DMON_MAX_PATH];
     if (stat(watchdir, &st) == 0 && (st.st_mode & S_IFDIR)) {
-        _dmon_strcpy(subdir.rootdir, sizeof(subdir.rootdir), watchdir);
-        if (strstr(subdir.rootdir, watch->rootdir) == subdir.rootdir) {
-            _dmon_strcpy(subdir.rootdir, sizeof(subdir.rootdir), watchdir + strlen(watch->rootdir));
+        _dmon_strcpy(subdir, sizeof(subdir), watchdir);
+        if (strstr(subdir, watch->rootdir) == subdir) {
+            _dmon_strcpy(subdir, sizeof(subdir), watchdir + strlen(watch->rootdir));
         }
     } else {
         char fullpath[DMON_MAX_PATH];
@@ -66,59 +271,64 @@ DMON_API_IMPL bool dmon_watch_add(dmon_watch_id id, const char* watchdir)
         if (stat(fullpath, &st) != 0 || (st.st_mode & S_IFDIR) == 0) {
             _DMON_LOG_ERRORF("Watch directory '%s' is not valid", watchdir);
             if (!skip_lock)
-                pthread_mutex_unlock(&_dmon.mutex);
+                pthread_mutex_unlock(&ctx->mutex);
             return false;
         }
-        _dmon_strcpy(subdir.rootdir, sizeof(subdir.rootdir), watchdir);
+        _dmon_strcpy(subdir, sizeof(subdir), watchdir);
     }
 
-    dirlen = (int)strlen(subdir.rootdir);
-    if (subdir.rootdir[dirlen - 1] != '/') {
-        subdir.rootdir[dirlen] = '/';
-        subdir.rootdir[dirlen + 1] = '\0';
+    dirlen = (int)strlen(subdir);
+    if (subdir[dirlen - 1] != '/') {
+        subdir[dirlen] = '/';
+        subdir[dirlen + 1] = '\0';
     }
 
     // check that the directory is not already added
-    for (i = 0, c = stb_sb_count(watch->subdirs); i < c; i++) {
-        if (strcmp(subdir.rootdir, watch->subdirs[i].rootdir) == 0) {
-            _DMON_LOG_ERRORF("Error watching directory '%s', because it is already added.", watchdir);
-            if (!skip_lock) 
-                pthread_mutex_unlock(&_dmon.mutex);
-            return false;
-        }
+    int n = _dmon_subdir_find(watch, subdir, (int)strlen(subdir), false);
+    if (n != -1 && watch->subdirs[n].wd >= 0) {
+        _DMON_LOG_ERRORF("Error watching directory '%s', because it is already added.", watchdir);
+        if (!skip_lock) 
+            pthread_mutex_unlock(&ctx->mutex);
+        return false;
     }
 
-    const uint32_t inotify_mask = IN_MOVED_TO | IN_CREATE | IN_MOVED_FROM | IN_DELETE | IN_MODIFY;
+    const uint32_t inotify_mask = _dmon_inotify_mask(watch->actions, false);
     char fullpath[DMON_MAX_PATH];
     _dmon_strcpy(fullpath, sizeof(fullpath), watch->rootdir);
-    _dmon_strcat(fullpath, sizeof(fullpath), subdir.rootdir);
-    int wd = inotify_add_watch(watch->fd, fullpath, inotify_mask);
+    _dmon_strcat(fullpath, sizeof(fullpath), subdir);
+    int wd = inotify_add_watch(ctx->inotify_fd, fullpath, inotify_mask | IN_MASK_ADD);
     if (wd == -1) {
         _DMON_LOG_ERRORF("Error watching directory '%s'. (inotify_add_watch:err=%d)", watchdir, errno);
         if (!skip_lock)
-            pthread_mutex_unlock(&_dmon.mutex);
+            pthread_mutex_unlock(&ctx->mutex);
         return false;
     }
 
-    stb_sb_push(watch->subdirs, subdir);
-    stb_sb_push(watch->wds, wd);
+    _dmon_add_subdir(ctx, watch, subdir, wd);
+    _dmon_snapshot_read_dir(watch, subdir);
 
     if (!skip_lock)
-        pthread_mutex_unlock(&_dmon.mutex);
+        pthread_mutex_unlock(&ctx->mutex);
 
     return true;
 }
 
-DMON_API_IMPL bool dmon_watch_rm(dmon_watch_id id, const char* watchdir)
+DMON_API_IMPL bool dmon_context_watch_rm(dmon_context* ctx, dmon_watch_id id, const char* watchdir)
 {
-    DMON_ASSERT(id.id > 0 && id.id <= DMON_MAX_WATCHES);
+    DMON_ASSERT(id.id > 0);
 
-    bool skip_lock = pthread_self() == _dmon.thread_handle;
+    bool skip_lock = pthread_self() == ctx->thread_handle;
 
     if (!skip_lock)
-        pthread_mutex_lock(&_dmon.mutex);
+        pthread_mutex_lock(&ctx->mutex);
 
-    dmon__watch_state* watch = _dmon.watches[id.id - 1];
+    dmon__watch_state* watch = _dmon_get_watch(ctx, id);
+    if (watch == NULL) {
+        DMON_LOG_ERROR("Invalid watch id");
+        if (!skip_lock)
+            pthread_mutex_unlock(&ctx->mutex);
+        return false;
+    }
 
     char subdir[DMON_MAX_PATH];
     _dmon_strcpy(subdir, sizeof(subdir), watchdir);
@@ -132,32 +342,397 @@ DMON_API_IMPL bool dmon_watch_rm(dmon_watch_id id, const char* watchdir)
         subdir[dirlen + 1] = '\0';
     }
 
-    int i, c = stb_sb_count(watch->subdirs);
-    for (i = 0; i < c; i++) {
-        if (strcmp(watch->subdirs[i].rootdir, subdir) == 0) {
-            break;
-        }
-    }
-    if (i >= c) {
+    int n = _dmon_subdir_find(watch, subdir, (int)strlen(subdir), false);
+    if (n == -1 || watch->subdirs[n].wd < 0) {
         _DMON_LOG_ERRORF("Watch directory '%s' is not valid", watchdir);
         if (!skip_lock)
-            pthread_mutex_unlock(&_dmon.mutex);
+            pthread_mutex_unlock(&ctx->mutex);
+        return false;
+    }
+    _dmon_remove_subdir(ctx, watch, n);
+    _dmon_snapshot_remove_dir(&watch->snapshot, subdir);
+
+    if (!skip_lock)
+        pthread_mutex_unlock(&ctx->mutex);
+    return true;
+}
+
+DMON_API_IMPL dmon_watch_id dmon_context_watch_async(dmon_context* ctx, const char* rootdir,
+                                                     void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                      const char* dirname, const char* filename,
+                                                                      const char* oldname, void* user),
+                                                     uint32_t flags, void* user_data,
+                                                     void (*ready_cb)(dmon_watch_id watch_id, bool success, void* user),
+                                                     const dmon_watch_options* options)
+{
+    return _dmon_watch_async(ctx, rootdir, watch_cb, flags, user_data, ready_cb, options);
+}
+
+DMON_API_IMPL dmon_watch_id dmon_context_watch_batch(dmon_context* ctx, const char* rootdir,
+                                                     void (*batch_cb)(dmon_watch_id watch_id, const char* rootdir,
+                                                                      const dmon_event* events, int count, void* user),
+                                                     uint32_t flags, void* user_data, const dmon_watch_options* options)
+{
+    DMON_ASSERT(batch_cb);
+    return _dmon_watch(ctx, rootdir, NULL, batch_cb, flags, user_data, options);
+}
+
+DMON_API_IMPL dmon_watch_id dmon_context_watch_filtered(dmon_context* ctx, const char* rootdir,
+                                                        void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                         const char* dirname, const char* filename,
+                                                                         const char* oldname, void* user),
+                                                        uint32_t flags, void* user_data, const char* patterns)
+{
+    dmon_watch_options options;
+    memset(&options, 0x0, sizeof(options));
+    options.ignore = patterns;
+    return dmon_context_watch_ex(ctx, rootdir, watch_cb, flags, user_data, &options);
+}
+
+DMON_API_IMPL dmon_watch_id dmon_context_watch_ex(dmon_context* ctx, const char* rootdir,
+                                                  void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                   const char* dirname, const char* filename,
+                                                                   const char* oldname, void* user),
+                                                  uint32_t flags, void* user_data, const dmon_watch_options* options)
+{
+    DMON_ASSERT(watch_cb);
+    return _dmon_watch(ctx, rootdir, watch_cb, NULL, flags, user_data, options);
+}
+
+// dmon_stats only has uint64_t counters
+_DMON_PRIVATE void _dmon_copy_stats(dmon_stats* dst, const dmon_stats* src)
+{
+    const uint64_t* s = (const uint64_t*)src;
+    uint64_t* d = (uint64_t*)dst;
+    int i;
+    for (i = 0; i < (int)(sizeof(dmon_stats) / sizeof(uint64_t)); i++) {
+        d[i] = __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+    }
+}
+
+DMON_API_IMPL bool dmon_context_get_stats(dmon_context* ctx, dmon_watch_id id, dmon_stats* stats)
+{
+    DMON_ASSERT(ctx->initialized);
+    DMON_ASSERT(stats);
+
+    if (id.id == 0) {
+        _dmon_copy_stats(stats, &ctx->stats);
+        return true;
+    }
+
+    bool skip_lock = pthread_self() == ctx->thread_handle;
+
+    if (!skip_lock)
+        pthread_mutex_lock(&ctx->mutex);
+
+    dmon__watch_state* watch = _dmon_get_watch(ctx, id);
+    if (watch) {
+        _dmon_copy_stats(stats, &watch->stats);
+        int i;
+        for (i = 0; i < stb_sb_count(watch->subdirs); i++) {
+            stats->dirs_watched += watch->subdirs[i].wd >= 0 ? 1 : 0;
+        }
+        // callbacks that are called by the callback threads
+        if (watch->dispatch) {
+            stats->callback_ns += __atomic_load_n(&watch->dispatch->callback_ns, __ATOMIC_RELAXED);
+            stats->callback_max_ns = _dmon_max(stats->callback_max_ns,
+                                               __atomic_load_n(&watch->dispatch->callback_max_ns, __ATOMIC_RELAXED));
+        }
+    } else {
+        DMON_LOG_ERROR("Invalid watch id");
+    }
+
+    if (!skip_lock)
+        pthread_mutex_unlock(&ctx->mutex);
+    return watch != NULL;
+}
+
+DMON_API_IMPL bool dmon_context_watch_set_window(dmon_context* ctx, dmon_watch_id id, int min_ms, int max_ms)
+{
+    DMON_ASSERT(id.id > 0);
+    if (min_ms < 0 || min_ms > max_ms) {
+        return false;
+    }
+
+    bool skip_lock = pthread_self() == ctx->thread_handle;
+
+    if (!skip_lock)
+        pthread_mutex_lock(&ctx->mutex);
+
+    // takes effect from the next batch of events
+    dmon__watch_state* watch = _dmon_get_watch(ctx, id);
+    if (watch) {
+        watch->window_min = (uint64_t)min_ms * 1000000ull;
+        watch->window_max = (uint64_t)max_ms * 1000000ull;
+        watch->window = watch->window_min;
+    } else {
+        DMON_LOG_ERROR("Invalid watch id");
+    }
+
+    if (!skip_lock)
+        pthread_mutex_unlock(&ctx->mutex);
+    return watch != NULL;
+}
+
+DMON_API_IMPL dmon_watch_id dmon_context_watch_queue(dmon_context* ctx, const char* rootdir, uint32_t flags,
+                                                     const dmon_watch_options* options)
+{
+    return _dmon_watch(ctx, rootdir, NULL, NULL, flags, NULL, options);
+}
+
+DMON_API_IMPL int dmon_context_poll_events(dmon_context* ctx, dmon_queued_event* events, int max)
+{
+    DMON_ASSERT(ctx->initialized);
+    DMON_ASSERT(events || max == 0);
+    return _dmon_queue_pop(ctx, events, max);
+}
+
+DMON_API_IMPL int dmon_context_wait_events(dmon_context* ctx, dmon_queued_event* events, int max, int timeout_ms)
+{
+    DMON_ASSERT(ctx->initialized);
+    DMON_ASSERT(events && max > 0);
+    return _dmon_queue_wait(ctx, events, max, timeout_ms);
+}
+
+DMON_API_IMPL void dmon_context_get_queue_info(dmon_context* ctx, dmon_queue_info* info)
+{
+    DMON_ASSERT(ctx->initialized);
+    DMON_ASSERT(info);
+    info->capacity = DMON_QUEUE_SIZE;
+    info->count = _dmon_queue_count(ctx);
+    info->dropped = __atomic_load_n(&ctx->queue.dropped, __ATOMIC_RELAXED);
+}
+
+DMON_API_IMPL bool dmon_context_watch_save(dmon_context* ctx, dmon_watch_id id, const char* indexfile)
+{
+    DMON_ASSERT(id.id > 0);
+    DMON_ASSERT(indexfile);
+
+    bool skip_lock = pthread_self() == ctx->thread_handle;
+
+    if (!skip_lock)
+        pthread_mutex_lock(&ctx->mutex);
+
+    dmon__watch_state* watch = _dmon_get_watch(ctx, id);
+    bool r = false;
+    if (watch == NULL) {
+        DMON_LOG_ERROR("Invalid watch id");
+    } else if (watch->fanotify) {
+        DMON_LOG_ERROR("Index files are not supported for fanotify watches");
+    } else if ((watch->watch_flags & DMON_WATCHFLAGS_SNAPSHOT) == 0) {
+        DMON_LOG_ERROR("Index files need DMON_WATCHFLAGS_SNAPSHOT");
+    } else {
+        r = _dmon_index_save(watch, indexfile);
+    }
+
+    if (!skip_lock)
+        pthread_mutex_unlock(&ctx->mutex);
+    return r;
+}
+
+DMON_API_IMPL dmon_watch_id dmon_context_watch_restore(dmon_context* ctx, const char* rootdir,
+                                                       void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                        const char* dirname, const char* filename,
+                                                                        const char* oldname, void* user),
+                                                       uint32_t flags, void* user_data, const char* indexfile,
+                                                       const dmon_watch_options* options)
+{
+    return _dmon_watch_restore(ctx, rootdir, watch_cb, flags, user_data, indexfile, options);
+}
+
+DMON_API_IMPL bool dmon_context_set_crawl_threads(dmon_context* ctx, int num_threads)
+{
+    if (num_threads < 1) {
         return false;
     }
-    inotify_rm_watch(watch->fd, watch->wds[i]);
 
-    /* Remove entry from subdirs and wds by swapping position with the last entry */
-    watch->subdirs[i] = stb_sb_last(watch->subdirs);
-    stb_sb_pop(watch->subdirs);
+    bool skip_lock = pthread_self() == ctx->thread_handle;
+
+    if (!skip_lock)
+        pthread_mutex_lock(&ctx->mutex);
 
-    watch->wds[i] = stb_sb_last(watch->wds);
-    stb_sb_pop(watch->wds);
+    // crawls that are already running keep their threads
+    ctx->crawl_threads = num_threads;
 
     if (!skip_lock)
-        pthread_mutex_unlock(&_dmon.mutex);
+        pthread_mutex_unlock(&ctx->mutex);
     return true;
 }
-#endif  // DMON_OS_LINUX
+
+_DMON_PRIVATE void _dmon_entry_info(const dmon__snapshot_stat* st, dmon_entry_info* info)
+{
+    info->inode = st->inode;
+    info->size = st->has_stat ? st->size : -1;
+    info->mtime = st->has_stat ? st->mtime : -1;
+    info->is_dir = st->type == DT_DIR;
+}
+
+DMON_API_IMPL bool dmon_context_watch_stat(dmon_context* ctx, dmon_watch_id id, const char* filepath,
+                                           dmon_entry_info* info)
+{
+    DMON_ASSERT(id.id > 0);
+    DMON_ASSERT(info);
+
+    bool skip_lock = pthread_self() == ctx->thread_handle;
+
+    if (!skip_lock)
+        pthread_mutex_lock(&ctx->mutex);
+
+    dmon__watch_state* watch = _dmon_get_watch(ctx, id);
+    int n = watch && !watch->fanotify ? _dmon_snapshot_lookup(&watch->snapshot, filepath) : -1;
+    if (n != -1) {
+        _dmon_entry_info(&watch->snapshot.nodes[n].st, info);
+    }
+
+    if (!skip_lock)
+        pthread_mutex_unlock(&ctx->mutex);
+    return n != -1;
+}
+
+DMON_API_IMPL int dmon_context_watch_list(dmon_context* ctx, dmon_watch_id id, const char* dirpath,
+                                          void (*list_cb)(const char* filepath, const dmon_entry_info* info, void* user),
+                                          void* user)
+{
+    DMON_ASSERT(id.id > 0);
+    DMON_ASSERT(list_cb);
+
+    bool skip_lock = pthread_self() == ctx->thread_handle;
+
+    if (!skip_lock)
+        pthread_mutex_lock(&ctx->mutex);
+
+    dmon__watch_state* watch = _dmon_get_watch(ctx, id);
+    int dir = watch && !watch->fanotify ? _dmon_snapshot_lookup(&watch->snapshot, dirpath) : -1;
+    int count = -1;
+    if (dir != -1) {
+        const dmon__snapshot* snap = &watch->snapshot;
+        char filepath[DMON_MAX_PATH];
+        dmon_entry_info info;
+        int n;
+        count = 0;
+        for (n = snap->nodes[dir].first_child; n != -1; n = snap->nodes[n].next_sibling) {
+            if (_dmon_snapshot_path(snap, n, filepath, sizeof(filepath))) {
+                _dmon_entry_info(&snap->nodes[n].st, &info);
+                list_cb(filepath, &info, user);
+                ++count;
+            }
+        }
+    }
+
+    if (!skip_lock)
+        pthread_mutex_unlock(&ctx->mutex);
+    return count;
+}
+// the functions without a context work on the default one
+DMON_API_IMPL bool dmon_watch_add(dmon_watch_id id, const char* watchdir)
+{
+    return dmon_context_watch_add(&_dmon_default, id, watchdir);
+}
+
+DMON_API_IMPL bool dmon_watch_rm(dmon_watch_id id, const char* watchdir)
+{
+    return dmon_context_watch_rm(&_dmon_default, id, watchdir);
+}
+
+DMON_API_IMPL dmon_watch_id dmon_watch_async(const char* rootdir,
+                                             void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                              const char* dirname, const char* filename,
+                                                              const char* oldname, void* user),
+                                             uint32_t flags, void* user_data,
+                                             void (*ready_cb)(dmon_watch_id watch_id, bool success, void* user),
+                                             const dmon_watch_options* options)
+{
+    return dmon_context_watch_async(&_dmon_default, rootdir, watch_cb, flags, user_data, ready_cb, options);
+}
+
+DMON_API_IMPL dmon_watch_id dmon_watch_batch(const char* rootdir,
+                                             void (*batch_cb)(dmon_watch_id watch_id, const char* rootdir,
+                                                              const dmon_event* events, int count, void* user),
+                                             uint32_t flags, void* user_data, const dmon_watch_options* options)
+{
+    return dmon_context_watch_batch(&_dmon_default, rootdir, batch_cb, flags, user_data, options);
+}
+
+DMON_API_IMPL dmon_watch_id dmon_watch_filtered(const char* rootdir,
+                                                void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                 const char* dirname, const char* filename,
+                                                                 const char* oldname, void* user),
+                                                uint32_t flags, void* user_data, const char* patterns)
+{
+    return dmon_context_watch_filtered(&_dmon_default, rootdir, watch_cb, flags, user_data, patterns);
+}
+
+DMON_API_IMPL dmon_watch_id dmon_watch_ex(const char* rootdir,
+                                          void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                           const char* dirname, const char* filename,
+                                                           const char* oldname, void* user),
+                                          uint32_t flags, void* user_data, const dmon_watch_options* options)
+{
+    return dmon_context_watch_ex(&_dmon_default, rootdir, watch_cb, flags, user_data, options);
+}
+
+DMON_API_IMPL bool dmon_get_stats(dmon_watch_id id, dmon_stats* stats)
+{
+    return dmon_context_get_stats(&_dmon_default, id, stats);
+}
+
+DMON_API_IMPL bool dmon_watch_set_window(dmon_watch_id id, int min_ms, int max_ms)
+{
+    return dmon_context_watch_set_window(&_dmon_default, id, min_ms, max_ms);
+}
+
+DMON_API_IMPL dmon_watch_id dmon_watch_queue(const char* rootdir, uint32_t flags, const dmon_watch_options* options)
+{
+    return dmon_context_watch_queue(&_dmon_default, rootdir, flags, options);
+}
+
+DMON_API_IMPL int dmon_poll_events(dmon_queued_event* events, int max)
+{
+    return dmon_context_poll_events(&_dmon_default, events, max);
+}
+
+DMON_API_IMPL int dmon_wait_events(dmon_queued_event* events, int max, int timeout_ms)
+{
+    return dmon_context_wait_events(&_dmon_default, events, max, timeout_ms);
+}
+
+DMON_API_IMPL void dmon_get_queue_info(dmon_queue_info* info)
+{
+    dmon_context_get_queue_info(&_dmon_default, info);
+}
+
+DMON_API_IMPL bool dmon_watch_save(dmon_watch_id id, const char* indexfile)
+{
+    return dmon_context_watch_save(&_dmon_default, id, indexfile);
+}
+
+DMON_API_IMPL dmon_watch_id dmon_watch_restore(const char* rootdir,
+                                               void (*watch_cb)(dmon_watch_id watch_id, dmon_action action,
+                                                                const char* dirname, const char* filename,
+                                                                const char* oldname, void* user),
+                                               uint32_t flags, void* user_data, const char* indexfile,
+                                               const dmon_watch_options* options)
+{
+    return dmon_context_watch_restore(&_dmon_default, rootdir, watch_cb, flags, user_data, indexfile, options);
+}
+
+DMON_API_IMPL bool dmon_set_crawl_threads(int num_threads)
+{
+    return dmon_context_set_crawl_threads(&_dmon_default, num_threads);
+}
+
+DMON_API_IMPL bool dmon_watch_stat(dmon_watch_id id, const char* filepath, dmon_entry_info* info)
+{
+    return dmon_context_watch_stat(&_dmon_default, id, filepath, info);
+}
+
+DMON_API_IMPL int dmon_watch_list(dmon_watch_id id, const char* dirpath,
+                                  void (*list_cb)(const char* filepath, const dmon_entry_info* info, void* user),
+                                  void* user)
+{
+    return dmon_context_watch_list(&_dmon_default, id, dirpath, list_cb, user);
+}
+#endif  // DMON_OS_INOTIFY
 #endif // DMON_IMPL
 
 #endif // __DMON_EXTRA_H__
@@ -0,0 +1,200 @@
+#ifndef __DMON_TEST_UTIL_H__
+#define __DMON_TEST_UTIL_H__
+
+//
+// Helpers of the tests: the events of the watches are written to logs as text lines, "ACTION filepath" or
+// "MOVE filepath <- oldfilepath", and checked against the expected lines after the events settle
+//
+// include after dmon.h, inotify backend only
+//
+
+#ifndef TEST_SETTLE_MS
+#   define TEST_SETTLE_MS 300     // no events for this long means that they are all delivered
+#endif
+
+typedef struct test_log {
+    char text[65536];
+    int len;
+    int num_events;
+    int num_creates;
+} test_log;
+
+static pthread_mutex_t test_mutex = PTHREAD_MUTEX_INITIALIZER;
+static test_log test_logs[2];   // the callback writes to the log in user, or to the first one
+static int test_failed;
+
+_DMON_PRIVATE const char* test_action_str(dmon_action action)
+{
+    switch (action) {
+    case DMON_ACTION_CREATE: return "CREATE";
+    case DMON_ACTION_DELETE: return "DELETE";
+    case DMON_ACTION_MODIFY: return "MODIFY";
+    case DMON_ACTION_MOVE: return "MOVE";
+    default: return "OTHER";
+    }
+}
+
+_DMON_PRIVATE void test_callback(dmon_watch_id watch_id, dmon_action action, const char* rootdir,
+                                 const char* filepath, const char* oldfilepath, void* user)
+{
+    _DMON_UNUSED(watch_id);
+    _DMON_UNUSED(rootdir);
+
+    pthread_mutex_lock(&test_mutex);
+    test_log* log = user ? (test_log*)user : &test_logs[0];
+    if (oldfilepath) {
+        log->len += snprintf(log->text + log->len, sizeof(log->text) - log->len, "%s %s <- %s\n",
+                             test_action_str(action), filepath, oldfilepath);
+    } else {
+        log->len += snprintf(log->text + log->len, sizeof(log->text) - log->len, "%s %s\n",
+                             test_action_str(action), filepath);
+    }
+    log->len = log->len < (int)sizeof(log->text) ? log->len : (int)sizeof(log->text) - 1;
+    ++log->num_events;
+    log->num_creates += action == DMON_ACTION_CREATE ? 1 : 0;
+    pthread_mutex_unlock(&test_mutex);
+}
+
+// waits until no events come to any of the logs for a while
+_DMON_PRIVATE void test_settle(void)
+{
+    int i, last = -1;
+    for (i = 0; i < 50; i++) {
+        usleep(TEST_SETTLE_MS * 1000);
+        pthread_mutex_lock(&test_mutex);
+        int count = test_logs[0].num_events + test_logs[1].num_events;
+        pthread_mutex_unlock(&test_mutex);
+        if (count == last) {
+            break;
+        }
+        last = count;
+    }
+}
+
+// for the events that are not checked
+_DMON_PRIVATE void test_clear_logs(void)
+{
+    test_settle();
+    pthread_mutex_lock(&test_mutex);
+    memset(test_logs, 0x0, sizeof(test_logs));
+    pthread_mutex_unlock(&test_mutex);
+}
+
+_DMON_PRIVATE void test_check(const char* name, bool ok)
+{
+    printf("%s: %s\n", ok ? "ok" : "FAIL", name);
+    test_failed |= ok ? 0 : 1;
+}
+
+// compares the log with the expected lines and clears it, test_mutex must be locked
+_DMON_PRIVATE void test_compare_log(test_log* log, const char* name, const char* expected)
+{
+    if (strcmp(log->text, expected) != 0) {
+        printf("FAIL: %s\nexpected:\n%sgot:\n%s", name, expected, log->text);
+        test_failed = 1;
+    } else {
+        printf("ok: %s\n", name);
+    }
+    memset(log, 0x0, sizeof(*log));
+}
+
+_DMON_PRIVATE void test_expect(const char* name, const char* expected)
+{
+    test_settle();
+    pthread_mutex_lock(&test_mutex);
+    test_compare_log(&test_logs[0], name, expected);
+    pthread_mutex_unlock(&test_mutex);
+}
+
+_DMON_PRIVATE int test_compare_lines(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+// for events that come in any order, like the ones of the directories that are checked by threads
+_DMON_PRIVATE void test_expect_sorted(const char* name, const char* expected)
+{
+    test_settle();
+    pthread_mutex_lock(&test_mutex);
+    test_log* log = &test_logs[0];
+    char* lines[256];
+    int num_lines = 0;
+    char* line;
+    for (line = strtok(log->text, "\n"); line && num_lines < 256; line = strtok(NULL, "\n")) {
+        lines[num_lines++] = line;
+    }
+    qsort(lines, num_lines, sizeof(char*), test_compare_lines);
+
+    static test_log sorted;
+    int i;
+    memset(&sorted, 0x0, sizeof(sorted));
+    for (i = 0; i < num_lines; i++) {
+        sorted.len += snprintf(sorted.text + sorted.len, sizeof(sorted.text) - sorted.len, "%s\n", lines[i]);
+    }
+    memset(log, 0x0, sizeof(*log));
+    test_compare_log(&sorted, name, expected);
+    pthread_mutex_unlock(&test_mutex);
+}
+
+_DMON_PRIVATE void test_path(char* path, const char* rootdir, const char* filepath)
+{
+    snprintf(path, DMON_MAX_PATH, "%s/%s", rootdir, filepath);
+}
+
+_DMON_PRIVATE void test_write(const char* rootdir, const char* filepath, const char* text)
+{
+    char path[DMON_MAX_PATH];
+    test_path(path, rootdir, filepath);
+    FILE* f = fopen(path, "a");
+    if (f) {
+        fputs(text, f);
+        fclose(f);
+    }
+}
+
+_DMON_PRIVATE void test_mkdir(const char* rootdir, const char* dirpath)
+{
+    char path[DMON_MAX_PATH];
+    test_path(path, rootdir, dirpath);
+    mkdir(path, 0755);
+}
+
+// removes a file or an empty directory
+_DMON_PRIVATE void test_remove(const char* rootdir, const char* filepath)
+{
+    char path[DMON_MAX_PATH];
+    test_path(path, rootdir, filepath);
+    remove(path);
+}
+
+_DMON_PRIVATE void test_rename(const char* rootdir, const char* oldpath, const char* newpath)
+{
+    char path[DMON_MAX_PATH], old[DMON_MAX_PATH];
+    test_path(old, rootdir, oldpath);
+    test_path(path, rootdir, newpath);
+    rename(old, path);
+}
+
+_DMON_PRIVATE void test_remove_tree(const char* dirname)
+{
+    char path[DMON_MAX_PATH];
+    struct dirent* entry;
+    DIR* dir = opendir(dirname);
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
+        if (entry->d_type == DT_DIR) {
+            test_remove_tree(path);
+        } else {
+            unlink(path);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    rmdir(dirname);
+}
+
+#endif // __DMON_TEST_UTIL_H__
@@ -0,0 +1,142 @@
+#include <stdio.h>
+
+#define DMON_IMPL
+#include "dmon.h"
+
+// creates files while dmon_watch_async is still adding the directories of the tree, every file must be reported as
+// created, and the files that exist before the watch must not be, even if they are written meanwhile
+
+#if DMON_OS_INOTIFY
+#include "dmon_extra.h"
+#include "test_util.h"
+
+#define TEST_FANOUT 8
+#define TEST_NUM_DIRS (TEST_FANOUT * TEST_FANOUT * TEST_FANOUT)
+#define TEST_NUM_FILES 256
+
+static const char* test_rootdir;
+static int test_ready;
+static int test_success;
+
+static void test_ready_callback(dmon_watch_id watch_id, bool success, void* user)
+{
+    _DMON_UNUSED(watch_id);
+    _DMON_UNUSED(user);
+    pthread_mutex_lock(&test_mutex);
+    test_ready = 1;
+    test_success = success ? 1 : 0;
+    pthread_mutex_unlock(&test_mutex);
+}
+
+static void test_leaf(char* dirpath, int index)
+{
+    snprintf(dirpath, DMON_MAX_PATH, "%d/%d/%d", index / (TEST_FANOUT * TEST_FANOUT), (index / TEST_FANOUT) % TEST_FANOUT,
+             index % TEST_FANOUT);
+}
+
+// the directories are crawled in order, the files are created from the last one, so some of them are created before
+// their directory is added to the watch and some after
+static void* test_writer_thread(void* arg)
+{
+    _DMON_UNUSED(arg);
+    char dirpath[DMON_MAX_PATH], filepath[DMON_MAX_PATH];
+    int i;
+    for (i = 0; i < TEST_NUM_FILES; i++) {
+        int leaf = TEST_NUM_DIRS - 1 - (i * (TEST_NUM_DIRS / TEST_NUM_FILES));
+        test_leaf(dirpath, leaf);
+        snprintf(filepath, sizeof(filepath), "%s/new%d", dirpath, i);
+        test_write(test_rootdir, filepath, "1");
+        snprintf(filepath, sizeof(filepath), "%s/old", dirpath);
+        test_write(test_rootdir, filepath, "1");
+    }
+    return NULL;
+}
+
+// file systems that don't keep the birth time report written files as created, if their directory is changed
+static bool test_has_btime(const char* rootdir)
+{
+    char path[DMON_MAX_PATH];
+    struct timespec t1, t2;
+    test_write(rootdir, "probe", "0");
+    test_path(path, rootdir, "probe");
+    bool ok = _dmon_created_time(AT_FDCWD, path, &t1);
+    usleep(50000);
+    chmod(path, 0600);
+    ok = ok && _dmon_created_time(AT_FDCWD, path, &t2) && t1.tv_sec == t2.tv_sec && t1.tv_nsec == t2.tv_nsec;
+    unlink(path);
+    return ok;
+}
+
+int main(void)
+{
+    char rootdir[] = "/tmp/dmon_test_XXXXXX";
+    if (mkdtemp(rootdir) == NULL) {
+        puts("could not create temp directory");
+        return 1;
+    }
+    test_rootdir = rootdir;
+    bool has_btime = test_has_btime(rootdir);
+
+    char dirpath[DMON_MAX_PATH], filepath[DMON_MAX_PATH];
+    int i;
+    for (i = 0; i < TEST_NUM_DIRS; i++) {
+        snprintf(dirpath, sizeof(dirpath), "%d", i / (TEST_FANOUT * TEST_FANOUT));
+        test_mkdir(rootdir, dirpath);
+        snprintf(dirpath, sizeof(dirpath), "%d/%d", i / (TEST_FANOUT * TEST_FANOUT), (i / TEST_FANOUT) % TEST_FANOUT);
+        test_mkdir(rootdir, dirpath);
+        test_leaf(dirpath, i);
+        test_mkdir(rootdir, dirpath);
+        snprintf(filepath, sizeof(filepath), "%s/old", dirpath);
+        test_write(rootdir, filepath, "0");
+    }
+
+    // changes of the files are only known after the watch is requested
+    sleep(1);
+
+    dmon_init();
+    pthread_t thread;
+    dmon_watch_id id = dmon_watch_async(rootdir, test_callback, DMON_WATCHFLAGS_RECURSIVE, NULL, test_ready_callback,
+                                        NULL);
+    pthread_create(&thread, NULL, test_writer_thread, NULL);
+    pthread_join(thread, NULL);
+    for (i = 0; i < 100 && !test_ready; i++) {
+        usleep(100000);
+    }
+    test_settle();
+
+    pthread_mutex_lock(&test_mutex);
+    test_check("async watch is ready", id.id != 0 && test_ready && test_success);
+    int missing = 0, created_old = 0;
+    char line[DMON_MAX_PATH];
+    for (i = 0; i < TEST_NUM_FILES; i++) {
+        int leaf = TEST_NUM_DIRS - 1 - (i * (TEST_NUM_DIRS / TEST_NUM_FILES));
+        test_leaf(dirpath, leaf);
+        snprintf(line, sizeof(line), "CREATE %s/new%d\n", dirpath, i);
+        missing += strstr(test_logs[0].text, line) == NULL ? 1 : 0;
+        snprintf(line, sizeof(line), "CREATE %s/old\n", dirpath);
+        created_old += strstr(test_logs[0].text, line) != NULL ? 1 : 0;
+    }
+    if (missing > 0) {
+        printf("%d files are not reported\n", missing);
+    }
+    test_check("files created during the crawl are reported", missing == 0);
+    if (has_btime) {
+        test_check("written files are not reported as created", created_old == 0);
+    } else {
+        printf("skipped: the file system doesn't keep the birth time, %d written files are reported as created\n",
+               created_old);
+    }
+    memset(test_logs, 0x0, sizeof(test_logs));
+    pthread_mutex_unlock(&test_mutex);
+
+    dmon_deinit();
+    test_remove_tree(rootdir);
+    return test_failed;
+}
+#else
+int main(void)
+{
+    puts("skipped: inotify backend only");
+    return 0;
+}
+#endif // DMON_OS_INOTIFY
@@ -0,0 +1,141 @@
+#include <stdio.h>
+
+#define DMON_IMPL
+#include "dmon.h"
+
+// checks the pool of DMON_CALLBACK_THREADS: the events of every watch come one at a time and in order, while the
+// watches are called in parallel, and dmon_unwatch returns after the running callback of the watch is done
+
+#if DMON_OS_INOTIFY && DMON_CALLBACK_THREADS > 0
+#include "test_util.h"
+
+#define TEST_NUM_WATCHES 4
+#define TEST_NUM_FILES 50
+
+typedef struct test_watch {
+    test_log log;
+    int inside;     // callbacks of the watch that are running now
+    int overlaps;   // callbacks that are called while another one of the same watch is running
+} test_watch;
+
+static test_watch test_watches[TEST_NUM_WATCHES];
+static int test_slow_entered;
+static int test_slow_finished;
+
+static void test_order_callback(dmon_watch_id watch_id, dmon_action action, const char* rootdir,
+                                const char* filepath, const char* oldfilepath, void* user)
+{
+    test_watch* w = (test_watch*)user;
+    if (__atomic_fetch_add(&w->inside, 1, __ATOMIC_SEQ_CST) != 0) {
+        __atomic_fetch_add(&w->overlaps, 1, __ATOMIC_SEQ_CST);
+    }
+    usleep(1000);   // gives the other watches the time to be called meanwhile
+    test_callback(watch_id, action, rootdir, filepath, oldfilepath, &w->log);
+    __atomic_fetch_sub(&w->inside, 1, __ATOMIC_SEQ_CST);
+}
+
+static void test_slow_callback(dmon_watch_id watch_id, dmon_action action, const char* rootdir,
+                               const char* filepath, const char* oldfilepath, void* user)
+{
+    _DMON_UNUSED(watch_id);
+    _DMON_UNUSED(action);
+    _DMON_UNUSED(rootdir);
+    _DMON_UNUSED(filepath);
+    _DMON_UNUSED(oldfilepath);
+    _DMON_UNUSED(user);
+    if (__atomic_exchange_n(&test_slow_entered, 1, __ATOMIC_SEQ_CST) == 0) {
+        usleep(500000);
+        __atomic_store_n(&test_slow_finished, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// creates the files of all the watches in turns, so their events are mixed in the inotify queue
+static void test_create_files(char rootdirs[][32])
+{
+    char path[DMON_MAX_PATH];
+    int i, k;
+    for (i = 0; i < TEST_NUM_FILES; i++) {
+        for (k = 0; k < TEST_NUM_WATCHES; k++) {
+            snprintf(path, sizeof(path), "%s/f%02d", rootdirs[k], i);
+            FILE* f = fopen(path, "w");
+            if (f) {
+                fclose(f);
+            }
+        }
+    }
+}
+
+static bool test_all_delivered(void)
+{
+    int k;
+    bool done = true;
+    pthread_mutex_lock(&test_mutex);
+    for (k = 0; k < TEST_NUM_WATCHES; k++) {
+        done = done && test_watches[k].log.num_events >= TEST_NUM_FILES;
+    }
+    pthread_mutex_unlock(&test_mutex);
+    return done;
+}
+
+int main(void)
+{
+    char rootdirs[TEST_NUM_WATCHES + 1][32];
+    int i, k;
+    for (k = 0; k <= TEST_NUM_WATCHES; k++) {
+        strcpy(rootdirs[k], "/tmp/dmon_test_XXXXXX");
+        if (mkdtemp(rootdirs[k]) == NULL) {
+            puts("could not create temp directory");
+            return 1;
+        }
+    }
+
+    dmon_init();
+    dmon_watch_id ids[TEST_NUM_WATCHES];
+    for (k = 0; k < TEST_NUM_WATCHES; k++) {
+        ids[k] = dmon_watch(rootdirs[k], test_order_callback, 0, &test_watches[k]);
+        test_check("watch", ids[k].id != 0);
+    }
+
+    test_create_files(rootdirs);
+    for (i = 0; i < 100 && !test_all_delivered(); i++) {
+        usleep(100000);
+    }
+    test_settle();
+
+    char expected[TEST_NUM_FILES * 16];
+    int len = 0;
+    for (i = 0; i < TEST_NUM_FILES; i++) {
+        len += snprintf(expected + len, sizeof(expected) - len, "CREATE f%02d\n", i);
+    }
+    pthread_mutex_lock(&test_mutex);
+    int overlaps = 0;
+    for (k = 0; k < TEST_NUM_WATCHES; k++) {
+        overlaps += test_watches[k].overlaps;
+        test_compare_log(&test_watches[k].log, "events of the watch come in order", expected);
+    }
+    pthread_mutex_unlock(&test_mutex);
+    test_check("callbacks of a watch are not called in parallel", overlaps == 0);
+
+    // the callback is running when the watch is removed
+    dmon_watch_id slow_id = dmon_watch(rootdirs[TEST_NUM_WATCHES], test_slow_callback, 0, NULL);
+    test_write(rootdirs[TEST_NUM_WATCHES], "slow", "1");
+    for (i = 0; i < 100 && !__atomic_load_n(&test_slow_entered, __ATOMIC_SEQ_CST); i++) {
+        usleep(10000);
+    }
+    test_check("slow callback is called", __atomic_load_n(&test_slow_entered, __ATOMIC_SEQ_CST) == 1);
+    dmon_unwatch(slow_id);
+    test_check("unwatch waits for the running callback", __atomic_load_n(&test_slow_finished, __ATOMIC_SEQ_CST) == 1);
+
+    dmon_deinit();
+    for (k = 0; k <= TEST_NUM_WATCHES; k++) {
+        test_remove_tree(rootdirs[k]);
+    }
+    return test_failed;
+}
+#else
+int main(void)
+{
+    puts("skipped: inotify backend with DMON_CALLBACK_THREADS only");
+    return 0;
+}
+#endif // DMON_OS_INOTIFY && DMON_CALLBACK_THREADS > 0
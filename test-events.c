@@ -0,0 +1,188 @@
+#include <stdio.h>
+
+#define DMON_IMPL
+#include "dmon.h"
+
+// checks how the events of a batch are merged: modifications of the same file, create + modify, temp files that
+// are renamed over a file and moves that are paired by their cookie
+
+#if DMON_OS_INOTIFY
+#include "dmon_extra.h"
+#include "test_util.h"
+
+// two moves of different watches whose cookies collide in the move tables, both must be found
+static void test_move_collision(void)
+{
+    static dmon__state ctx;
+    dmon__inotify_event ev;
+    memset(&ev, 0x0, sizeof(ev));
+    ev.mask = IN_MOVED_FROM;
+    ev.cookie = 1234;
+    ev.watch_id.id = 1;
+    stb_sb_push(ctx.events, ev);
+    ev.cookie = 1234 ^ _dmon_hash_u32(1) ^ _dmon_hash_u32(2);
+    ev.watch_id.id = 2;
+    stb_sb_push(ctx.events, ev);
+    test_check("colliding move keys", _dmon_move_key(&ctx.events[0]) == _dmon_move_key(&ctx.events[1]));
+
+    _dmon_add_move(&ctx, &ctx.moved_from_tbl, 0);
+    _dmon_add_move(&ctx, &ctx.moved_from_tbl, 1);
+    ev.cookie = 1234;
+    ev.watch_id.id = 2;
+    test_check("colliding moves are both found", _dmon_find_move(&ctx, &ctx.moved_from_tbl, &ctx.events[0]) == 0 &&
+                                                 _dmon_find_move(&ctx, &ctx.moved_from_tbl, &ctx.events[1]) == 1 &&
+                                                 _dmon_find_move(&ctx, &ctx.moved_from_tbl, &ev) == -1);
+
+    stb_sb_free(ctx.events);
+    stb_sb_free(ctx.movekeys);
+    _dmon_hashtbl_free(&ctx.moved_from_tbl);
+}
+
+static int test_dirs_watched(dmon_watch_id id)
+{
+    dmon_stats stats;
+    return dmon_get_stats(id, &stats) ? (int)stats.dirs_watched : -1;
+}
+
+// directories that are deleted, or moved out of the watch, give their inotify watches back. the ones that are moved
+// in are watched again
+static void test_lifecycle(const char* rootdir, dmon_watch_id id)
+{
+    char outdir[] = "/tmp/dmon_test_XXXXXX";
+    if (mkdtemp(outdir) == NULL) {
+        puts("could not create temp directory");
+        test_failed = 1;
+        return;
+    }
+    int count = test_dirs_watched(id);
+
+    int i;
+    for (i = 0; i < 50; i++) {
+        test_mkdir(rootdir, "churn");
+        test_mkdir(rootdir, "churn/a");
+        test_mkdir(rootdir, "churn/a/b");
+        test_remove(rootdir, "churn/a/b");
+        test_remove(rootdir, "churn/a");
+        test_remove(rootdir, "churn");
+    }
+    test_clear_logs();
+    test_check("deleted directories are not watched", test_dirs_watched(id) == count);
+
+    test_mkdir(rootdir, "away");
+    test_mkdir(rootdir, "away/sub");
+    test_mkdir(rootdir, "away/sub/deep");
+    test_expect("new directories", "CREATE away\nCREATE away/sub\nCREATE away/sub/deep\n");
+    test_check("new directories are watched", test_dirs_watched(id) == count + 3);
+
+    char path[DMON_MAX_PATH], outpath[DMON_MAX_PATH];
+    test_path(path, rootdir, "away");
+    test_path(outpath, outdir, "away");
+    rename(path, outpath);
+    test_expect("directory moved out is deleted", "DELETE away\n");
+    test_check("directories moved out are not watched", test_dirs_watched(id) == count);
+    test_write(outdir, "away/sub/file", "1");
+    test_expect("events out of the watch are not reported", "");
+
+    // the contents of the directory are reported as created, in the order they are read
+    rename(outpath, path);
+    test_expect_sorted("directory moved in is created with it's contents",
+                       "CREATE away\n"
+                       "CREATE away/sub\n"
+                       "CREATE away/sub/deep\n"
+                       "CREATE away/sub/file\n");
+    test_check("directories moved in are watched", test_dirs_watched(id) == count + 3);
+    test_write(rootdir, "away/sub/deep/back", "1");
+    test_expect("events of a directory that is moved back in", "CREATE away/sub/deep/back\n");
+
+    test_remove_tree(outdir);
+}
+
+int main(void)
+{
+    char rootdir[] = "/tmp/dmon_test_XXXXXX";
+    if (mkdtemp(rootdir) == NULL) {
+        puts("could not create temp directory");
+        return 1;
+    }
+    test_write(rootdir, "modified", "0");
+    test_write(rootdir, "replaced", "0");
+    test_write(rootdir, "moved", "0");
+
+    test_move_collision();
+
+    dmon_init();
+    dmon_watch_id id = dmon_watch(rootdir, test_callback, DMON_WATCHFLAGS_RECURSIVE, NULL);
+
+    test_write(rootdir, "modified", "1");
+    test_write(rootdir, "modified", "2");
+    test_write(rootdir, "modified", "3");
+    test_expect("modifications are merged", "MODIFY modified\n");
+
+    test_write(rootdir, "created", "1");
+    test_write(rootdir, "created", "2");
+    test_expect("create + modify is a create", "CREATE created\n");
+
+    test_write(rootdir, "replaced.tmp", "1");
+    test_rename(rootdir, "replaced.tmp", "replaced");
+    test_expect("temp file renamed over a file is a modify", "MODIFY replaced\n");
+
+    test_rename(rootdir, "moved", "moved2");
+    test_expect("moves are paired by cookie", "MOVE moved2 <- moved\n");
+
+    test_mkdir(rootdir, "dir");
+    test_expect("directory create", "CREATE dir\n");
+    test_write(rootdir, "dir/file", "1");
+    test_expect("create in a new directory", "CREATE dir/file\n");
+    test_rename(rootdir, "dir", "dir2");
+    test_write(rootdir, "dir2/file", "2");
+    test_expect("events right after a directory move have the new path", "MOVE dir2 <- dir\nMODIFY dir2/file\n");
+
+    // only the renamed directory is changed, the directories under it get the new path from it
+    test_mkdir(rootdir, "a");
+    test_mkdir(rootdir, "a/b");
+    test_mkdir(rootdir, "a/b/c");
+    test_expect("nested directories create", "CREATE a\nCREATE a/b\nCREATE a/b/c\n");
+    test_rename(rootdir, "a", "z");
+    test_write(rootdir, "z/b/c/file", "1");
+    test_expect("events under a renamed directory have the new path", "MOVE z <- a\nCREATE z/b/c/file\n");
+
+    // a large batch, like a checkout: every file is created and written twice. the writes can take more than a
+    // window, so the second write may come as a modify in the next batch, but every file is created once
+    int i;
+    char name[64];
+    for (i = 0; i < 2000; i++) {
+        snprintf(name, sizeof(name), "dir2/many%d", i);
+        test_write(rootdir, name, "1");
+        test_write(rootdir, name, "2");
+    }
+    test_settle();
+    pthread_mutex_lock(&test_mutex);
+    int num_creates = test_logs[0].num_creates;
+    pthread_mutex_unlock(&test_mutex);
+    if (num_creates != 2000) {
+        printf("large batch: %d creates\n", num_creates);
+    }
+    test_check("large batch", num_creates == 2000);
+    test_clear_logs();
+
+    test_lifecycle(rootdir, id);
+
+    // the slot of the removed watch is reused, the old id is stale and must not remove the new watch
+    dmon_unwatch(id);
+    dmon_watch_id id2 = dmon_watch(rootdir, test_callback, DMON_WATCHFLAGS_RECURSIVE, NULL);
+    test_check("slot is reused with a new id", id2.id != id.id && (id2.id & 0xffff) == (id.id & 0xffff));
+    dmon_unwatch(id);
+    test_write(rootdir, "stale", "1");
+    test_expect("stale ids are ignored", "CREATE stale\n");
+
+    dmon_deinit();
+    test_remove_tree(rootdir);
+    return test_failed;
+}
+#else
+int main(void)
+{
+    puts("skipped: inotify backend only");
+    return 0;
+}
+#endif // DMON_OS_INOTIFY
@@ -0,0 +1,146 @@
+#include <stdio.h>
+
+#define DMON_IMPL
+#include "dmon.h"
+
+// matches paths with the compiled ignore patterns of dmon_watch_filtered, they should follow .gitignore
+
+#if DMON_OS_INOTIFY
+#include "dmon_extra.h"
+#include "test_util.h"
+
+typedef struct test_case {
+    const char* patterns;
+    const char* path;       // relative to rootdir
+    bool is_dir;
+    bool ignored;
+} test_case;
+
+static const test_case test_cases[] = {
+    { "*.o", "a.o", false, true },
+    { "*.o", "src/a.o", false, true },
+    { "*.o", "a.c", false, false },
+    { "# comment\n\nfoo", "foo", false, true },
+    { "# comment\n\nfoo", "# comment", false, false },
+    { "foo  ", "foo", false, true },
+
+    // '!' includes again, the last match wins, but nothing under an excluded directory
+    { "*.log\n!keep.log", "x.log", false, true },
+    { "*.log\n!keep.log", "keep.log", false, false },
+    { "*.log\n!keep.log", "d/keep.log", false, false },
+    { "!keep.log\n*.log", "keep.log", false, true },
+    { "out/\n!out/keep", "out/keep", false, true },
+
+    // trailing '/' only matches directories, in any directory
+    { "build/", "build", true, true },
+    { "build/", "build", false, false },
+    { "build/", "src/build", true, true },
+    { "build/", "build/x", false, true },
+    { "build/", "src/build/x/y", false, true },
+
+    // leading and middle '/' anchor the pattern to rootdir
+    { "/build", "build", false, true },
+    { "/build", "src/build", false, false },
+    { "doc/frotz", "doc/frotz", true, true },
+    { "doc/frotz", "a/doc/frotz", true, false },
+    { "doc/*.txt", "doc/a.txt", false, true },
+    { "doc/*.txt", "doc/x/a.txt", false, false },
+
+    // "**/" at the start matches in any directory
+    { "**/foo", "foo", false, true },
+    { "**/foo", "a/b/foo", false, true },
+    { "**/a/b", "a/b", false, true },
+    { "**/a/b", "x/a/b", false, true },
+    { "**/a/b", "x/a/c", false, false },
+
+    // "/**" at the end matches everything inside, but not the directory itself
+    { "abc/**", "abc", true, false },
+    { "abc/**", "abc/x", false, true },
+    { "abc/**", "abc/x/y", false, true },
+    { "abc/**", "x/abc/y", false, false },
+
+    // "/**/" in the middle matches zero or more directories
+    { "a/**/b", "a/b", false, true },
+    { "a/**/b", "a/x/b", false, true },
+    { "a/**/b", "a/x/y/b", false, true },
+    { "a/**/b", "a/xb", false, false },
+    { "a/**/b", "x/a/b", false, false },
+
+    // classes, '?' and '*' don't match '/'
+    { "[!a-z].txt", "A.txt", false, true },
+    { "[!a-z].txt", "1.txt", false, true },
+    { "[!a-z].txt", "a.txt", false, false },
+    { "[a-c]?.md", "bx.md", false, true },
+    { "[a-c]?.md", "dx.md", false, false },
+    { "a/*", "a/b/c", false, true },
+    { "a?b", "a/b", false, false },
+
+    // escapes
+    { "\\#file", "#file", false, true },
+    { "#file", "#file", false, false },
+    { "\\!important", "!important", false, true },
+    { "trailing\\ ", "trailing ", false, true },
+    { "trailing\\ ", "trailing", false, false },
+    { "\\*", "*", false, true },
+    { "\\*", "x", false, false },
+};
+
+// excluded directories are not crawled, so they don't get an inotify watch
+static void test_pruned(void)
+{
+    char rootdir[] = "/tmp/dmon_test_XXXXXX";
+    if (mkdtemp(rootdir) == NULL) {
+        puts("could not create temp directory");
+        test_failed = 1;
+        return;
+    }
+    static const char* dirs[] = { "src", "src/node_modules", "src/node_modules/a", "node_modules", "lib" };
+    int i;
+    for (i = 0; i < (int)(sizeof(dirs) / sizeof(dirs[0])); i++) {
+        test_mkdir(rootdir, dirs[i]);
+    }
+
+    dmon_init();
+    dmon_watch_id id = dmon_watch_filtered(rootdir, test_callback, DMON_WATCHFLAGS_RECURSIVE, NULL, "node_modules/");
+    dmon_stats stats;
+    bool ok = dmon_get_stats(id, &stats) && stats.dirs_registered == 3;    // rootdir, src and lib
+    dmon_deinit();
+
+    test_remove_tree(rootdir);
+    test_check("excluded directories are not watched", ok);
+}
+
+int main(void)
+{
+    int i;
+    for (i = 0; i < (int)(sizeof(test_cases) / sizeof(test_cases[0])); i++) {
+        const test_case* tc = &test_cases[i];
+        dmon__ignore* ignore = _dmon_ignore_compile(tc->patterns);
+
+        // reldir of the entry has a trailing slash
+        char reldir[DMON_MAX_PATH];
+        const char* slash = strrchr(tc->path, '/');
+        int reldir_len = slash ? (int)(slash - tc->path) + 1 : 0;
+        memcpy(reldir, tc->path, reldir_len);
+        reldir[reldir_len] = '\0';
+
+        bool ignored = _dmon_ignored_path(ignore, reldir, tc->path + reldir_len, tc->is_dir);
+        if (ignored != tc->ignored) {
+            printf("FAIL: \"%s\" %s%s: expected %s\n", tc->patterns, tc->path, tc->is_dir ? "/" : "",
+                   tc->ignored ? "ignored" : "not ignored");
+            test_failed = 1;
+        }
+        _dmon_ignore_release(ignore);
+    }
+    printf("%d cases, %s\n", i, test_failed ? "FAILED" : "ok");
+
+    test_pruned();
+    return test_failed;
+}
+#else
+int main(void)
+{
+    puts("skipped: inotify backend only");
+    return 0;
+}
+#endif // DMON_OS_INOTIFY
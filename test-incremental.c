@@ -25,6 +25,21 @@ static void watch_callback(dmon_watch_id watch_id, dmon_action action, const cha
     case DMON_ACTION_MOVE:
         printf("MOVE: [%s]%s -> [%s]%s\n", rootdir, oldfilepath, rootdir, filepath);
         break;
+    case DMON_ACTION_OVERFLOW:
+        printf("OVERFLOW: [%s] events are lost, rescanning\n", rootdir);
+        break;
+    case DMON_ACTION_CLOSE_WRITE:
+        printf("CLOSE_WRITE: [%s]%s\n", rootdir, filepath);
+        break;
+    case DMON_ACTION_ATTRIB:
+        printf("ATTRIB: [%s]%s\n", rootdir, filepath);
+        break;
+    case DMON_ACTION_ROOT_DELETE:
+        printf("ROOT_DELETE: [%s]\n", rootdir);
+        break;
+    case DMON_ACTION_ROOT_MOVE:
+        printf("ROOT_MOVE: [%s]\n", rootdir);
+        break;
     }
 }
 
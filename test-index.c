@@ -0,0 +1,215 @@
+#include <stdio.h>
+
+// saving a watch without DMON_WATCHFLAGS_SNAPSHOT is an error that the test makes on purpose
+#define DMON_LOG_ERROR(s) puts(s)
+#define DMON_IMPL
+#include "dmon.h"
+
+// saves a watch to an index file, changes the tree while nothing is watching and checks that the restored watch
+// reports the changes. then checks that broken index files are rejected and the watch crawls the tree instead
+
+#if DMON_OS_INOTIFY
+#include "dmon_extra.h"
+#include "test_util.h"
+
+static char* test_read_file(const char* filepath, long* size)
+{
+    FILE* f = fopen(filepath, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* data = (char*)malloc(*size);
+    if (data && fread(data, 1, *size, f) != (size_t)*size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+static void test_write_file(const char* filepath, const char* data, long size)
+{
+    FILE* f = fopen(filepath, "wb");
+    if (f) {
+        fwrite(data, 1, size, f);
+        fclose(f);
+    }
+}
+
+// restores the watch from the broken index, it should be the same as a new watch: no events, and the files are known
+static void test_broken_index(const char* name, const char* rootdir, const char* indexfile, const char* data, long size)
+{
+    test_write_file(indexfile, data, size);
+    dmon_init();
+    dmon_watch_id id = dmon_watch_restore(rootdir, test_callback, DMON_WATCHFLAGS_RECURSIVE | DMON_WATCHFLAGS_SNAPSHOT,
+                                          NULL, indexfile, NULL);
+    dmon_entry_info info;
+    bool known = id.id != 0 && dmon_watch_stat(id, "dir/m2", &info) && !info.is_dir;
+    test_expect_sorted(name, "");
+    if (!known) {
+        printf("FAIL: %s, the tree is not crawled\n", name);
+        test_failed = 1;
+    }
+    dmon_deinit();
+}
+
+// the deepest directory doesn't fit in DMON_MAX_PATH, the restore skips it like the crawl does
+static void test_long_path(const char* indexfile)
+{
+    char rootdir[] = "/tmp/dmon_test_XXXXXX";
+    if (mkdtemp(rootdir) == NULL) {
+        puts("could not create temp directory");
+        test_failed = 1;
+        return;
+    }
+    char path[DMON_MAX_PATH * 2];
+    char name[51];
+    int i;
+    memset(name, 'x', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    strcpy(path, rootdir);
+    for (i = 0; i < 5; i++) {
+        strcat(path, "/");
+        strcat(path, name);
+        mkdir(path, 0755);
+    }
+
+    dmon_init();
+    uint32_t flags = DMON_WATCHFLAGS_RECURSIVE | DMON_WATCHFLAGS_SNAPSHOT;
+    dmon_watch_id id = dmon_watch(rootdir, test_callback, flags, NULL);
+    dmon_stats crawled, restored;
+    bool ok = dmon_get_stats(id, &crawled) && dmon_watch_save(id, indexfile);
+    dmon_deinit();
+
+    dmon_init();
+    id = dmon_watch_restore(rootdir, test_callback, flags, NULL, indexfile, NULL);
+    ok = ok && dmon_get_stats(id, &restored);
+    dmon_deinit();
+    test_check("too long paths are skipped by the restore", ok && crawled.dirs_skipped == 1 &&
+                                                           restored.dirs_skipped == 1 &&
+                                                           restored.dirs_registered == crawled.dirs_registered);
+
+    unlink(indexfile);
+    test_remove_tree(rootdir);
+}
+
+int main(void)
+{
+    char rootdir[] = "/tmp/dmon_test_XXXXXX";
+    if (mkdtemp(rootdir) == NULL) {
+        puts("could not create temp directory");
+        return 1;
+    }
+    char indexfile[DMON_MAX_PATH];
+    snprintf(indexfile, sizeof(indexfile), "%s.index", rootdir);
+    uint32_t flags = DMON_WATCHFLAGS_RECURSIVE | DMON_WATCHFLAGS_SNAPSHOT;
+
+    test_mkdir(rootdir, "dir");
+    test_mkdir(rootdir, "gone");
+    test_write(rootdir, "modified", "0");
+    test_write(rootdir, "deleted", "0");
+    test_write(rootdir, "moved", "0");
+    test_write(rootdir, "dir/kept", "0");
+
+    // entries that are modified within a second of the save are checked again anyway, the test wants them trusted
+    sleep(2);
+
+    dmon_init();
+    dmon_watch_id id = dmon_watch(rootdir, test_callback, DMON_WATCHFLAGS_RECURSIVE, NULL);
+    test_check("watches without DMON_WATCHFLAGS_SNAPSHOT are not saved", !dmon_watch_save(id, indexfile));
+    dmon_unwatch(id);
+    id = dmon_watch(rootdir, test_callback, flags, NULL);
+    test_check("save", dmon_watch_save(id, indexfile));
+    dmon_deinit();
+
+    // changes while nothing is watching
+    test_write(rootdir, "modified", "1");
+    test_remove(rootdir, "deleted");
+    test_write(rootdir, "dir/created", "0");
+    test_rename(rootdir, "moved", "dir/m2");
+    test_remove(rootdir, "gone");
+    test_mkdir(rootdir, "new");
+
+    dmon_init();
+    id = dmon_watch_restore(rootdir, test_callback, flags, NULL, indexfile, NULL);
+    test_check("restore", id.id != 0);
+    test_expect_sorted("changes since the save are reported",
+                "CREATE dir/created\n"
+                "CREATE new\n"
+                "DELETE deleted\n"
+                "DELETE gone\n"
+                "MODIFY modified\n"
+                "MOVE dir/m2 <- moved\n");
+    dmon_entry_info info;
+    test_check("restored snapshot", dmon_watch_stat(id, "dir/kept", &info) && info.size == 1 &&
+                                    !dmon_watch_stat(id, "deleted", &info));
+    test_write(rootdir, "new/live", "0");
+    test_expect_sorted("restored watch receives events", "CREATE new/live\n");
+    test_check("save the restored watch", dmon_watch_save(id, indexfile));
+    dmon_deinit();
+
+    long size = 0;
+    char* data = test_read_file(indexfile, &size);
+    test_check("read the index", data != NULL && size > (long)sizeof(dmon__index_header));
+    if (data) {
+        char* broken = (char*)malloc(size);
+        dmon__index_header* header = (dmon__index_header*)broken;
+        dmon__index_node* nodes = (dmon__index_node*)(broken + sizeof(dmon__index_header));
+        char* names = (char*)(nodes + header->num_nodes);
+
+        test_broken_index("truncated index", rootdir, indexfile, data, size / 2);
+
+        memcpy(broken, data, size);
+        header->num_nodes = 0xffffffff;
+        test_broken_index("too many nodes", rootdir, indexfile, broken, size);
+
+        memcpy(broken, data, size);
+        header->version += 1;
+        test_broken_index("other version", rootdir, indexfile, broken, size);
+
+        memcpy(broken, data, size);
+        nodes[0].first_child = 0;
+        test_broken_index("node that is it's own child", rootdir, indexfile, broken, size);
+
+        memcpy(broken, data, size);
+        nodes[1].name = header->names_size;
+        test_broken_index("name out of the file", rootdir, indexfile, broken, size);
+
+        memcpy(broken, data, size);
+        names = (char*)(nodes + header->num_nodes);
+        strcpy(names + nodes[1].name, "/");
+        test_broken_index("name with a slash", rootdir, indexfile, broken, size);
+
+        memcpy(broken, data, size);
+        strcpy(names + nodes[1].name, "..");
+        test_broken_index("name of the parent", rootdir, indexfile, broken, size);
+
+        memcpy(broken, data, size);
+        broken[size - 1] = 'x';
+        test_broken_index("names without terminator", rootdir, indexfile, broken, size);
+
+        free(broken);
+        free(data);
+    }
+
+    unlink(indexfile);
+    dmon_init();
+    id = dmon_watch_restore(rootdir, test_callback, flags, NULL, indexfile, NULL);
+    test_check("missing index", id.id != 0 && dmon_watch_stat(id, "dir/m2", &info));
+    dmon_deinit();
+
+    test_long_path(indexfile);
+
+    test_remove_tree(rootdir);
+    return test_failed;
+}
+#else
+int main(void)
+{
+    puts("skipped: inotify backend only");
+    return 0;
+}
+#endif // DMON_OS_INOTIFY
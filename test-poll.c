@@ -0,0 +1,88 @@
+#include <stdio.h>
+
+// the checks are made more often than the default, so the test doesn't wait too long. the events have settled
+// when a few checks find nothing
+#define DMON_POLL_INTERVAL 200
+#define TEST_SETTLE_MS (DMON_POLL_INTERVAL * 3)
+#define DMON_IMPL
+#include "dmon.h"
+
+// watches the same directory with inotify and with DMON_WATCHFLAGS_POLL, and checks that both report the same
+// actions: modify, create, delete, and moves, which the poll watch pairs by the inode
+
+#if DMON_OS_INOTIFY
+#include "test_util.h"
+
+// the same events are expected from both watches
+static void test_expect_both(const char* name, const char* expected)
+{
+    test_settle();
+    pthread_mutex_lock(&test_mutex);
+    char fullname[128];
+    snprintf(fullname, sizeof(fullname), "%s (inotify)", name);
+    test_compare_log(&test_logs[0], fullname, expected);
+    snprintf(fullname, sizeof(fullname), "%s (poll)", name);
+    test_compare_log(&test_logs[1], fullname, expected);
+    pthread_mutex_unlock(&test_mutex);
+}
+
+int main(void)
+{
+    char rootdir[] = "/tmp/dmon_test_XXXXXX";
+    if (mkdtemp(rootdir) == NULL) {
+        puts("could not create temp directory");
+        return 1;
+    }
+    test_mkdir(rootdir, "dir");
+    test_write(rootdir, "modified", "0");
+    test_write(rootdir, "deleted", "0");
+    test_write(rootdir, "moved", "0");
+    test_write(rootdir, "dir/deep", "0");
+
+    dmon_init();
+    dmon_watch(rootdir, test_callback, DMON_WATCHFLAGS_RECURSIVE, &test_logs[0]);
+    dmon_watch(rootdir, test_callback, DMON_WATCHFLAGS_RECURSIVE | DMON_WATCHFLAGS_POLL, &test_logs[1]);
+
+    test_write(rootdir, "modified", "1");
+    test_expect_both("modify", "MODIFY modified\n");
+
+    test_write(rootdir, "created", "0");
+    test_expect_both("create", "CREATE created\n");
+
+    test_remove(rootdir, "deleted");
+    test_expect_both("delete", "DELETE deleted\n");
+
+    test_rename(rootdir, "moved", "moved2");
+    test_expect_both("move", "MOVE moved2 <- moved\n");
+
+    test_write(rootdir, "dir/deep", "1");
+    test_expect_both("modify in a sub-directory", "MODIFY dir/deep\n");
+
+    test_rename(rootdir, "dir/deep", "deep2");
+    test_expect_both("move between directories", "MOVE deep2 <- dir/deep\n");
+
+    // a new file takes the inode of a deleted one, it's not a move
+    test_remove(rootdir, "moved2");
+    test_write(rootdir, "dir/replacement", "0");
+    test_settle();
+    pthread_mutex_lock(&test_mutex);
+    if (strstr(test_logs[1].text, "MOVE") != NULL) {
+        printf("FAIL: a reused inode is reported as a move (poll)\n%s", test_logs[1].text);
+        test_failed = 1;
+    } else {
+        puts("ok: reused inode (poll)");
+    }
+    memset(test_logs, 0x0, sizeof(test_logs));
+    pthread_mutex_unlock(&test_mutex);
+
+    dmon_deinit();
+    test_remove_tree(rootdir);
+    return test_failed;
+}
+#else
+int main(void)
+{
+    puts("skipped: inotify backend only");
+    return 0;
+}
+#endif // DMON_OS_INOTIFY
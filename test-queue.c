@@ -0,0 +1,129 @@
+#include <stdio.h>
+
+// a small queue, so the test can fill it
+#define DMON_QUEUE_SIZE 16
+#define DMON_IMPL
+#include "dmon.h"
+
+// checks the event queue of dmon_watch_queue: the order of the events, the events that are dropped when the queue
+// is full, and the timeout of dmon_wait_events
+
+#if DMON_OS_INOTIFY
+#include "dmon_extra.h"
+#include "test_util.h"
+
+static uint64_t test_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void test_create_files(const char* rootdir, const char* prefix, int count)
+{
+    char path[DMON_MAX_PATH];
+    int i;
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/%s%02d", rootdir, prefix, i);
+        FILE* f = fopen(path, "w");
+        if (f) {
+            fclose(f);
+        }
+    }
+}
+
+// the events must be the creates of prefix00, prefix01, ... in order
+static bool test_in_order(const dmon_queued_event* events, int count, const char* prefix)
+{
+    char name[64];
+    int i;
+    for (i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "%s%02d", prefix, i);
+        if (events[i].action != DMON_ACTION_CREATE || strcmp(events[i].filepath, name) != 0) {
+            printf("event %d: %d %s, expected CREATE %s\n", i, events[i].action, events[i].filepath, name);
+            return false;
+        }
+    }
+    return true;
+}
+
+// pulls events until there are count of them, or nothing comes for a second
+static int test_pull(dmon_queued_event* events, int count)
+{
+    int num = 0, n;
+    while (num < count && (n = dmon_wait_events(events + num, count - num, 1000)) > 0) {
+        num += n;
+    }
+    return num;
+}
+
+static void* test_wait_thread(void* arg)
+{
+    dmon_queued_event ev;
+    *(int*)arg = dmon_wait_events(&ev, 1, 5000);
+    return NULL;
+}
+
+int main(void)
+{
+    char rootdir[] = "/tmp/dmon_test_XXXXXX";
+    if (mkdtemp(rootdir) == NULL) {
+        puts("could not create temp directory");
+        return 1;
+    }
+
+    dmon_init();
+    dmon_watch_id id = dmon_watch_queue(rootdir, 0, NULL);
+    test_check("watch", id.id != 0);
+
+    dmon_queued_event events[64];
+    uint64_t start = test_now_ms();
+    int n = dmon_wait_events(events, 64, 300);
+    uint64_t elapsed = test_now_ms() - start;
+    test_check("wait times out with no events", n == 0 && elapsed >= 250 && elapsed < 3000);
+    test_check("poll doesn't block", dmon_poll_events(events, 64) == 0);
+
+    test_create_files(rootdir, "a", 10);
+    n = test_pull(events, 64);
+    test_check("events come in order", n == 10 && test_in_order(events, n, "a"));
+    test_check("same watch id", n > 0 && events[0].watch_id.id == id.id);
+
+    // nobody pulls, so the queue is filled up and the rest is dropped
+    test_create_files(rootdir, "b", 40);
+    dmon_queue_info info;
+    int i;
+    for (i = 0; i < 50; i++) {
+        usleep(100000);
+        dmon_get_queue_info(&info);
+        if (info.count + (int)info.dropped >= 40) {
+            break;
+        }
+    }
+    test_check("queue info", info.capacity == DMON_QUEUE_SIZE && info.count == DMON_QUEUE_SIZE && info.dropped == 24);
+    n = dmon_poll_events(events, 64);
+    test_check("the first events are kept", n == DMON_QUEUE_SIZE && test_in_order(events, n, "b"));
+    dmon_get_queue_info(&info);
+    test_check("queue is empty", info.count == 0 && info.dropped == 24);
+
+    // a waiting consumer is woken up by the event
+    pthread_t thread;
+    int woken = -1;
+    pthread_create(&thread, NULL, test_wait_thread, &woken);
+    usleep(200000);
+    start = test_now_ms();
+    test_create_files(rootdir, "c", 1);
+    pthread_join(thread, NULL);
+    elapsed = test_now_ms() - start;
+    test_check("waiting consumer is woken up", woken == 1 && elapsed < 3000);
+
+    dmon_deinit();
+    test_remove_tree(rootdir);
+    return test_failed;
+}
+#else
+int main(void)
+{
+    puts("skipped: inotify backend only");
+    return 0;
+}
+#endif // DMON_OS_INOTIFY